@@ -0,0 +1,472 @@
+// End-to-end benchmark of bloom_eval
+//
+// Loads the model once and sweeps the prompt length, the batch size used for the prompt, the number of generated
+// tokens and the thread count. For every combination it reports the prefill and decode throughput, the time to the
+// first token and the percentiles of the per token decode latency.
+//
+// usage:
+//
+//   ./bench -m model.bin -p 32,128 -b 8,32 -n 32,128 -t 8,16,48 [-r 3] [-o md|csv|json]
+//
+// The prompts are random token ids, so that the results do not depend on the tokenizer.
+//
+// --check-alloc runs the generation loop of main instead - sampling included - for the first prompt length, batch
+// size and generation length, and exits with 1 if the decode steps after the first one allocate heap memory.
+//
+
+#include "bloom.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// heap allocations of the process, for --check-alloc
+static std::atomic<int64_t> bench_n_alloc {0};
+
+#if defined(__GLIBC__)
+// glibc lets the program replace malloc, this counts the allocations of ggml too
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t n, size_t size);
+extern "C" void * __libc_realloc(void * ptr, size_t size);
+
+extern "C" void * malloc(size_t size) {
+    bench_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t n, size_t size) {
+    bench_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void * realloc(void * ptr, size_t size) {
+    bench_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#else
+// the C++ allocations only
+void * operator new(size_t size) {
+    bench_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    std::free(ptr);
+}
+#endif
+
+struct bench_params {
+    std::string model = "models/ggml-model-bloomz-7b1-f16-q4_0.bin";
+
+    std::vector<int> n_prompt  = { 32, 128 };
+    std::vector<int> n_batch   = { 8 };
+    std::vector<int> n_gen     = { 32 };
+    std::vector<int> n_threads = { std::min(4, (int32_t) std::thread::hardware_concurrency()) };
+
+    int n_ctx  = 512;
+    int n_reps = 1;
+    int seed   = 1234;
+
+    std::string output = "md";
+
+    bool check_alloc = false;
+};
+
+struct bench_result {
+    int n_threads;
+    int n_batch;
+    int n_prompt;
+    int n_gen;
+
+    double prefill_tps;
+    double decode_tps;
+    double ttft_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+};
+
+static std::vector<int> parse_list(const char * arg) {
+    std::vector<int> values;
+
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(std::stoi(item));
+    }
+
+    return values;
+}
+
+static void print_usage(const char * argv0, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -p N,N,..             prompt lengths in tokens\n");
+    fprintf(stderr, "  -b N,N,..             batch sizes for the prompt processing, 0 to tune it for the model and threads\n");
+    fprintf(stderr, "  -n N,N,..             numbers of tokens to generate\n");
+    fprintf(stderr, "  -t N,N,..             thread counts\n");
+    fprintf(stderr, "  -c N, --ctx N         context size (default: %d)\n", params.n_ctx);
+    fprintf(stderr, "  -r N, --reps N        repetitions of every combination (default: %d)\n", params.n_reps);
+    fprintf(stderr, "  -s N, --seed N        seed of the random prompts (default: %d)\n", params.seed);
+    fprintf(stderr, "  -o FMT, --output FMT  output format: md, csv or json (default: %s)\n", params.output.c_str());
+    fprintf(stderr, "  --check-alloc         check that the decode steps of the generation loop do not allocate, no timing\n");
+    fprintf(stderr, "\n");
+}
+
+static bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0], params);
+            exit(0);
+        }
+
+        if (arg == "--check-alloc") {
+            params.check_alloc = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-p") {
+            params.n_prompt = parse_list(argv[++i]);
+        } else if (arg == "-b") {
+            params.n_batch = parse_list(argv[++i]);
+        } else if (arg == "-n") {
+            params.n_gen = parse_list(argv[++i]);
+        } else if (arg == "-t") {
+            params.n_threads = parse_list(argv[++i]);
+        } else if (arg == "-c" || arg == "--ctx") {
+            params.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "-r" || arg == "--reps") {
+            params.n_reps = std::stoi(argv[++i]);
+        } else if (arg == "-s" || arg == "--seed") {
+            params.seed = std::stoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            params.output = argv[++i];
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0], params);
+            return false;
+        }
+    }
+
+    if (params.output != "md" && params.output != "csv" && params.output != "json") {
+        fprintf(stderr, "error: unknown output format: %s\n", params.output.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// nearest rank
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    const size_t rank = std::min(values.size() - 1, (size_t) (p/100.0*values.size()));
+
+    return values[rank];
+}
+
+static gpt_vocab::id argmax(const std::vector<float> & logits, int n_vocab) {
+    const float * p = logits.data() + (logits.size() - n_vocab);
+
+    return std::max_element(p, p + n_vocab) - p;
+}
+
+static bool bench_run(
+        const bloom_model & model,
+        const std::vector<gpt_vocab::id> & prompt,
+        int n_threads,
+        int n_batch,
+        int n_gen,
+        int n_reps,
+        size_t & mem_per_token,
+        bench_result & result) {
+    const int n_vocab = model.hparams.n_vocab;
+
+    std::vector<float> logits;
+    std::vector<float> embeddings;
+
+    int64_t t_prefill_us = 0;
+    int64_t t_decode_us  = 0;
+    int     n_decoded    = 0;
+
+    std::vector<double> latencies_ms;
+
+    for (int rep = 0; rep < n_reps; ++rep) {
+        // the kv cache is simply overwritten from position 0
+        int n_past = 0;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        while (n_past < (int) prompt.size()) {
+            const int n = std::min(n_batch, (int) prompt.size() - n_past);
+            const std::vector<gpt_vocab::id> embd(prompt.begin() + n_past, prompt.begin() + n_past + n);
+
+            if (!bloom_eval(model, n_threads, n_past, embd, logits, embeddings, mem_per_token)) {
+                return false;
+            }
+
+            n_past += n;
+        }
+
+        // the first token is sampled from the logits of the last prompt token
+        gpt_vocab::id id = argmax(logits, n_vocab);
+
+        t_prefill_us += ggml_time_us() - t_start_us;
+
+        for (int i = 1; i < n_gen; ++i) {
+            const int64_t t_token_us = ggml_time_us();
+
+            const bloom_seq seq = { 0, n_past, &id, 1 };
+            if (!bloom_eval_batch(model, n_threads, &seq, 1, logits, embeddings, mem_per_token)) {
+                return false;
+            }
+            id = argmax(logits, n_vocab);
+
+            const int64_t t_us = ggml_time_us() - t_token_us;
+
+            latencies_ms.push_back(t_us/1000.0);
+            t_decode_us += t_us;
+            n_decoded   += 1;
+            n_past      += 1;
+        }
+    }
+
+    result.n_threads   = n_threads;
+    result.n_batch     = n_batch;
+    result.n_prompt    = prompt.size();
+    result.n_gen       = n_gen;
+    result.prefill_tps = 1e6*prompt.size()*n_reps/std::max<int64_t>(t_prefill_us, 1);
+    result.decode_tps  = n_decoded > 0 ? 1e6*n_decoded/std::max<int64_t>(t_decode_us, 1) : 0.0;
+    result.ttft_ms     = t_prefill_us/1000.0/n_reps;
+    result.p50_ms      = percentile(latencies_ms, 50);
+    result.p90_ms      = percentile(latencies_ms, 90);
+    result.p99_ms      = percentile(latencies_ms, 99);
+
+    return true;
+}
+
+// prefill the prompt, then sample and decode n_gen tokens like main, n_alloc is set to the number of heap allocations
+// of the decode steps after the first one - the buffers reach their size in the first one
+static bool bench_check_alloc(
+        const bloom_model & model,
+        const gpt_vocab & vocab,
+        const std::vector<gpt_vocab::id> & prompt,
+        int n_threads,
+        int n_batch,
+        int n_gen,
+        size_t & mem_per_token,
+        int64_t & n_alloc) {
+    const int n_vocab = model.hparams.n_vocab;
+
+    gpt_params params;
+    std::mt19937 rng(params.seed);
+
+    std::vector<float> logits;
+    std::vector<float> embeddings;
+
+    bloom_sampler_buf sampler;
+
+    // a ring buffer of the last tokens, as in main
+    std::vector<gpt_vocab::id> last_n_tokens(params.repeat_last_n, 0);
+    int i_last = 0;
+
+    int n_past = 0;
+    while (n_past < (int) prompt.size()) {
+        const bloom_seq seq = { 0, n_past, prompt.data() + n_past, std::min(n_batch, (int) prompt.size() - n_past) };
+        if (!bloom_eval_batch(model, n_threads, &seq, 1, logits, embeddings, mem_per_token)) {
+            return false;
+        }
+        n_past += seq.n_tokens;
+    }
+
+    int64_t n_alloc_start = 0;
+    for (int i = 0; i < n_gen; ++i) {
+        if (i == 1) {
+            n_alloc_start = bench_n_alloc.load();
+        }
+
+        gpt_vocab::id id = bloom_sample_top_p(vocab, logits.data() + (logits.size() - n_vocab), last_n_tokens,
+                params.repeat_penalty, params.top_p, params.top_k, params.temp, rng, sampler);
+
+        last_n_tokens[i_last] = id;
+        i_last = (i_last + 1) % last_n_tokens.size();
+
+        const bloom_seq seq = { 0, n_past, &id, 1 };
+        if (!bloom_eval_batch(model, n_threads, &seq, 1, logits, embeddings, mem_per_token)) {
+            return false;
+        }
+        n_past += 1;
+    }
+
+    n_alloc = n_gen > 1 ? bench_n_alloc.load() - n_alloc_start : 0;
+
+    return true;
+}
+
+static void print_results(const bench_params & params, const std::vector<bench_result> & results) {
+    if (params.output == "md") {
+        printf("| threads | n_batch | n_prompt | n_gen | prefill t/s | decode t/s | ttft ms | p50 ms | p90 ms | p99 ms |\n");
+        printf("| ---:    | ---:    | ---:     | ---:  | ---:        | ---:       | ---:    | ---:   | ---:   | ---:   |\n");
+        for (const auto & r : results) {
+            printf("| %7d | %7d | %8d | %5d | %11.2f | %10.2f | %7.2f | %6.2f | %6.2f | %6.2f |\n",
+                    r.n_threads, r.n_batch, r.n_prompt, r.n_gen, r.prefill_tps, r.decode_tps, r.ttft_ms, r.p50_ms, r.p90_ms, r.p99_ms);
+        }
+    } else if (params.output == "csv") {
+        printf("model,n_threads,n_batch,n_prompt,n_gen,prefill_tps,decode_tps,ttft_ms,p50_ms,p90_ms,p99_ms\n");
+        for (const auto & r : results) {
+            printf("\"%s\",%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", params.model.c_str(),
+                    r.n_threads, r.n_batch, r.n_prompt, r.n_gen, r.prefill_tps, r.decode_tps, r.ttft_ms, r.p50_ms, r.p90_ms, r.p99_ms);
+        }
+    } else {
+        printf("[\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto & r = results[i];
+            printf("  {\"model\": \"%s\", \"n_threads\": %d, \"n_batch\": %d, \"n_prompt\": %d, \"n_gen\": %d, "
+                    "\"prefill_tps\": %.3f, \"decode_tps\": %.3f, \"ttft_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+                    params.model.c_str(), r.n_threads, r.n_batch, r.n_prompt, r.n_gen,
+                    r.prefill_tps, r.decode_tps, r.ttft_ms, r.p50_ms, r.p90_ms, r.p99_ms, i + 1 < results.size() ? "," : "");
+        }
+        printf("]\n");
+    }
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    bench_params params;
+    if (!bench_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    gpt_vocab vocab;
+    bloom_model model;
+
+    // the progress goes to stderr, stdout only has the results
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!bloom_model_load(params.model, model, vocab, params.n_ctx)) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            return 1;
+        }
+
+        fprintf(stderr, "%s: model loaded in %.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0);
+    }
+
+    std::mt19937 rng(params.seed);
+
+    // skip the special tokens at the start of the vocab
+    std::uniform_int_distribution<int> dist(std::min(100, model.hparams.n_vocab - 1), model.hparams.n_vocab - 1);
+
+    std::vector<bench_result> results;
+
+    bool ok = true;
+
+    for (int n_threads : params.n_threads) {
+        // determine the required inference memory per token and warm up the threads
+        size_t mem_per_token = 0;
+        {
+            std::vector<float> logits;
+            std::vector<float> embeddings;
+            bloom_eval(model, n_threads, 0, { 0, 1, 2, 3 }, logits, embeddings, mem_per_token);
+        }
+
+        if (params.check_alloc) {
+            const int n_prompt = params.n_prompt[0];
+            const int n_batch  = params.n_batch[0] > 0 ? params.n_batch[0] : bloom_tune_n_batch(model, n_threads, mem_per_token);
+            const int n_gen    = params.n_gen[0];
+
+            if (n_prompt < 1 || n_batch < 1 || n_prompt + n_gen > model.hparams.n_ctx) {
+                fprintf(stderr, "%s: n_prompt = %d, n_batch = %d, n_gen = %d do not fit the context size %d\n",
+                        __func__, n_prompt, n_batch, n_gen, model.hparams.n_ctx);
+                return 1;
+            }
+
+            std::vector<gpt_vocab::id> prompt(n_prompt);
+            for (auto & id : prompt) {
+                id = dist(rng);
+            }
+
+            int64_t n_alloc = 0;
+            if (!bench_check_alloc(model, vocab, prompt, n_threads, n_batch, n_gen, mem_per_token, n_alloc)) {
+                fprintf(stderr, "%s: failed to eval\n", __func__);
+                return 1;
+            }
+
+            printf("n_threads = %d, n_prompt = %d, n_gen = %d: %" PRId64 " heap allocations in %d decode steps - %s\n",
+                    n_threads, n_prompt, n_gen, n_alloc, std::max(n_gen - 1, 0), n_alloc == 0 ? "ok" : "FAILED");
+
+            ok = ok && n_alloc == 0;
+            continue;
+        }
+
+        for (int n_prompt : params.n_prompt) {
+            std::vector<gpt_vocab::id> prompt(n_prompt);
+            for (auto & id : prompt) {
+                id = dist(rng);
+            }
+
+            for (int n_batch : params.n_batch) {
+                // 0 for the size picked by bloom_tune_n_batch
+                if (n_batch == 0) {
+                    n_batch = bloom_tune_n_batch(model, n_threads, mem_per_token);
+                }
+
+                for (int n_gen : params.n_gen) {
+                    if (n_prompt < 1 || n_batch < 1 || n_gen < 1 || n_prompt + n_gen > model.hparams.n_ctx) {
+                        fprintf(stderr, "%s: skipping n_prompt = %d, n_batch = %d, n_gen = %d (context size %d)\n",
+                                __func__, n_prompt, n_batch, n_gen, model.hparams.n_ctx);
+                        continue;
+                    }
+
+                    fprintf(stderr, "%s: n_threads = %d, n_batch = %d, n_prompt = %d, n_gen = %d\n", __func__, n_threads, n_batch, n_prompt, n_gen);
+
+                    bench_result result;
+                    if (!bench_run(model, prompt, n_threads, n_batch, n_gen, params.n_reps, mem_per_token, result)) {
+                        fprintf(stderr, "%s: failed to eval\n", __func__);
+                        return 1;
+                    }
+
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    if (!params.check_alloc) {
+        print_results(params, results);
+    }
+
+    ggml_free(model.ctx);
+
+    return ok ? 0 : 1;
+}
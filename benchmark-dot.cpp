@@ -0,0 +1,186 @@
+// Benchmark of the q4_0 and f16 dot product kernels with 64-byte aligned versus misaligned rows
+//
+// usage:
+//
+//   ./benchmark-dot [-k N] [-n N]
+//
+//   -k N   row length in elements (default: 4096)
+//   -n N   number of passes over each matrix (default: 16)
+//
+// Each kernel is run over a small matrix that stays in the cache and over a large one that has to be
+// streamed from memory. The misaligned rows start 16 bytes past a cache line, which is the worst case
+// that the default GGML_MEM_ALIGN allows.
+//
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const size_t CACHE_LINE = 64;
+
+struct bench_result {
+    double ns_per_row;
+    double gb_per_s;
+    float  sum;
+};
+
+// rows of row_size bytes, row_stride apart, the first one at offs bytes past a cache line
+struct bench_matrix {
+    std::vector<uint8_t> buf;
+    uint8_t * data;
+    size_t    row_stride;
+    int       n_rows;
+};
+
+static void matrix_init(bench_matrix & m, size_t row_size, int n_rows, size_t offs) {
+    m.row_stride = ((row_size + CACHE_LINE - 1)/CACHE_LINE)*CACHE_LINE;
+    m.n_rows     = n_rows;
+    m.buf.resize(m.row_stride*n_rows + 2*CACHE_LINE);
+
+    const uintptr_t base = (uintptr_t) m.buf.data();
+    m.data = m.buf.data() + (CACHE_LINE - base%CACHE_LINE)%CACHE_LINE + offs;
+}
+
+template <typename F>
+static bench_result run(const bench_matrix & m, size_t row_size, int n_pass, F dot) {
+    float sum = 0.0f;
+
+    // warm up
+    for (int i = 0; i < m.n_rows; ++i) {
+        sum += dot(m.data + i*m.row_stride);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int p = 0; p < n_pass; ++p) {
+        for (int i = 0; i < m.n_rows; ++i) {
+            sum += dot(m.data + i*m.row_stride);
+        }
+    }
+
+    const int64_t t_us = std::max<int64_t>(ggml_time_us() - t_start_us, 1);
+
+    const double n_rows = (double) m.n_rows*n_pass;
+
+    return { 1e3*t_us/n_rows, row_size*n_rows/(1e3*t_us), sum };
+}
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s [-k N] [-n N]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -k N   row length in elements (default: 4096)\n");
+    fprintf(stderr, "  -n N   number of passes over each matrix (default: 16)\n");
+}
+
+int main(int argc, char ** argv) {
+    int k      = 4096;
+    int n_pass = 16;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-k" && i + 1 < argc) {
+            k = std::stoi(argv[++i]);
+        } else if (arg == "-n" && i + 1 < argc) {
+            n_pass = std::stoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const quantize_fns_t fns_q4_0 = ggml_internal_get_quantize_fn(GGML_TYPE_Q4_0);
+    const enum ggml_type type_dot = fns_q4_0.vec_dot_type;
+
+    const int qk = ggml_blck_size(GGML_TYPE_Q4_0);
+    if (k <= 0 || k % (2*qk) != 0) {
+        fprintf(stderr, "%s: the row length must be a multiple of %d\n", __func__, 2*qk);
+        return 1;
+    }
+
+    ggml_time_init();
+
+    // the ggml context is only needed to initialize the f16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false, 0 };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    srand(1234);
+
+    std::vector<float> x(k);
+    std::vector<float> y(k);
+    for (int i = 0; i < k; ++i) {
+        x[i] = 2.0f*rand()/RAND_MAX - 1.0f;
+        y[i] = 2.0f*rand()/RAND_MAX - 1.0f;
+    }
+
+    const size_t row_size_q4_0 = ggml_type_size(GGML_TYPE_Q4_0)*k/qk;
+    const size_t row_size_f16  = sizeof(ggml_fp16_t)*k;
+
+    // the activations are always aligned, only the weight rows move
+    bench_matrix y_q; matrix_init(y_q, ggml_type_size(type_dot)*k/ggml_blck_size(type_dot), 1, 0);
+    bench_matrix y_h; matrix_init(y_h, row_size_f16, 1, 0);
+
+    fns_q4_0.quantize_row_q_dot(y.data(), y_q.data, k);
+    ggml_fp32_to_fp16_row(y.data(), (ggml_fp16_t *) y_h.data, k);
+
+    const size_t sizes[] = { 256*1024, 256*1024*1024 };
+    const char * names[] = { "cache", "memory" };
+    const size_t offsets[] = { 0, 16 };
+
+    printf("%s: k = %d, passes = %d, avx512 = %d\n", __func__, k, n_pass, ggml_cpu_has_avx512());
+    printf("\n");
+    printf("| kernel | working set | row offset | rows  | ns/row   | GB/s   |\n");
+    printf("| ---    | ---         | ---        | ---   | ---      | ---    |\n");
+
+    for (int is = 0; is < 2; ++is) {
+        for (int io = 0; io < 2; ++io) {
+            // q4_0 x q8_0
+            {
+                const int n_rows = std::max<int>(1, sizes[is]/row_size_q4_0);
+
+                bench_matrix m; matrix_init(m, row_size_q4_0, n_rows, offsets[io]);
+                for (int i = 0; i < n_rows; ++i) {
+                    fns_q4_0.quantize_row_q(x.data(), m.data + i*m.row_stride, k);
+                }
+
+                const bench_result r = run(m, row_size_q4_0, is == 0 ? 8*n_pass : n_pass, [&](const uint8_t * row) {
+                    float s;
+                    fns_q4_0.vec_dot_q(k, &s, row, y_q.data);
+                    return s;
+                });
+
+                printf("| q4_0   | %-11s | %10zu | %5d | %8.1f | %6.2f |\n", names[is], offsets[io], n_rows, r.ns_per_row, r.gb_per_s);
+            }
+
+            // f16 x f16
+            {
+                const int n_rows = std::max<int>(1, sizes[is]/row_size_f16);
+
+                bench_matrix m; matrix_init(m, row_size_f16, n_rows, offsets[io]);
+                for (int i = 0; i < n_rows; ++i) {
+                    ggml_fp32_to_fp16_row(x.data(), (ggml_fp16_t *) (m.data + i*m.row_stride), k);
+                }
+
+                const bench_result r = run(m, row_size_f16, is == 0 ? 8*n_pass : n_pass, [&](const uint8_t * row) {
+                    float s;
+                    ggml_internal_vec_dot_f16(k, &s, (const ggml_fp16_t *) row, (const ggml_fp16_t *) y_h.data);
+                    return s;
+                });
+
+                printf("| f16    | %-11s | %10zu | %5d | %8.1f | %6.2f |\n", names[is], offsets[io], n_rows, r.ns_per_row, r.gb_per_s);
+            }
+        }
+    }
+
+    return 0;
+}
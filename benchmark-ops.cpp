@@ -0,0 +1,718 @@
+// Microbenchmark and correctness check of the ggml ops used by bloom_eval, at the shapes of the BLOOM models
+//
+// usage:
+//
+//   ./benchmark-ops [-e N,N,..] [-N N,N,..] [-t N,N,..] [-r N] [-o op,op,..] [--check]
+//
+// For every n_embd the following cases are run:
+//
+//   mul_mat   q4_0, q4_1 and f16 weights: qkv, wo, ffn_up, ffn_down and lm_head (n_vocab rows)
+//   get_rows  q4_0, q4_1 and f16 token embeddings
+//   norm      [n_embd, N]
+//   gelu      [4*n_embd, N]
+//   alibi     [n_past + N, N, n_head]
+//   soft_max  [n_past + N, N, n_head]
+//
+// Each case is computed once per thread count and compared against a scalar reference in double precision,
+// then timed over a number of repetitions. The error is the normalized mean squared error of the output. The
+// reference of the large matrix multiplications only covers a strided subset of the output rows.
+//
+// --check runs the same cases at small shapes, which takes a few seconds, and exits with 1 on a mismatch.
+//
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct ops_params {
+    std::vector<int> n_embd    = { 1024, 2048, 4096, 14336 };
+    std::vector<int> n_tokens  = { 1, 32 };
+    std::vector<int> n_threads;
+
+    std::vector<std::string> ops; // empty for all
+
+    int n_vocab = 250880;
+    int n_past  = 128;
+    int n_reps  = 10;
+
+    bool check = false;
+};
+
+// reference values of a subset of the output elements
+typedef std::vector<std::pair<int64_t, double>> ref_values;
+
+struct op_case {
+    std::string op;
+    std::string name;
+    std::string shape;
+
+    enum ggml_type type;
+
+    double bytes; // read and written by the op
+    double flops; // 0 if not meaningful
+    double max_err;
+
+    // upper bounds of the memory of the tensors and of the work buffer of the graph (per thread)
+    size_t mem_size;
+    size_t work_size;
+
+    // creates the inputs and returns the output, the inputs are filled by the caller
+    std::function<struct ggml_tensor * (struct ggml_context *, std::vector<struct ggml_tensor *> &)> build;
+
+    std::function<void (const std::vector<struct ggml_tensor *> &, ref_values &)> ref;
+};
+
+//
+// helpers
+//
+
+// xorshift, rand() is too slow to fill the lm_head of the large models
+struct ops_rng {
+    uint64_t s = 0x2545f4914f6cdd1dull;
+
+    float uniform(float a, float b) {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return a + (b - a)*((s >> 40)*(1.0f/16777216.0f));
+    }
+};
+
+static size_t tensor_size(enum ggml_type type, int64_t ne0, int64_t ne1 = 1, int64_t ne2 = 1) {
+    return ggml_type_size(type)*(ne0/ggml_blck_size(type))*ne1*ne2;
+}
+
+static void fill_f32(struct ggml_tensor * t, ops_rng & rng, float a, float b) {
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = rng.uniform(a, b);
+    }
+}
+
+// fill a 2d tensor of any type row by row
+static void fill_rows(struct ggml_tensor * t, ops_rng & rng) {
+    const int64_t ne0 = t->ne[0];
+
+    std::vector<float> row(ne0);
+
+    for (int64_t i1 = 0; i1 < t->ne[1]; ++i1) {
+        for (int64_t i0 = 0; i0 < ne0; ++i0) {
+            row[i0] = rng.uniform(-1.0f, 1.0f);
+        }
+
+        char * dst = (char *) t->data + i1*t->nb[1];
+
+        switch (t->type) {
+            case GGML_TYPE_F32: memcpy(dst, row.data(), ne0*sizeof(float)); break;
+            case GGML_TYPE_F16: ggml_fp32_to_fp16_row(row.data(), (ggml_fp16_t *) dst, ne0); break;
+            default:            ggml_internal_get_quantize_fn(t->type).quantize_row_q(row.data(), dst, ne0); break;
+        }
+    }
+}
+
+static void row_to_f32(const struct ggml_tensor * t, int64_t i1, float * dst) {
+    const int64_t ne0 = t->ne[0];
+    const char * src = (const char *) t->data + i1*t->nb[1];
+
+    switch (t->type) {
+        case GGML_TYPE_F32: memcpy(dst, src, ne0*sizeof(float)); break;
+        case GGML_TYPE_F16: ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, ne0); break;
+        default:            ggml_internal_get_quantize_fn(t->type).dequantize_row_q(src, dst, ne0); break;
+    }
+}
+
+static std::string shape_str(int64_t ne0, int64_t ne1, int64_t ne2 = 1) {
+    char buf[64];
+    if (ne2 == 1) {
+        snprintf(buf, sizeof(buf), "%lld x %lld", (long long) ne0, (long long) ne1);
+    } else {
+        snprintf(buf, sizeof(buf), "%lld x %lld x %lld", (long long) ne0, (long long) ne1, (long long) ne2);
+    }
+    return buf;
+}
+
+//
+// cases
+//
+
+// w: [K, M], x: [K, N] -> [M, N]
+static op_case case_mul_mat(const char * name, enum ggml_type type, int K, int M, int N) {
+    op_case c;
+
+    c.op        = "mul_mat";
+    c.name      = name;
+    c.shape     = shape_str(K, M) + " * " + shape_str(K, N);
+    c.type      = type;
+    c.flops     = 2.0*K*M*N;
+    c.max_err   = type == GGML_TYPE_F16 ? 1e-5 : 1e-3;
+    c.mem_size  = tensor_size(type, K, M) + tensor_size(GGML_TYPE_F32, K, N) + tensor_size(GGML_TYPE_F32, M, N);
+    c.bytes     = c.mem_size;
+    c.work_size = tensor_size(GGML_TYPE_F32, K, N);
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * w = ggml_new_tensor_2d(ctx, type,          K, M);
+        struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, N);
+
+        inputs = { w, x };
+
+        return ggml_mul_mat(ctx, w, x);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const struct ggml_tensor * w = inputs[0];
+        const float * x = (const float *) inputs[1]->data;
+
+        // keep the reference of the large matrices to about 2^28 multiply-adds
+        const int64_t stride = std::max<int64_t>(1, ((int64_t) K*M*N) >> 28) | 1;
+
+        std::vector<float> row(K);
+
+        for (int64_t m = 0; m < M; m += stride) {
+            row_to_f32(w, m, row.data());
+
+            for (int64_t n = 0; n < N; ++n) {
+                double sum = 0.0;
+                for (int64_t k = 0; k < K; ++k) {
+                    sum += (double) row[k]*x[n*K + k];
+                }
+                ref.push_back({ n*M + m, sum });
+            }
+        }
+    };
+
+    return c;
+}
+
+// embd: [E, V], ids: [N] -> [E, N]
+static op_case case_get_rows(enum ggml_type type, int E, int V, int N) {
+    op_case c;
+
+    c.op        = "get_rows";
+    c.name      = "tok_embeddings";
+    c.shape     = shape_str(E, V) + " [" + std::to_string(N) + "]";
+    c.type      = type;
+    c.flops     = 0.0;
+    c.max_err   = 1e-10;
+    c.mem_size  = tensor_size(type, E, V) + tensor_size(GGML_TYPE_I32, N) + tensor_size(GGML_TYPE_F32, E, N);
+    c.bytes     = tensor_size(type, E, N) + tensor_size(GGML_TYPE_F32, E, N); // only N rows of the table are read
+    c.work_size = 0;
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * embd = ggml_new_tensor_2d(ctx, type, E, V);
+        struct ggml_tensor * ids  = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, N);
+
+        inputs = { embd, ids };
+
+        return ggml_get_rows(ctx, embd, ids);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const int32_t * ids = (const int32_t *) inputs[1]->data;
+
+        std::vector<float> row(E);
+
+        for (int64_t n = 0; n < N; ++n) {
+            row_to_f32(inputs[0], ids[n], row.data());
+
+            for (int64_t i = 0; i < E; ++i) {
+                ref.push_back({ n*E + i, row[i] });
+            }
+        }
+    };
+
+    return c;
+}
+
+// x: [E, N]
+static op_case case_norm(int E, int N) {
+    op_case c;
+
+    c.op        = "norm";
+    c.name      = "ln";
+    c.shape     = shape_str(E, N);
+    c.type      = GGML_TYPE_F32;
+    c.flops     = 0.0;
+    c.max_err   = 1e-8;
+    c.mem_size  = 2*tensor_size(GGML_TYPE_F32, E, N);
+    c.bytes     = c.mem_size;
+    c.work_size = 0;
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, E, N);
+
+        inputs = { x };
+
+        return ggml_norm(ctx, x);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const float * x = (const float *) inputs[0]->data;
+
+        for (int64_t n = 0; n < N; ++n) {
+            const float * xn = x + n*E;
+
+            double mean = 0.0;
+            for (int64_t i = 0; i < E; ++i) {
+                mean += xn[i];
+            }
+            mean /= E;
+
+            double var = 0.0;
+            for (int64_t i = 0; i < E; ++i) {
+                var += (xn[i] - mean)*(xn[i] - mean);
+            }
+            var /= E;
+
+            const double scale = 1.0/sqrt(var + 1e-5);
+
+            for (int64_t i = 0; i < E; ++i) {
+                ref.push_back({ n*E + i, (xn[i] - mean)*scale });
+            }
+        }
+    };
+
+    return c;
+}
+
+// x: [F, N]
+static op_case case_gelu(int F, int N) {
+    op_case c;
+
+    c.op        = "gelu";
+    c.name      = "ffn";
+    c.shape     = shape_str(F, N);
+    c.type      = GGML_TYPE_F32;
+    c.flops     = 0.0;
+    c.max_err   = 1e-5; // the gelu is looked up in an fp16 table
+    c.mem_size  = 2*tensor_size(GGML_TYPE_F32, F, N);
+    c.bytes     = c.mem_size;
+    c.work_size = 0;
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, F, N);
+
+        inputs = { x };
+
+        return ggml_gelu(ctx, x);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const float * x = (const float *) inputs[0]->data;
+
+        for (int64_t i = 0; i < (int64_t) F*N; ++i) {
+            const double v = x[i];
+            ref.push_back({ i, 0.5*v*(1.0 + tanh(sqrt(2.0/M_PI)*v*(1.0 + 0.044715*v*v))) });
+        }
+    };
+
+    return c;
+}
+
+// KQ: [n_past + N, N, n_head]
+static op_case case_alibi(int n_past, int N, int n_head) {
+    const int L = n_past + N;
+
+    op_case c;
+
+    c.op        = "alibi";
+    c.name      = "KQ_scaled";
+    c.shape     = shape_str(L, N, n_head);
+    c.type      = GGML_TYPE_F32;
+    c.flops     = 0.0;
+    c.max_err   = 1e-8;
+    c.mem_size  = tensor_size(GGML_TYPE_F32, L, N, n_head);
+    c.bytes     = c.mem_size;
+    c.work_size = 0;
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * x = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, L, N, n_head);
+
+        inputs = { x };
+
+        // same bias as bloom_eval
+        return ggml_alibi(ctx, x, n_past, n_head, 8.0f);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const float * x = (const float *) inputs[0]->data;
+
+        const int n_heads_log2_floor = 1 << (int) floor(log2(n_head));
+
+        const double m0 = pow(2.0, -8.0/n_heads_log2_floor);
+        const double m1 = pow(2.0, -4.0/n_heads_log2_floor);
+
+        for (int64_t h = 0; h < n_head; ++h) {
+            const double m = h < n_heads_log2_floor ? pow(m0, h + 1) : pow(m1, 2*(h - n_heads_log2_floor) + 1);
+
+            for (int64_t j = 0; j < N; ++j) {
+                for (int64_t i = 0; i < L; ++i) {
+                    const int64_t idx = (h*N + j)*L + i;
+                    ref.push_back({ idx, x[idx] + (i - L + 1)*m });
+                }
+            }
+        }
+    };
+
+    return c;
+}
+
+// KQ_masked: [n_past + N, N, n_head]
+static op_case case_soft_max(int n_past, int N, int n_head) {
+    const int L = n_past + N;
+
+    op_case c;
+
+    c.op        = "soft_max";
+    c.name      = "KQ_masked";
+    c.shape     = shape_str(L, N, n_head);
+    c.type      = GGML_TYPE_F32;
+    c.flops     = 0.0;
+    c.max_err   = 1e-5; // the exp is looked up in an fp16 table
+    c.mem_size  = 2*tensor_size(GGML_TYPE_F32, L, N, n_head);
+    c.bytes     = c.mem_size;
+    c.work_size = tensor_size(GGML_TYPE_F32, L);
+
+    c.build = [=](struct ggml_context * ctx, std::vector<struct ggml_tensor *> & inputs) {
+        struct ggml_tensor * x = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, L, N, n_head);
+
+        inputs = { x };
+
+        return ggml_soft_max(ctx, x);
+    };
+
+    c.ref = [=](const std::vector<struct ggml_tensor *> & inputs, ref_values & ref) {
+        const float * x = (const float *) inputs[0]->data;
+
+        for (int64_t r = 0; r < (int64_t) N*n_head; ++r) {
+            const float * xr = x + r*L;
+
+            double max = -INFINITY;
+            for (int64_t i = 0; i < L; ++i) {
+                max = std::max(max, (double) xr[i]);
+            }
+
+            double sum = 0.0;
+            for (int64_t i = 0; i < L; ++i) {
+                sum += exp(xr[i] - max);
+            }
+
+            for (int64_t i = 0; i < L; ++i) {
+                ref.push_back({ r*L + i, exp(xr[i] - max)/sum });
+            }
+        }
+    };
+
+    return c;
+}
+
+static int n_head_of(int n_embd) {
+    // bloom-560m has 64-dim heads, the larger models 128-dim heads
+    return n_embd <= 1024 ? n_embd/64 : n_embd/128;
+}
+
+static std::vector<op_case> make_cases(const ops_params & params) {
+    const enum ggml_type wtypes[] = { GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_F16 };
+
+    std::vector<op_case> cases;
+
+    for (int E : params.n_embd) {
+        const int n_head = n_head_of(E);
+
+        for (int N : params.n_tokens) {
+            for (enum ggml_type type : wtypes) {
+                cases.push_back(case_mul_mat("qkv",      type,   E, 3*E, N));
+                cases.push_back(case_mul_mat("wo",       type,   E,   E, N));
+                cases.push_back(case_mul_mat("ffn_up",   type,   E, 4*E, N));
+                cases.push_back(case_mul_mat("ffn_down", type, 4*E,   E, N));
+                cases.push_back(case_mul_mat("lm_head",  type,   E, params.n_vocab, N));
+            }
+
+            for (enum ggml_type type : wtypes) {
+                cases.push_back(case_get_rows(type, E, params.n_vocab, N));
+            }
+
+            cases.push_back(case_norm(E, N));
+            cases.push_back(case_gelu(4*E, N));
+            cases.push_back(case_alibi   (params.n_past, N, n_head));
+            cases.push_back(case_soft_max(params.n_past, N, n_head));
+        }
+    }
+
+    if (!params.ops.empty()) {
+        cases.erase(std::remove_if(cases.begin(), cases.end(), [&](const op_case & c) {
+            return std::find(params.ops.begin(), params.ops.end(), c.op) == params.ops.end();
+        }), cases.end());
+    }
+
+    return cases;
+}
+
+//
+// runner
+//
+
+struct op_result {
+    int    n_threads;
+    double us;
+    double nmse;
+};
+
+static bool run_case(const op_case & c, const ops_params & params, ops_rng & rng, std::vector<op_result> & results) {
+    struct ggml_init_params ip = {
+        /*.mem_size   =*/ c.mem_size + 1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+        /*.data_align =*/ 0,
+    };
+
+    struct ggml_context * ctx = ggml_init(ip);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes for %s %s\n", __func__, ip.mem_size, c.op.c_str(), c.name.c_str());
+        return false;
+    }
+
+    std::vector<struct ggml_tensor *> inputs;
+    struct ggml_tensor * out = c.build(ctx, inputs);
+
+    for (struct ggml_tensor * t : inputs) {
+        if (t->type == GGML_TYPE_I32) {
+            // token ids, the first input is the table
+            for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+                ((int32_t *) t->data)[i] = (int32_t) rng.uniform(0.0f, (float) inputs[0]->ne[1] - 1);
+            }
+        } else if (t->type != GGML_TYPE_F32) {
+            fill_rows(t, rng);
+        } else {
+            // the attention scores have a wider range than the activations
+            const float range = c.op == "alibi" || c.op == "soft_max" ? 8.0f : 1.0f;
+            fill_f32(t, rng, -range, range);
+        }
+    }
+
+    // the inputs are restored before every checked run, alibi works in place
+    std::vector<std::vector<char>> saved;
+    for (struct ggml_tensor * t : inputs) {
+        saved.emplace_back((char *) t->data, (char *) t->data + ggml_nbytes(t));
+    }
+
+    ref_values ref;
+    c.ref(inputs, ref);
+
+    for (int n_threads : params.n_threads) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            memcpy(inputs[i]->data, saved[i].data(), saved[i].size());
+        }
+
+        // the work buffer of every graph goes into its own context
+        struct ggml_init_params wp = {
+            /*.mem_size   =*/ (n_threads + 1)*c.work_size + 1024*1024,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ false,
+            /*.data_align =*/ 0,
+        };
+
+        struct ggml_context * ctx_work = ggml_init(wp);
+
+        struct ggml_cgraph gf = ggml_build_forward(out);
+        gf.n_threads = n_threads;
+
+        ggml_graph_compute(ctx_work, &gf);
+
+        double err = 0.0;
+        double sum = 0.0;
+        for (const auto & r : ref) {
+            const double d = ((const float *) out->data)[r.first] - r.second;
+            err += d*d;
+            sum += r.second*r.second;
+        }
+
+        std::vector<double> times_us;
+        for (int rep = 0; rep < params.n_reps; ++rep) {
+            const int64_t t_start_us = ggml_time_us();
+            ggml_graph_compute(ctx_work, &gf);
+            times_us.push_back(ggml_time_us() - t_start_us);
+        }
+
+        std::sort(times_us.begin(), times_us.end());
+
+        op_result r;
+        r.n_threads = n_threads;
+        r.us        = times_us.empty() ? 0.0 : times_us[times_us.size()/2];
+        r.nmse      = sum > 0.0 ? err/sum : err;
+
+        results.push_back(r);
+
+        ggml_free(ctx_work);
+    }
+
+    ggml_free(ctx);
+
+    return true;
+}
+
+static std::vector<int> parse_list(const char * arg) {
+    std::vector<int> values;
+
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(std::stoi(item));
+    }
+
+    return values;
+}
+
+static std::vector<std::string> parse_str_list(const char * arg) {
+    std::vector<std::string> values;
+
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(item);
+    }
+
+    return values;
+}
+
+static void print_usage(const char * argv0, const ops_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -e N,N,..             n_embd values (default: 1024,2048,4096,14336)\n");
+    fprintf(stderr, "  -N N,N,..             numbers of tokens (default: 1,32)\n");
+    fprintf(stderr, "  -t N,N,..             thread counts (default: powers of 2 up to the number of cores)\n");
+    fprintf(stderr, "  -o OP,OP,..           ops to run: mul_mat, get_rows, norm, gelu, alibi, soft_max (default: all)\n");
+    fprintf(stderr, "  -V N                  vocab size (default: %d)\n", params.n_vocab);
+    fprintf(stderr, "  -P N                  n_past of the attention ops (default: %d)\n", params.n_past);
+    fprintf(stderr, "  -r N                  timed repetitions (default: %d)\n", params.n_reps);
+    fprintf(stderr, "  --check               check all ops at small shapes, no timing\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    ops_params params;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0], params);
+            return 0;
+        } else if (arg == "--check") {
+            params.check = true;
+        } else if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return 1;
+        } else if (arg == "-e") {
+            params.n_embd = parse_list(argv[++i]);
+        } else if (arg == "-N") {
+            params.n_tokens = parse_list(argv[++i]);
+        } else if (arg == "-t") {
+            params.n_threads = parse_list(argv[++i]);
+        } else if (arg == "-o") {
+            params.ops = parse_str_list(argv[++i]);
+        } else if (arg == "-V") {
+            params.n_vocab = std::stoi(argv[++i]);
+        } else if (arg == "-P") {
+            params.n_past = std::stoi(argv[++i]);
+        } else if (arg == "-r") {
+            params.n_reps = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0], params);
+            return 1;
+        }
+    }
+
+    if (params.check) {
+        // small enough to run in a few seconds, the thread counts cover the uneven splits of the rows
+        params.n_embd    = { 256 };
+        params.n_tokens  = { 1, 7 };
+        params.n_threads = { 1, 2, 3, 4 };
+        params.n_vocab   = 1000;
+        params.n_past    = 9;
+        params.n_reps    = 0;
+    }
+
+    if (params.n_threads.empty()) {
+        const int n_cores = std::max(1, (int) std::thread::hardware_concurrency());
+        for (int n = 1; n < n_cores; n *= 2) {
+            params.n_threads.push_back(n);
+        }
+        params.n_threads.push_back(n_cores);
+    }
+
+    for (int E : params.n_embd) {
+        if (E <= 0 || E % 64 != 0) {
+            fprintf(stderr, "%s: n_embd must be a multiple of 64\n", __func__);
+            return 1;
+        }
+    }
+
+    // initialize the f16 tables
+    {
+        struct ggml_init_params ip = { 0, NULL, false, 0 };
+        struct ggml_context * ctx = ggml_init(ip);
+        ggml_free(ctx);
+    }
+
+    const std::vector<op_case> cases = make_cases(params);
+
+    ops_rng rng;
+
+    int n_failed = 0;
+
+    printf("| op       | name           | type | shape                          | threads | us/run     | GB/s   | GFLOPS  | nmse     | ok   |\n");
+    printf("| ---      | ---            | ---  | ---                            | ---:    | ---:       | ---:   | ---:    | ---:     | ---  |\n");
+
+    for (const auto & c : cases) {
+        fprintf(stderr, "%s: %s %s %s %s\n", __func__, c.op.c_str(), c.name.c_str(), ggml_type_name(c.type), c.shape.c_str());
+
+        std::vector<op_result> results;
+        if (!run_case(c, params, rng, results)) {
+            return 1;
+        }
+
+        for (const auto & r : results) {
+            const bool ok = r.nmse <= c.max_err;
+            n_failed += ok ? 0 : 1;
+
+            char us[32]     = "-";
+            char gbps[32]   = "-";
+            char gflops[32] = "-";
+            if (r.us > 0.0) {
+                snprintf(us,   sizeof(us),   "%.1f", r.us);
+                snprintf(gbps, sizeof(gbps), "%.2f", c.bytes/(1e3*r.us));
+                if (c.flops > 0.0) {
+                    snprintf(gflops, sizeof(gflops), "%.2f", c.flops/(1e3*r.us));
+                }
+            }
+
+            printf("| %-8s | %-14s | %-4s | %-30s | %7d | %10s | %6s | %7s | %8.2e | %-4s |\n",
+                    c.op.c_str(), c.name.c_str(), ggml_type_name(c.type), c.shape.c_str(),
+                    r.n_threads, us, gbps, gflops, r.nmse, ok ? "ok" : "FAIL");
+            fflush(stdout);
+        }
+    }
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s: %d of the runs do not match the reference\n", __func__, n_failed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,16 +1,27 @@
 #include "bloom.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cinttypes>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #elif defined (_WIN32)
 #include <signal.h>
@@ -23,11 +34,41 @@ struct ChatContext {
     std::vector<gpt_vocab::id> cached_tokens;
     std::vector<float> logits;
     std::vector<float> embeddings;
+
+    // reused by the requests, cached_tokens and decode_ms have the capacity of n_ctx tokens from bloom_load
+    std::vector<gpt_vocab::id> last_n_tokens;
+    bloom_sampler_buf sampler;
+
+    // the end of the generation of bloom_run, see bloom_set_eos and bloom_set_stop
+    std::vector<gpt_vocab::id> eos_ids = { 2 };
+    bloom_stop_matcher stops;
+
+    // the constraint of bloom_set_regex, none while the pattern is empty - the trie is built on its first call
+    bloom_token_trie trie;
+    bloom_grammar    grammar;
+
+    // one request at a time, the callers wait here
+    std::mutex mutex;
+
+    // the last request and all of them so far
+    bloom_metrics metrics;
+    std::vector<float> decode_ms;
+
+    std::mutex summary_mutex;
+    bloom_metrics_summary summary {};
+
+    bloom_counters counters;
+    bloom_exporter * exporter = nullptr;
+
+    // bloom_cancel bumps the generation, a request stops when it changes after the request was called
+    std::atomic<uint32_t> cancel_gen {0};
+    // deadline of the next requests in ms from their call, queue included, 0 for none
+    std::atomic<int32_t>  timeout_ms {0};
 };
 
 // load the model's weights from a file
-bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab & vocab, int n_ctx) {
-    printf("%s: loading model from '%s' - please wait ...\n", "loading bigdl-llm model", fname.c_str());
+bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab & vocab, int n_ctx, int n_seq) {
+    fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", "loading bigdl-llm model", fname.c_str());
 
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
@@ -61,20 +102,21 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
         fin.read((char *) &hparams.f16,     sizeof(hparams.f16));
 
         hparams.n_ctx = n_ctx;
+        hparams.n_seq = n_seq;
 
         n_ff = ((4*hparams.n_embd + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
         // n_parts = BLOOM_N_PARTS.at(hparams.n_embd);
         n_parts = 1;
 
-        printf("%s: n_vocab = %d\n", "loading bigdl-llm model", hparams.n_vocab);
-        printf("%s: n_ctx   = %d\n", "loading bigdl-llm model", hparams.n_ctx);
-        printf("%s: n_embd  = %d\n", "loading bigdl-llm model", hparams.n_embd);
-        printf("%s: n_mult  = %d\n", "loading bigdl-llm model", hparams.n_mult);
-        printf("%s: n_head  = %d\n", "loading bigdl-llm model", hparams.n_head);
-        printf("%s: n_layer = %d\n", "loading bigdl-llm model", hparams.n_layer);
-        printf("%s: f16     = %d\n", "loading bigdl-llm model", hparams.f16);
-        printf("%s: n_ff    = %d\n", "loading bigdl-llm model", n_ff);
-        printf("%s: n_parts = %d\n", "loading bigdl-llm model", n_parts);
+        fprintf(stderr, "%s: n_vocab = %d\n", "loading bigdl-llm model", hparams.n_vocab);
+        fprintf(stderr, "%s: n_ctx   = %d\n", "loading bigdl-llm model", hparams.n_ctx);
+        fprintf(stderr, "%s: n_embd  = %d\n", "loading bigdl-llm model", hparams.n_embd);
+        fprintf(stderr, "%s: n_mult  = %d\n", "loading bigdl-llm model", hparams.n_mult);
+        fprintf(stderr, "%s: n_head  = %d\n", "loading bigdl-llm model", hparams.n_head);
+        fprintf(stderr, "%s: n_layer = %d\n", "loading bigdl-llm model", hparams.n_layer);
+        fprintf(stderr, "%s: f16     = %d\n", "loading bigdl-llm model", hparams.f16);
+        fprintf(stderr, "%s: n_ff    = %d\n", "loading bigdl-llm model", n_ff);
+        fprintf(stderr, "%s: n_parts = %d\n", "loading bigdl-llm model", n_parts);
     }
 
     // load vocab
@@ -173,12 +215,13 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
         ctx_size += n_layer*(n_ff*n_embd*ggml_type_sizef(wtype)); // w2
         ctx_size += n_layer*(n_ff*ggml_type_sizef(GGML_TYPE_F32)); // w2_b
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_v
+        ctx_size += hparams.n_seq*n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_k
+        ctx_size += hparams.n_seq*n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_v
 
-        ctx_size += (5 + 10*n_layer)*256; // object overhead TODO:
+        ctx_size += (8 + 12*n_layer)*(GGML_OBJECT_SIZE + sizeof(struct ggml_tensor)); // tensor objects
+        ctx_size += (8 + 12*n_layer)*std::max<size_t>(model.data_align, 64); // data alignment padding
 
-        printf("%s: ggml ctx size = %6.2f MB\n", "loading bigdl-llm model", ctx_size/(1024.0*1024.0));
+        fprintf(stderr, "%s: ggml ctx size = %6.2f MB\n", "loading bigdl-llm model", ctx_size/(1024.0*1024.0));
     }
 
     // create the ggml context
@@ -186,6 +229,8 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
         struct ggml_init_params params = {
             /*.mem_size   =*/ ctx_size,
             /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ false,
+            /*.data_align =*/ model.data_align,
         };
 
         model.ctx = ggml_init(params);
@@ -269,15 +314,16 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
         const int n_layer = hparams.n_layer;
         const int n_ctx   = hparams.n_ctx;
 
-        const int n_mem      = n_layer*n_ctx;
-        const int n_elements = n_embd*n_mem;
+        // one n_layer*n_ctx cache per sequence
+        const int     n_mem      = hparams.n_seq*n_layer*n_ctx;
+        const int64_t n_elements = (int64_t) n_embd*n_mem;
 
         model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
         model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
 
         const size_t memory_size = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
 
-        printf("%s: memory_size = %8.2f MB, n_mem = %d\n", "loading bigdl-llm model", memory_size/1024.0/1024.0, n_mem);
+        fprintf(stderr, "%s: memory_size = %8.2f MB, n_mem = %d\n", "loading bigdl-llm model", memory_size/1024.0/1024.0, n_mem);
     }
 
     const size_t file_offset = fin.tellg();
@@ -295,7 +341,7 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
             fname_part += "." + std::to_string(i);
         }
 
-        printf("%s: loading model part %d/%d from '%s'\n", "loading bigdl-llm model", i+1, n_parts, fname_part.c_str());
+        fprintf(stderr, "%s: loading model part %d/%d from '%s'\n", "loading bigdl-llm model", i+1, n_parts, fname_part.c_str());
 
         fin = std::ifstream(fname_part, std::ios::binary);
         fin.seekg(file_offset);
@@ -305,7 +351,7 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
             int n_tensors = 0;
             size_t total_size = 0;
 
-            printf("%s: ", "loading bigdl-llm model");
+            fprintf(stderr, "%s: ", "loading bigdl-llm model");
 
             while (true) {
                 int32_t n_dims;
@@ -408,7 +454,7 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
 
                 if (0) {
                     static const char * ftype_str[] = { "f32", "f16", "q4_0", "q4_1", };
-                    printf("%24s - [%5d, %5d], type = %6s, split = %d\n", name.data(), ne[0], ne[1], ftype_str[ftype], split_type);
+                    fprintf(stderr, "%24s - [%5d, %5d], type = %6s, split = %d\n", name.data(), ne[0], ne[1], ftype_str[ftype], split_type);
                 }
 
                 size_t bpe = 0;
@@ -473,14 +519,16 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
 
                 //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
                 if (++n_tensors % 8 == 0) {
-                    printf(".");
-                    fflush(stdout);
+                    fprintf(stderr, ".");
+                    fflush(stderr);
                 }
             }
 
-            printf(" done\n");
+            fprintf(stderr, " done\n");
 
-            printf("%s: model size = %8.2f MB / num tensors = %d\n", "loading bigdl-llm model", total_size/1024.0/1024.0, n_tensors);
+            fprintf(stderr, "%s: model size = %8.2f MB / num tensors = %d\n", "loading bigdl-llm model", total_size/1024.0/1024.0, n_tensors);
+            fprintf(stderr, "%s: ggml ctx used = %6.2f MB of %6.2f MB\n", "loading bigdl-llm model",
+                    ggml_used_mem(model.ctx)/(1024.0*1024.0), ctx_size/(1024.0*1024.0));
         }
 
         fin.close();
@@ -489,6 +537,10 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
     return true;
 }
 
+// compute buffer of bloom_eval, shared by all the models and grown to mem_per_token*N when an eval needs more
+static size_t bloom_eval_buf_size = 512ul*10000*10000; // todo!
+static size_t bloom_eval_buf_peak = 0;
+
 // evaluate the transformer
 //
 //   - model:     the model
@@ -499,6 +551,72 @@ bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab
 //
 // The GPT-J model requires about 16MB of memory per input token.
 //
+// start of a profiled part of the graph - the tensors are allocated one after the other in the eval context,
+// so the offset of a node in the context tells which layer and sub-block created it
+struct bloom_perf_mark {
+    size_t           offs;
+    int              il; // -1 outside of the layers
+    bloom_perf_block block;
+};
+
+static void bloom_perf_add(
+        bloom_perf & perf,
+        const struct ggml_cgraph & gf,
+        const void * mem_buffer,
+        const std::vector<bloom_perf_mark> & marks,
+        bloom_perf_phase phase,
+        int n_tokens,
+        int n_layer) {
+    bloom_perf_stats & stats = perf.phase[phase];
+
+    if ((int) stats.layer_time_us.size() < n_layer) {
+        stats.layer_time_us.resize(n_layer, {});
+    }
+
+    stats.n_eval   += 1;
+    stats.n_tokens += n_tokens;
+
+    for (int i = 0; i < gf.n_nodes; ++i) {
+        const struct ggml_tensor * node = gf.nodes[i];
+        const size_t offs = (const char *) node - (const char *) mem_buffer;
+
+        // last mark at or before the node
+        auto it = std::upper_bound(marks.begin(), marks.end(), offs,
+                [](size_t offs, const bloom_perf_mark & mark) { return offs < mark.offs; });
+        if (it == marks.begin()) {
+            continue;
+        }
+        --it;
+
+        stats.t_graph_us           += node->perf_time_us;
+        stats.op_runs[node->op]    += 1;
+        stats.op_time_us[node->op] += node->perf_time_us;
+
+        stats.block_time_us[it->block] += node->perf_time_us;
+        if (it->il >= 0) {
+            stats.layer_time_us[it->il][it->block] += node->perf_time_us;
+        }
+
+        if (node->op == GGML_OP_MUL_MAT) {
+            const struct ggml_tensor * src0 = node->src0;
+            const struct ggml_tensor * src1 = node->src1;
+
+            stats.mm_bytes  [it->block] += ggml_nbytes(src0);
+            stats.mm_flops  [it->block] += 2*src0->ne[0]*src0->ne[1]*src1->ne[1]*src1->ne[2]*src1->ne[3];
+            stats.mm_time_us[it->block] += node->perf_time_us;
+        }
+
+        if (perf.hwc) {
+            for (int k = 0; k < GGML_HWC_COUNT; ++k) {
+                const int64_t count = ggml_hwc_get(perf.hwc, i, (enum ggml_hwc_event) k);
+
+                stats.op_hwc[node->op][k]     += count;
+                stats.block_hwc[it->block][k] += count;
+            }
+        }
+    }
+}
+
 bool bloom_eval(
         const bloom_model & model,
         const int n_threads,
@@ -509,8 +627,51 @@ bool bloom_eval(
               size_t                     & mem_per_token,
               bool logits_all,
               bool embed) {
+    const bloom_seq seq = { 0, n_past, embd_inp.data(), (int32_t) embd_inp.size() };
+
+    return bloom_eval_batch(model, n_threads, &seq, 1, embd_w, embeddings, mem_per_token, logits_all, embed);
+}
+
+bool bloom_eval_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const std::vector<bloom_seq> & batch,
+              std::vector<float>     & embd_w,
+              std::vector<float>     & embeddings,
+              size_t                 & mem_per_token,
+              bool logits_all,
+              bool embed) {
+    return bloom_eval_batch(model, n_threads, batch.data(), batch.size(), embd_w, embeddings, mem_per_token, logits_all, embed);
+}
+
+// the graph of bloom_eval_batch and bloom_embed_batch - without embd_w it ends at the output norm
+static bool bloom_eval_graph(
+        const bloom_model & model,
+        const int n_threads,
+        const bloom_seq * batch,
+        const int n_batch,
+              std::vector<float> * embd_w,
+              std::vector<float> & embeddings,
+              size_t             & mem_per_token,
+              bool logits_all,
+              bool embed,
+              bloom_pooling pooling) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // the tokens of the sequences are evaluated as one batch, one after the other
+    int64_t N = 0;
+    bool prefill = false;
+    for (int ib = 0; ib < n_batch; ++ib) {
+        const bloom_seq & s = batch[ib];
+        if (s.seq < 0 || s.seq >= model.hparams.n_seq || s.n_tokens <= 0 || s.kv_base < 0 ||
+            s.kv_base + s.n_past + s.n_tokens > model.hparams.n_ctx) {
+            fprintf(stderr, "%s: invalid sequence %d with %d past and %d new tokens at row %d\n", __func__, s.seq, s.n_past, s.n_tokens, s.kv_base);
+            return false;
+        }
 
-    const int64_t N = embd_inp.size();
+        N += s.n_tokens;
+        prefill = prefill || s.n_tokens > 1;
+    }
 
     const auto & hparams = model.hparams;
 
@@ -522,12 +683,22 @@ bool bloom_eval(
 
     const int d_key = n_embd/n_head;
 
-    static size_t buf_size = 512ul*10000*10000;     // todo!
+    // the attention kernels specialized for the head size read K and V straight from the f32 cache
+    const bool attn_specialized = (d_key == 64 || d_key == 128) &&
+        model.memory_k->type == GGML_TYPE_F32 && model.memory_v->type == GGML_TYPE_F32;
+
+    // head-parallel attention: a single node per layer instead of one barrier per step
+    auto attn_heads = [&](int n_tokens) {
+        return model.memory_k->type == GGML_TYPE_F32 && model.memory_v->type == GGML_TYPE_F32 &&
+            (model.attn_mode == BLOOM_ATTN_HEADS || (model.attn_mode == BLOOM_ATTN_AUTO && n_tokens == 1));
+    };
+
+    size_t & buf_size = bloom_eval_buf_size;
     static void * buf = malloc(buf_size);
 
     if (mem_per_token > 0 && mem_per_token*N > buf_size) {
         const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        //printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, buf_size, buf_size_new);
+        fprintf(stderr, "%s: reallocating the compute buffer from %zu to %zu bytes\n", __func__, buf_size, buf_size_new);
 
         // reallocate
         buf_size = buf_size_new;
@@ -541,15 +712,37 @@ bool bloom_eval(
     struct ggml_init_params params = {
         buf_size,
         buf,
-        false
+        false,
+        model.data_align,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
+    // the evals of one token per sequence are bound by the memory bandwidth, they can use fewer threads
+    const std::vector<int> & cpus = prefill ? model.cpus : model.cpus_decode;
+
     ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    gf.n_threads = !prefill && model.n_threads_decode > 0 ? model.n_threads_decode : n_threads;
+    gf.cpus      = cpus.empty() ? nullptr : cpus.data();
+    gf.n_cpus    = cpus.size();
+    gf.trace     = model.trace;
+    gf.hwc       = model.perf ? model.perf->hwc : nullptr;
+
+    ggml_pool_stats pool_stats = {};
+    gf.pool      = model.counters ? &pool_stats : nullptr;
+
+    std::vector<bloom_perf_mark> perf_marks;
+    auto perf_mark = [&](int il, bloom_perf_block block) {
+        if (model.perf) {
+            perf_marks.push_back({ ggml_used_mem(ctx0), il, block });
+        }
+    };
+
+    perf_mark(-1, BLOOM_PERF_EMBD);
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    for (int ib = 0, offs = 0; ib < n_batch; offs += batch[ib].n_tokens, ++ib) {
+        memcpy((int32_t *) embd->data + offs, batch[ib].tokens, batch[ib].n_tokens*ggml_element_size(embd));
+    }
 
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
 
@@ -565,6 +758,8 @@ bool bloom_eval(
 
         struct ggml_tensor * cur;
 
+        perf_mark(il, BLOOM_PERF_QKV);
+
         // norm
         {
             cur = ggml_norm(ctx0, inpL);
@@ -587,76 +782,125 @@ bool bloom_eval(
 
         // cur = ggml_debug(ctx0, cur);
 
-        // self-attention
+        perf_mark(il, BLOOM_PERF_ATTN);
+
+        // self-attention, each sequence attends to its own kv cache
         {
-            struct ggml_tensor * Qcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*sizeof(float)*n_embd);
-            struct ggml_tensor * Kcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*sizeof(float)*n_embd); //TODO: float or fp16?
-            struct ggml_tensor * Vcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*sizeof(float)*n_embd);
+            struct ggml_tensor * qkv = cur;
+
+            struct ggml_tensor * attn = n_batch > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N) : nullptr;
+
+            for (int ib = 0, row = 0; ib < n_batch; row += batch[ib].n_tokens, ++ib) {
+                const int N      = batch[ib].n_tokens;
+                const int n_past = batch[ib].n_past;
+
+                // first row of the cache of this layer and sequence
+                const int64_t kv_offs = ((int64_t) batch[ib].seq*n_layer + il)*n_ctx + batch[ib].kv_base;
+
+                struct ggml_tensor * Qcur = ggml_view_2d(ctx0, qkv, n_embd, N, qkv->nb[1], row*qkv->nb[1] + 0*sizeof(float)*n_embd);
+                struct ggml_tensor * Kcur = ggml_view_2d(ctx0, qkv, n_embd, N, qkv->nb[1], row*qkv->nb[1] + 1*sizeof(float)*n_embd); //TODO: float or fp16?
+                struct ggml_tensor * Vcur = ggml_view_2d(ctx0, qkv, n_embd, N, qkv->nb[1], row*qkv->nb[1] + 2*sizeof(float)*n_embd);
+
+                // store key and value to memory
+                if (N >= 1) {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_k, N*n_embd, (ggml_element_size(model.memory_k)*n_embd)*(kv_offs + n_past));
+                    struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_v, N*n_embd, (ggml_element_size(model.memory_v)*n_embd)*(kv_offs + n_past));
+
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                }
+
+                // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                                ggml_cpy(ctx0, Qcur,
+                                    ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
+                            0, 2, 1, 3);
+
+                // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0, ggml_reshape_3d(ctx0,
+                                    ggml_view_1d(ctx0, model.memory_k, (n_past + N)*n_embd, kv_offs*ggml_element_size(model.memory_k)*n_embd),
+                                    n_embd/n_head, n_head, n_past + N),
+                            0, 2, 1, 3);
+
+                if (attn_heads(N)) {
+                    // V = Vmem.view(n_embd/n_head, n_head, n_past + N)
+                    struct ggml_tensor * V =
+                        ggml_reshape_3d(ctx0,
+                                ggml_view_1d(ctx0, model.memory_v, (n_past + N)*n_embd, kv_offs*ggml_element_size(model.memory_v)*n_embd),
+                                n_embd/n_head, n_head, n_past + N);
+
+                    // cur = soft_max(mask_past(K*Q/sqrt(n_embd/n_head) + alibi)) * V, merged into (n_embd, N)
+                    cur = ggml_reshape_2d(ctx0,
+                            ggml_attn_alibi(ctx0, Q, K, V, n_past, 1.0f/sqrt(float(n_embd)/n_head), 8.0f),
+                            n_embd, N);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = attn_specialized ? ggml_attn_kq(ctx0, K, Q) : ggml_mul_mat(ctx0, K, Q);
+
+                    // KQ_scaled = KQ / sqrt(n_embd/n_head)
+                    struct ggml_tensor * KQ_scaled =
+                        ggml_scale(ctx0,
+                                KQ,
+                                ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
+                                );
+
+                    // Alibi
+                    // KQ_scaled_alibi = KQ_scaled + alibi_bias //TODO: optimize
+                    struct ggml_tensor * KQ_scaled_alibi = ggml_alibi(ctx0, KQ_scaled, n_past, n_head, 8.0);
+
+                    // KQ_masked = mask_past(KQ_scaled)
+                    struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_alibi, n_past);
+
+                    // KQ = soft_max(KQ_masked)
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                    if (attn_specialized) {
+                        // V = Vmem.view(n_embd/n_head, n_head, n_past + N), used in place without a transposed copy
+                        struct ggml_tensor * V =
+                            ggml_reshape_3d(ctx0,
+                                    ggml_view_1d(ctx0, model.memory_v, (n_past + N)*n_embd, kv_offs*ggml_element_size(model.memory_v)*n_embd),
+                                    n_embd/n_head, n_head, n_past + N);
+
+                        // cur = (KQ_soft_max * V).view(n_embd, N) - the heads come out already merged
+                        cur = ggml_reshape_2d(ctx0, ggml_attn_kqv(ctx0, V, KQ_soft_max), n_embd, N);
+                    } else {
+                        // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
+                        struct ggml_tensor *V_trans =
+                                ggml_cpy(ctx0,
+                                         ggml_permute(ctx0,
+                                                      ggml_reshape_3d(ctx0,
+                                                                      ggml_view_1d(ctx0, model.memory_v, (n_past + N) * n_embd,
+                                                                                   kv_offs * ggml_element_size(model.memory_v) *
+                                                                                   n_embd),
+                                                                      n_embd / n_head, n_head, n_past + N),
+                                                      1, 2, 0, 3),
+                                         ggml_new_tensor_3d(ctx0, model.memory_v->type, n_past + N, n_embd / n_head, n_head));
+                        // KQV = transpose(V) * KQ_soft_max
+                        struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+                        // KQV_merged = KQV.permute(0, 2, 1, 3)
+                        struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                        // cur = KQV_merged.contiguous().view(n_embd, N)
+                        cur = ggml_cpy(ctx0,
+                                KQV_merged,
+                                ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+                    }
+                }
 
-            // store key and value to memory
-            if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_k, N*n_embd, (ggml_element_size(model.memory_k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_v, N*n_embd, (ggml_element_size(model.memory_v)*n_embd)*(il*n_ctx + n_past));
+                // the rows of the sequences are put back together for the projection
+                if (attn) {
+                    attn = ggml_set_2d_inplace(ctx0, attn, cur, attn->nb[1], row*attn->nb[1]);
+                }
+            }
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+            if (attn) {
+                cur = attn;
             }
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                            ggml_cpy(ctx0, Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-                        0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0, ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.memory_k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_k)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-            // Alibi
-            // KQ_scaled_alibi = KQ_scaled + alibi_bias //TODO: optimize
-            struct ggml_tensor * KQ_scaled_alibi = ggml_alibi(ctx0, KQ_scaled, n_past, n_head, 8.0);
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_alibi, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor *V_trans =
-                    ggml_cpy(ctx0,
-                             ggml_permute(ctx0,
-                                          ggml_reshape_3d(ctx0,
-                                                          ggml_view_1d(ctx0, model.memory_v, (n_past + N) * n_embd,
-                                                                       il * n_ctx * ggml_element_size(model.memory_v) *
-                                                                       n_embd),
-                                                          n_embd / n_head, n_head, n_past + N),
-                                          1, 2, 0, 3),
-                             ggml_new_tensor_3d(ctx0, model.memory_v->type, n_past + N, n_embd / n_head, n_head));
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+            perf_mark(il, BLOOM_PERF_WO);
 
             // projection
             cur = ggml_mul_mat(ctx0,
@@ -667,6 +911,8 @@ bool bloom_eval(
 
         struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpSA);
 
+        perf_mark(il, BLOOM_PERF_FFN);
+
         // feed-forward network
         {
             // norm
@@ -699,6 +945,21 @@ bool bloom_eval(
         inpL = cur;
     }
 
+    perf_mark(-1, BLOOM_PERF_LM_HEAD);
+
+    // without logits_all only the last token of every sequence goes through the output norm and the lm_head, the mean
+    // pooling needs them all
+    const int n_out = logits_all || (embed && pooling == BLOOM_POOLING_MEAN) ? N : n_batch;
+    if (n_out < N) {
+        struct ggml_tensor * last = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out);
+        for (int ib = 0, row = 0; ib < n_batch; ++ib) {
+            row += batch[ib].n_tokens;
+            ((int32_t *) last->data)[ib] = row - 1;
+        }
+
+        inpL = ggml_get_rows(ctx0, inpL, last);
+    }
+
     // used at the end to optionally extract the embeddings
     struct ggml_tensor * embedding_tensor = NULL;
 
@@ -717,7 +978,7 @@ bool bloom_eval(
     }
 
     // lm_head
-    {
+    if (embd_w) {
         inpL = ggml_mul_mat(ctx0, model.output, inpL);
     }
 
@@ -726,6 +987,8 @@ bool bloom_eval(
 
     // run the computation
     ggml_build_forward_expand(&gf, inpL);
+    // embedding_tensor is only read by the lm_head matmul, so it survives the optimizer
+    ggml_graph_optimize      (&gf);
     ggml_graph_compute       (ctx0, &gf);
 
     //if (n_past%100 == 0) {
@@ -736,260 +999,1686 @@ bool bloom_eval(
     //embd_w.resize(n_vocab*N);
     //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
 
-    // return result for just the last token
-    if (!logits_all) {
-        embd_w.resize(n_vocab);
-        memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
-    } else {
-        embd_w.resize(n_vocab * N);
-        memcpy(embd_w.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    // the logits of the last token of every sequence, or of all the tokens
+    if (embd_w) {
+        embd_w->resize(n_vocab*n_out);
+        memcpy(embd_w->data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*n_out);
     }
 
+    // the embedding of the last token of every sequence, or the mean of its tokens
     if (embed) {
-        embeddings.resize(n_embd);
-        memcpy(embeddings.data(), (float *)ggml_get_data(embedding_tensor) + (n_embd*(N - 1)), sizeof(float)*n_embd);
+        const float * states = (float *) ggml_get_data(embedding_tensor);
+
+        embeddings.resize(n_embd*n_batch);
+        for (int ib = 0, row = 0; ib < n_batch; ++ib) {
+            const int n_tokens = batch[ib].n_tokens;
+            float * dst = embeddings.data() + n_embd*ib;
+
+            row += n_tokens;
+
+            if (pooling == BLOOM_POOLING_MEAN) {
+                std::fill(dst, dst + n_embd, 0.0f);
+                for (int i = row - n_tokens; i < row; ++i) {
+                    for (int k = 0; k < n_embd; ++k) {
+                        dst[k] += states[n_embd*i + k];
+                    }
+                }
+                for (int k = 0; k < n_embd; ++k) {
+                    dst[k] /= n_tokens;
+                }
+            } else {
+                const int i_out = n_out == N ? row - 1 : ib;
+                memcpy(dst, states + n_embd*i_out, sizeof(float)*n_embd);
+            }
+        }
     }
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
     }
+
+    bloom_eval_buf_peak = std::max(bloom_eval_buf_peak, ggml_used_mem(ctx0));
     //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    ggml_free(ctx0);
+    if (model.perf) {
+        const bloom_perf_phase phase = prefill ? BLOOM_PERF_PREFILL : BLOOM_PERF_DECODE;
 
-    return true;
-}
+        bloom_perf_add(*model.perf, gf, buf, perf_marks, phase, N, n_layer);
+        model.perf->phase[phase].t_eval_us += ggml_time_us() - t_start_us;
+    }
 
-extern "C" ChatContext* bloom_load(const char * fname, int n_ctx, int n_threads) {
-    ChatContext * ctx = new ChatContext{};
+    if (model.counters) {
+        bloom_counters & counters = *model.counters;
 
-    // init model and vocab
-    bool res = bloom_model_load(fname, ctx->model, ctx->vocab, n_ctx);
-    if (!res) {
-        return 0;
-    }
+        int ib = 0;
+        while (ib < BLOOM_BATCH_BUCKETS - 1 && (1 << ib) < N) {
+            ++ib;
+        }
 
-    // determine the required inference memory per token:
-    res = bloom_eval(ctx->model,
-                     n_threads,
-                     0,
-                     { 0, 1, 2, 3 },
-                     ctx->logits,
-                     ctx->embeddings,
-                     ctx->mem_per_token);
-    if (!res) {
-        return 0;
+        counters.n_eval      .fetch_add(1,                           std::memory_order_relaxed);
+        counters.n_tokens    .fetch_add(N,                           std::memory_order_relaxed);
+        counters.t_eval_us   .fetch_add(ggml_time_us() - t_start_us, std::memory_order_relaxed);
+        counters.n_batch[ib] .fetch_add(1,                           std::memory_order_relaxed);
+        counters.pool_wall_us.fetch_add(pool_stats.wall_us,          std::memory_order_relaxed);
+        counters.pool_busy_us.fetch_add(pool_stats.busy_us,          std::memory_order_relaxed);
+        counters.pool_spin_us.fetch_add(pool_stats.spin_us,          std::memory_order_relaxed);
+        if (hparams.n_seq == 1) {
+            counters.n_kv.store(batch[0].n_past + batch[0].n_tokens, std::memory_order_relaxed);
+        }
     }
 
-    return ctx;
+    ggml_free(ctx0);
+
+    return true;
 }
 
-extern "C" void bloom_free(ChatContext* ctx) {
-    delete ctx;
+bool bloom_eval_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const bloom_seq * batch,
+        const int n_batch,
+              std::vector<float> & embd_w,
+              std::vector<float> & embeddings,
+              size_t             & mem_per_token,
+              bool logits_all,
+              bool embed) {
+    return bloom_eval_graph(model, n_threads, batch, n_batch, &embd_w, embeddings, mem_per_token, logits_all, embed, BLOOM_POOLING_LAST);
 }
 
-int inference(gpt_params & params,
-              const bloom_model & model,
-              const gpt_vocab & vocab,
-              size_t mem_per_token,
-              std::vector<gpt_vocab::id>& tokens,
-              std::vector<gpt_vocab::id>& last_n_tokens,
-              int n_past,
-              char * dst) {
-    ggml_time_init();
-    const int64_t t_start_us = ggml_time_us();
+bool bloom_embed_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const bloom_seq * batch,
+        const int n_batch,
+        bloom_pooling pooling,
+              std::vector<float> & embeddings,
+              size_t             & mem_per_token) {
+    return bloom_eval_graph(model, n_threads, batch, n_batch, nullptr, embeddings, mem_per_token, false, true, pooling);
+}
 
-    int64_t t_sample_us  = 0;
-    int64_t t_eval_us = 0;
-    int64_t t_predict_us = 0;
-    size_t n_past_init = n_past;
+bool bloom_embed_packed(
+        const bloom_model & model,
+        const int n_threads,
+        int n_batch,
+        const std::vector<std::vector<gpt_vocab::id>> & seqs,
+        bloom_pooling pooling,
+        float * dst,
+        size_t & mem_per_token) {
+    const int n_embd = model.hparams.n_embd;
+    const int n_ctx  = model.hparams.n_ctx;
+    const int n_seqs = seqs.size();
+
+    n_batch = std::max(1, std::min(n_batch, n_ctx));
+
+    auto length = [&](int i) {
+        return std::min((int) seqs[i].size(), n_ctx);
+    };
 
-    std::mt19937 rng(params.seed);
-    std::vector<float> logits, embeddings;
+    std::vector<int> order(n_seqs);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return length(a) > length(b);
+    });
 
-    while (n_past < tokens.size()) {
-        // eval input prompt
-        const int64_t t_start_eval_us = ggml_time_us();
+    std::vector<bloom_seq> batch;
+    std::vector<int>       batch_ids;
+    std::vector<float>     embeddings;
 
-        int n = std::min((size_t)params.n_batch, tokens.size() - n_past);
-        std::vector<gpt_vocab::id> embd(tokens.cbegin() + n_past,
-                                        tokens.cbegin() + n_past + n);
-        if (!bloom_eval(model,
-                        params.n_threads,
-                        n_past,
-                        embd,
-                        logits,
-                        embeddings,
-                        mem_per_token)) {
-            // todo: better error handling
-            printf("Failed to predict\n");
-            return 1;
+    auto flush = [&]() {
+        if (batch.empty()) {
+            return true;
         }
-        n_past += n;
+        if (!bloom_embed_batch(model, n_threads, batch.data(), batch.size(), pooling, embeddings, mem_per_token)) {
+            return false;
+        }
+        for (int ib = 0; ib < (int) batch.size(); ++ib) {
+            memcpy(dst + (int64_t) n_embd*batch_ids[ib], embeddings.data() + n_embd*ib, sizeof(float)*n_embd);
+        }
+        batch.clear();
+        batch_ids.clear();
+        return true;
+    };
 
-        t_eval_us += ggml_time_us() - t_start_eval_us;
-    }
+    // the rows of the kv cache taken by the sequences of the batch
+    int n_rows = 0;
 
-    int n_predict = 0;
-    while (1) {
-        {
-            // sample next token
-            const int64_t t_start_sample_us = ggml_time_us();
+    for (int i : order) {
+        const int n = length(i);
+        float * out = dst + (int64_t) n_embd*i;
 
-            gpt_vocab::id id = bloom_sample_top_p(vocab,
-                                                  logits.data() + (logits.size() - model.hparams.n_vocab),
-                                                  last_n_tokens,
-                                                  params.repeat_penalty,
-                                                  params.top_p,
-                                                  params.top_k,
-                                                  params.temp,
-                                                  rng);
-            last_n_tokens.erase(last_n_tokens.begin());
-            last_n_tokens.push_back(id);
-            ++n_predict;
+        if (n == 0) {
+            std::fill(out, out + n_embd, 0.0f);
+            continue;
+        }
 
-            const auto& word = vocab.id_to_token.find(id)->second;
-            strcpy(dst, word.c_str());
-            dst += word.size();
+        if (n > n_batch) {
+            // the mean of the slices weighted by their length, or the last token of the last one
+            std::vector<double> sum(n_embd, 0.0);
+            for (int n_past = 0; n_past < n; ) {
+                const int n_slice = std::min(n_batch, n - n_past);
 
-            t_sample_us += ggml_time_us() - t_start_sample_us;
+                const bloom_seq seq = { 0, n_past, seqs[i].data() + n_past, n_slice };
+                if (!bloom_embed_batch(model, n_threads, &seq, 1, pooling, embeddings, mem_per_token)) {
+                    return false;
+                }
+                for (int k = 0; k < n_embd; ++k) {
+                    sum[k] += (double) embeddings[k]*n_slice;
+                }
+                n_past += n_slice;
+            }
+
+            for (int k = 0; k < n_embd; ++k) {
+                out[k] = pooling == BLOOM_POOLING_MEAN ? sum[k]/n : embeddings[k];
+            }
+            continue;
         }
-        if (last_n_tokens.back() == 2 || n_predict >= params.n_predict) {
-            // end of text token or reach the token number limit
-            break;
+
+        if (n_rows + n > n_batch) {
+            if (!flush()) {
+                return false;
+            }
+            n_rows = 0;
         }
 
-        {
-            // predict the next token
-            const int64_t t_start_predict_us = ggml_time_us();
+        batch.push_back({ 0, 0, seqs[i].data(), n, n_rows });
+        batch_ids.push_back(i);
+        n_rows += n;
+    }
 
-            std::vector<gpt_vocab::id> embd(1, last_n_tokens.back());
-            if (!bloom_eval(model,
-                            params.n_threads,
-                            n_past,
-                            embd,
-                            logits,
-                            embeddings,
-                            mem_per_token)) {
-                // todo: better error handling
-                printf("Failed to predict\n");
-                return -1;
-            }
-            tokens.push_back(last_n_tokens.back());
-            ++n_past;
+    return flush();
+}
 
-            t_predict_us += ggml_time_us() - t_start_predict_us;
-        }
+// the file of a tuning cache, empty if there is no cache directory
+static std::string bloom_tune_cache_path(const char * name) {
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+    std::string dir;
+    if (const char * xdg = getenv("XDG_CACHE_HOME")) {
+        dir = xdg;
+    } else if (const char * home = getenv("HOME")) {
+        dir = std::string(home) + "/.cache";
+    } else {
+        return "";
     }
 
-    // report timing
-    {
-        const int64_t t_end_us = ggml_time_us();
+    mkdir(dir.c_str(), 0755);
+    dir += "/bloomz.cpp";
+    mkdir(dir.c_str(), 0755);
+
+    return dir + "/" + name;
+#else
+    return "";
+#endif
+}
 
-        int n_prompt = tokens.size() - n_predict - n_past_init;
-        n_predict = n_predict - 1;
+// the value tuned for key in a previous run, 0 if none
+static int bloom_tune_cache_get(const char * name, const std::string & key) {
+    const std::string path = bloom_tune_cache_path(name);
+    if (path.empty()) {
+        return 0;
+    }
 
-        printf("\n\n");
-        printf("%s:    mem per token = %8zu bytes\n", __func__, mem_per_token);
-        printf("%s:      sample time = %8.2f ms\n", __func__, t_sample_us/1000.0f);
-        printf("%s: evel prompt time = %8.2f ms / %d tokens / %.2f ms per token\n", __func__, t_eval_us/1000.0f, n_prompt, t_eval_us/1000.0f/n_prompt);
-        printf("%s:     predict time = %8.2f ms / %d tokens / %.2f ms per token\n", __func__, t_predict_us/1000.0f, n_predict, t_predict_us/1000.0f/n_predict);
-        printf("%s:       total time = %8.2f ms\n", __func__, (t_end_us - t_start_us)/1000.0f);
+    std::ifstream fin(path);
+    std::string line_key;
+    int value = 0;
+    while (fin >> line_key >> value) {
+        if (line_key == key && value > 0) {
+            return value;
+        }
     }
 
     return 0;
 }
 
-extern "C" int bloom_run(ChatContext *ctx,
-                         int32_t seed,
-                         int32_t n_threads,
-                         int32_t n_batch,
-                         int32_t n_predict,
-                         bool match_str,
-                         const char* prompt,
-                         char* dst)
-{
-    gpt_params params;
-    params.seed = seed < 0 ? time(NULL) : seed;
-    params.n_threads = n_threads > 0 ? n_threads : params.n_threads;
-    params.n_batch = n_batch > 0 ? n_batch : params.n_batch;
+static void bloom_tune_cache_put(const char * name, const std::string & key, int value) {
+    const std::string path = bloom_tune_cache_path(name);
+    if (path.empty()) {
+        return;
+    }
 
-    std::vector<gpt_vocab::id> & cached_tokens = ctx->cached_tokens;
+    std::ofstream fout(path, std::ios::app);
+    fout << key << " " << value << "\n";
+}
 
-    int n_past = 0;
-    if (match_str) {
-        int n_chars = 0, match = true;
-        for (int id : cached_tokens) {
-            const std::string & str = ctx->vocab.id_to_token[id];
-            for (int j = 0; j < str.size(); ++j) {
-                if (prompt[n_chars + j] == '\0' || prompt[n_chars + j] != str[j]) {
-                    match = false;
-                    break;
-                }
-            }
-            if (match) {
-                n_past += 1;
-                n_chars += str.size();
-            } else {
-                break;
-            }
-        }
-        n_past = prompt[n_chars] == '\0' ? n_past-1 : n_past;
-        cached_tokens.resize(n_past);
+// the model part of the cache keys: the same shapes and weight type run at the same speed on a machine
+static std::string bloom_tune_key(const bloom_model & model) {
+    const auto & hparams = model.hparams;
 
-        params.prompt = std::string(prompt + n_chars);
-        printf("n_past: %d, n_chars: %d, prompt: %s\n", n_past, n_chars, params.prompt.c_str());
-        std::vector<gpt_vocab::id> new_tokens = bloom_tokenize(ctx->vocab, params.prompt, false);
-        cached_tokens.insert(cached_tokens.end(), new_tokens.begin(), new_tokens.end());
-    } else {
-        params.prompt = std::string(prompt);
-        std::vector<gpt_vocab::id> input_tokens = bloom_tokenize(ctx->vocab, params.prompt, false);
+    char key[256];
+    snprintf(key, sizeof(key), "vocab=%d,embd=%d,head=%d,layer=%d,ctx=%d,wtype=%s",
+            hparams.n_vocab, hparams.n_embd, hparams.n_head, hparams.n_layer, hparams.n_ctx,
+            ggml_type_name(model.layers[0].query_key_value->type));
 
-        while (n_past < cached_tokens.size() && n_past < input_tokens.size()) {
-            if (cached_tokens[n_past] == input_tokens[n_past]) {
-                ++n_past;
-            } else {
-                break;
-            }
+    return key;
+}
+
+// the smallest candidate whose cost is within 5% of the best one - the candidates are measured in increasing order
+// until two in a row improve the best by less than 5%, one of them could be noise; cost returns 0 or less on failure
+static int bloom_tune_plateau(const char * func, const char * name, const std::vector<int> & candidates, const std::function<double(int)> & cost) {
+    std::vector<std::pair<int, double>> results;
+
+    double best   = 0.0;
+    int    n_flat = 0;
+    for (int n : candidates) {
+        const double c = cost(n);
+        if (c <= 0.0) {
+            break;
         }
-        n_past = std::min(n_past, (int)input_tokens.size() - 1);
-        // printf("n_past: %d\n", n_past);
 
-        cached_tokens.swap(input_tokens);
-    }
+        fprintf(stderr, "%s: %s = %3d: %8.3f ms per token\n", func, name, n, c/1000.0);
 
-    params.n_predict = std::min(n_predict, ctx->model.hparams.n_ctx - (int)cached_tokens.size());
+        results.emplace_back(n, c);
 
-    std::vector<gpt_vocab::id> last_n_tokens{};
-    int n_tokens = cached_tokens.size();
-    if (n_tokens >= params.repeat_last_n) {
-        for (int i = n_tokens - params.repeat_last_n; i < n_tokens; ++i) {
-            last_n_tokens.push_back(cached_tokens[i]);
+        n_flat = best == 0.0 || c < 0.95*best ? 0 : n_flat + 1;
+        if (best == 0.0 || c < best) {
+            best = c;
         }
-    } else {
-        last_n_tokens.resize(params.repeat_last_n - n_tokens, 0);
-        for (int i = 0; i < n_tokens; ++i) {
-            last_n_tokens.push_back(cached_tokens[i]);
+        if (n_flat == 2) {
+            break;
         }
     }
 
-    strcpy(dst, prompt);
-    dst += strlen(prompt);
+    for (const auto & r : results) {
+        if (r.second <= 1.05*best) {
+            return r.first;
+        }
+    }
 
-    int ret = inference(params,
-                        ctx->model,
-                        ctx->vocab,
+    return 0;
+}
+
+// the tuning evals are not part of the profile, the trace or the metrics, and use the thread counts they measure
+struct bloom_tune_scope {
+    bloom_model & model;
+
+    bloom_perf     * perf;
+    ggml_trace     * trace;
+    bloom_counters * counters;
+    int              n_threads_decode;
+
+    bloom_tune_scope(bloom_model & model) : model(model),
+        perf(model.perf), trace(model.trace), counters(model.counters), n_threads_decode(model.n_threads_decode) {
+        model.perf             = nullptr;
+        model.trace            = nullptr;
+        model.counters         = nullptr;
+        model.n_threads_decode = 0;
+    }
+
+    ~bloom_tune_scope() {
+        model.perf             = perf;
+        model.trace            = trace;
+        model.counters         = counters;
+        model.n_threads_decode = n_threads_decode;
+    }
+};
+
+int bloom_tune_n_batch(bloom_model & model, int n_threads, size_t & mem_per_token, size_t mem_max) {
+    auto cached = model.n_batch_tuned.find(n_threads);
+    if (cached != model.n_batch_tuned.end()) {
+        return cached->second;
+    }
+
+    const std::string key = bloom_tune_key(model) + ",threads=" + std::to_string(n_threads) + ",mem_max=" + std::to_string(mem_max);
+
+    int n_batch = bloom_tune_cache_get("n_batch", key);
+    if (n_batch > 0) {
+        model.n_batch_tuned[n_threads] = n_batch;
+        return n_batch;
+    }
+
+    const int n_max = std::min(512, model.hparams.n_ctx);
+
+    std::vector<gpt_vocab::id> tokens(n_max);
+    for (int i = 0; i < n_max; ++i) {
+        tokens[i] = i % model.hparams.n_vocab;
+    }
+
+    std::vector<int> candidates;
+    for (int n = 8; n <= n_max && (mem_max == 0 || mem_per_token*n <= mem_max); n *= 2) {
+        candidates.push_back(n);
+    }
+
+    std::vector<float> logits;
+    std::vector<float> embeddings;
+
+    {
+        bloom_tune_scope scope(model);
+
+        n_batch = bloom_tune_plateau(__func__, "n_batch", candidates, [&](int n) {
+            const std::vector<gpt_vocab::id> embd(tokens.begin(), tokens.begin() + n);
+
+            // the best of two, the first eval of a size also touches new pages of the compute buffer
+            double t_us = 0.0;
+            for (int rep = 0; rep < 2; ++rep) {
+                const int64_t t_start_us = ggml_time_us();
+                if (!bloom_eval(model, n_threads, 0, embd, logits, embeddings, mem_per_token)) {
+                    return 0.0;
+                }
+
+                const double t = (double) (ggml_time_us() - t_start_us)/n;
+                t_us = rep == 0 ? t : std::min(t_us, t);
+            }
+            return t_us;
+        });
+    }
+
+    if (n_batch > 0) {
+        bloom_tune_cache_put("n_batch", key, n_batch);
+    } else {
+        n_batch = std::min(8, n_max);
+    }
+
+    fprintf(stderr, "%s: n_batch = %d for %d threads\n", __func__, n_batch, n_threads);
+
+    model.n_batch_tuned[n_threads] = n_batch;
+
+    return n_batch;
+}
+
+int bloom_tune_threads_decode(bloom_model & model, int n_threads_max, size_t & mem_per_token) {
+    std::string cpus;
+    for (int cpu : model.cpus_decode) {
+        cpus += (cpus.empty() ? "" : ":") + std::to_string(cpu);
+    }
+
+    const std::string key = bloom_tune_key(model) + ",threads=" + std::to_string(n_threads_max) + ",cpus=" + (cpus.empty() ? "-" : cpus);
+
+    int n_threads = bloom_tune_cache_get("n_threads_decode", key);
+    if (n_threads > 0) {
+        model.n_threads_decode = n_threads;
+        return n_threads;
+    }
+
+    // the graphs run with at least two threads
+    std::vector<int> candidates;
+    for (int n = 2; n < n_threads_max; n += n < 4 ? 1 : n < 8 ? 2 : n/4) {
+        candidates.push_back(n);
+    }
+    candidates.push_back(n_threads_max);
+
+    // decode after a short prompt, the same positions for every thread count
+    const int n_prompt = std::min(32, model.hparams.n_ctx/2);
+    const int n_steps  = std::min(8,  model.hparams.n_ctx - n_prompt);
+
+    std::vector<gpt_vocab::id> prompt(n_prompt);
+    for (int i = 0; i < n_prompt; ++i) {
+        prompt[i] = i % model.hparams.n_vocab;
+    }
+
+    std::vector<float> logits;
+    std::vector<float> embeddings;
+
+    {
+        bloom_tune_scope scope(model);
+
+        if (n_steps > 0 && bloom_eval(model, n_threads_max, 0, prompt, logits, embeddings, mem_per_token)) {
+            n_threads = bloom_tune_plateau(__func__, "n_threads", candidates, [&](int n) {
+                // the fastest step, the others were slowed down by something else
+                double t_us = 0.0;
+                for (int i = 0; i < n_steps; ++i) {
+                    const int64_t t_start_us = ggml_time_us();
+                    if (!bloom_eval(model, n, n_prompt + i, { prompt[i] }, logits, embeddings, mem_per_token)) {
+                        return 0.0;
+                    }
+
+                    const double t = (double) (ggml_time_us() - t_start_us);
+                    t_us = i == 0 ? t : std::min(t_us, t);
+                }
+                return t_us;
+            });
+        }
+    }
+
+    if (n_threads > 0) {
+        bloom_tune_cache_put("n_threads_decode", key, n_threads);
+    } else {
+        n_threads = n_threads_max;
+    }
+
+    fprintf(stderr, "%s: %d decode threads of %d\n", __func__, n_threads, n_threads_max);
+
+    model.n_threads_decode = n_threads;
+
+    return n_threads;
+}
+
+static const char * BLOOM_PERF_BLOCK_NAME[BLOOM_PERF_BLOCK_COUNT] = {
+    "embd",
+    "qkv",
+    "attn",
+    "wo",
+    "ffn",
+    "lm_head",
+};
+
+static const char * BLOOM_PERF_PHASE_NAME[BLOOM_PERF_PHASE_COUNT] = {
+    "prefill",
+    "decode",
+};
+
+void bloom_perf_probe(bloom_perf & perf, int n_threads) {
+    n_threads = std::max(1, n_threads);
+
+    // STREAM-like read: larger than any last level cache, each thread sums its own slice
+    {
+        const size_t n = (512u*1024*1024)/sizeof(uint64_t);
+
+        std::vector<uint64_t> data(n, 1);
+        std::vector<uint64_t> sums(n_threads*8);
+
+        double best_us = 1e30;
+        for (int rep = 0; rep < 5; ++rep) {
+            const int64_t t_start_us = ggml_time_us();
+
+            std::vector<std::thread> workers;
+            for (int ith = 0; ith < n_threads; ++ith) {
+                workers.emplace_back([&, ith]() {
+                    const size_t i0 = (n*ith)/n_threads;
+                    const size_t i1 = (n*(ith + 1))/n_threads;
+
+                    uint64_t sum = 0;
+                    for (size_t i = i0; i < i1; ++i) {
+                        sum += data[i];
+                    }
+                    sums[ith*8] = sum; // a cache line per thread
+                });
+            }
+            for (auto & w : workers) {
+                w.join();
+            }
+
+            best_us = std::min(best_us, (double) (ggml_time_us() - t_start_us));
+        }
+
+        perf.peak_gbps = n*sizeof(uint64_t)/(1e3*best_us);
+    }
+
+    // independent multiply-add chains in registers, enough of them to cover the FMA latency
+    {
+        const int n_iter = 1 << 20;
+        const int n_lane = 64;
+
+        std::vector<float> sums(n_threads*16);
+
+        double best_us = 1e30;
+        for (int rep = 0; rep < 3; ++rep) {
+            const int64_t t_start_us = ggml_time_us();
+
+            std::vector<std::thread> workers;
+            for (int ith = 0; ith < n_threads; ++ith) {
+                workers.emplace_back([&, ith]() {
+                    float x[n_lane];
+                    for (int i = 0; i < n_lane; ++i) {
+                        x[i] = 1.0f + i*1e-3f;
+                    }
+
+                    const float a = 0.999f;
+                    const float b = 1e-3f;
+                    for (int it = 0; it < n_iter; ++it) {
+                        for (int i = 0; i < n_lane; ++i) {
+#if defined(__FMA__)
+                            x[i] = std::fma(x[i], a, b);
+#else
+                            x[i] = x[i]*a + b;
+#endif
+                        }
+                    }
+
+                    float sum = 0.0f;
+                    for (int i = 0; i < n_lane; ++i) {
+                        sum += x[i];
+                    }
+                    sums[ith*16] = sum;
+                });
+            }
+            for (auto & w : workers) {
+                w.join();
+            }
+
+            best_us = std::min(best_us, (double) (ggml_time_us() - t_start_us));
+        }
+
+        perf.peak_gflops = 2.0*n_lane*n_iter*n_threads/(1e3*best_us);
+    }
+}
+
+// one row of hardware counters: per token counts, IPC and the memory traffic they imply
+static void bloom_perf_print_hwc(
+        const struct ggml_hwc * hwc,
+        const char * name,
+        const std::array<int64_t, GGML_HWC_COUNT> & count,
+        int64_t t_us,
+        int n_tokens) {
+    printf("  %-16s", name);
+
+    for (int k = 0; k < GGML_HWC_COUNT; ++k) {
+        if (ggml_hwc_available(hwc, (enum ggml_hwc_event) k)) {
+            printf(" %12.3f", count[k]/1e3/n_tokens);
+        } else {
+            printf(" %12s", "n/a");
+        }
+    }
+
+    if (ggml_hwc_available(hwc, GGML_HWC_CYCLES) && ggml_hwc_available(hwc, GGML_HWC_INSTRUCTIONS) && count[GGML_HWC_CYCLES] > 0) {
+        printf(" %6.2f", (double) count[GGML_HWC_INSTRUCTIONS]/count[GGML_HWC_CYCLES]);
+    } else {
+        printf(" %6s", "n/a");
+    }
+
+    // a cache line per miss - the memory reads are exact where the CPU counts them, the llc misses an estimate
+    const enum ggml_hwc_event traffic = ggml_hwc_available(hwc, GGML_HWC_MEM_READS) ? GGML_HWC_MEM_READS : GGML_HWC_LLC_MISSES;
+    if (ggml_hwc_available(hwc, traffic) && t_us > 0) {
+        printf(" %8.2f", 64.0*count[traffic]/(1e3*t_us));
+    } else {
+        printf(" %8s", "n/a");
+    }
+
+    printf("\n");
+}
+
+static void bloom_perf_print_hwc_header(const char * name) {
+    printf("\n");
+    printf("  %-16s", name);
+    for (int k = 0; k < GGML_HWC_COUNT; ++k) {
+        printf(" %12s", ggml_hwc_name((enum ggml_hwc_event) k));
+    }
+    printf(" %6s %8s   (thousands per token)\n", "IPC", "GB/s");
+}
+
+void bloom_perf_print(const bloom_perf & perf) {
+    for (int ip = 0; ip < BLOOM_PERF_PHASE_COUNT; ++ip) {
+        const bloom_perf_stats & stats = perf.phase[ip];
+        if (stats.n_eval == 0) {
+            continue;
+        }
+
+        const double t_eval_ms = stats.t_eval_us/1000.0;
+        const int n_tokens = stats.n_tokens;
+
+        printf("\n");
+        printf("%s: %s - %d evals, %d tokens, %.2f ms, %.2f ms per token\n", __func__,
+                BLOOM_PERF_PHASE_NAME[ip], stats.n_eval, n_tokens, t_eval_ms, t_eval_ms/n_tokens);
+
+        // ops, slowest first
+        std::vector<int> ops;
+        for (int op = 0; op < GGML_OP_COUNT; ++op) {
+            if (stats.op_runs[op] > 0) {
+                ops.push_back(op);
+            }
+        }
+        std::sort(ops.begin(), ops.end(), [&](int a, int b) { return stats.op_time_us[a] > stats.op_time_us[b]; });
+
+        printf("\n");
+        printf("  %-16s %8s %12s %10s %7s\n", "op", "runs", "total ms", "ms/token", "%");
+        for (int op : ops) {
+            const double t_ms = stats.op_time_us[op]/1000.0;
+            printf("  %-16s %8d %12.3f %10.3f %6.2f%%\n", ggml_op_name((enum ggml_op) op),
+                    stats.op_runs[op], t_ms, t_ms/n_tokens, 100.0*t_ms/t_eval_ms);
+        }
+        {
+            // graph building, optimization, thread start-up and copying out the results
+            const double t_ms = (stats.t_eval_us - stats.t_graph_us)/1000.0;
+            printf("  %-16s %8s %12.3f %10.3f %6.2f%%\n", "(other)", "", t_ms, t_ms/n_tokens, 100.0*t_ms/t_eval_ms);
+        }
+
+        printf("\n");
+        printf("  %-16s %12s %10s %7s\n", "block", "total ms", "ms/token", "%");
+        for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+            const double t_ms = stats.block_time_us[ib]/1000.0;
+            printf("  %-16s %12.3f %10.3f %6.2f%%\n", BLOOM_PERF_BLOCK_NAME[ib], t_ms, t_ms/n_tokens, 100.0*t_ms/t_eval_ms);
+        }
+
+        // roofline of the matrix multiplications, against the probed peaks
+        {
+            const double balance = perf.peak_gbps > 0.0 ? perf.peak_gflops/perf.peak_gbps : 0.0;
+
+            printf("\n");
+            printf("  %-16s %10s %12s %10s %8s %6s %9s %6s  %s\n", "mul_mat", "MB/token", "GFLOP/token", "ms/token", "GB/s", "%peak", "GFLOP/s", "%peak", "bound");
+            for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+                if (stats.mm_time_us[ib] == 0) {
+                    continue;
+                }
+
+                const double gbps   = stats.mm_bytes[ib]/(1e3*stats.mm_time_us[ib]);
+                const double gflops = stats.mm_flops[ib]/(1e3*stats.mm_time_us[ib]);
+                const double intensity = (double) stats.mm_flops[ib]/stats.mm_bytes[ib];
+
+                printf("  %-16s %10.2f %12.3f %10.3f %8.2f %5.1f%% %9.2f %5.1f%%  %s\n", BLOOM_PERF_BLOCK_NAME[ib],
+                        stats.mm_bytes[ib]/1e6/n_tokens, stats.mm_flops[ib]/1e9/n_tokens, stats.mm_time_us[ib]/1e3/n_tokens,
+                        gbps,   perf.peak_gbps   > 0.0 ? 100.0*gbps/perf.peak_gbps     : 0.0,
+                        gflops, perf.peak_gflops > 0.0 ? 100.0*gflops/perf.peak_gflops : 0.0,
+                        balance == 0.0 ? "" : intensity < balance ? "memory" : "compute");
+            }
+
+            int64_t mm_bytes = 0;
+            for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+                mm_bytes += stats.mm_bytes[ib];
+            }
+
+            // end to end: every byte of the weights is read once per eval
+            const double gbps = mm_bytes/(1e3*stats.t_eval_us);
+
+            printf("\n");
+            if (perf.peak_gbps > 0.0) {
+                printf("%s: %s running at %.1f%% of memory bandwidth (%.2f of %.2f GB/s), peak %.1f GFLOP/s\n", __func__,
+                        BLOOM_PERF_PHASE_NAME[ip], 100.0*gbps/perf.peak_gbps, gbps, perf.peak_gbps, perf.peak_gflops);
+            } else {
+                printf("%s: %s streaming %.2f GB/s (no peak measured)\n", __func__, BLOOM_PERF_PHASE_NAME[ip], gbps);
+            }
+        }
+
+        if (perf.hwc) {
+            bloom_perf_print_hwc_header("op");
+            for (int op : ops) {
+                bloom_perf_print_hwc(perf.hwc, ggml_op_name((enum ggml_op) op), stats.op_hwc[op], stats.op_time_us[op], n_tokens);
+            }
+
+            bloom_perf_print_hwc_header("block");
+            for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+                bloom_perf_print_hwc(perf.hwc, BLOOM_PERF_BLOCK_NAME[ib], stats.block_hwc[ib], stats.block_time_us[ib], n_tokens);
+            }
+        }
+
+        printf("\n");
+        printf("  %-5s %10s %10s %10s %10s %10s   (ms/token)\n", "layer", "qkv", "attn", "wo", "ffn", "total");
+        for (int il = 0; il < (int) stats.layer_time_us.size(); ++il) {
+            const auto & t = stats.layer_time_us[il];
+            const int64_t t_us = t[BLOOM_PERF_QKV] + t[BLOOM_PERF_ATTN] + t[BLOOM_PERF_WO] + t[BLOOM_PERF_FFN];
+            printf("  %5d %10.3f %10.3f %10.3f %10.3f %10.3f\n", il,
+                    t[BLOOM_PERF_QKV]/1000.0/n_tokens, t[BLOOM_PERF_ATTN]/1000.0/n_tokens,
+                    t[BLOOM_PERF_WO] /1000.0/n_tokens, t[BLOOM_PERF_FFN] /1000.0/n_tokens,
+                    t_us/1000.0/n_tokens);
+        }
+    }
+}
+
+std::string bloom_perf_json(const bloom_perf & perf) {
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "{\"peak_gbps\": %.3f, \"peak_gflops\": %.3f, ", perf.peak_gbps, perf.peak_gflops);
+    std::string json = buf;
+
+    for (int ip = 0; ip < BLOOM_PERF_PHASE_COUNT; ++ip) {
+        const bloom_perf_stats & stats = perf.phase[ip];
+
+        snprintf(buf, sizeof(buf), "%s\"%s\": {\"n_eval\": %d, \"n_tokens\": %d, \"t_eval_us\": %" PRId64 ", \"t_graph_us\": %" PRId64 ", \"ops\": {",
+                ip > 0 ? ", " : "", BLOOM_PERF_PHASE_NAME[ip], stats.n_eval, stats.n_tokens, stats.t_eval_us, stats.t_graph_us);
+        json += buf;
+
+        bool first = true;
+        for (int op = 0; op < GGML_OP_COUNT; ++op) {
+            if (stats.op_runs[op] == 0) {
+                continue;
+            }
+            snprintf(buf, sizeof(buf), "%s\"%s\": {\"runs\": %d, \"t_us\": %" PRId64 "}",
+                    first ? "" : ", ", ggml_op_name((enum ggml_op) op), stats.op_runs[op], stats.op_time_us[op]);
+            json += buf;
+            first = false;
+        }
+
+        json += "}, \"blocks\": {";
+        for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+            snprintf(buf, sizeof(buf), "%s\"%s\": %" PRId64, ib > 0 ? ", " : "", BLOOM_PERF_BLOCK_NAME[ib], stats.block_time_us[ib]);
+            json += buf;
+        }
+
+        json += "}, \"layers\": [";
+        for (int il = 0; il < (int) stats.layer_time_us.size(); ++il) {
+            const auto & t = stats.layer_time_us[il];
+            snprintf(buf, sizeof(buf), "%s{\"qkv\": %" PRId64 ", \"attn\": %" PRId64 ", \"wo\": %" PRId64 ", \"ffn\": %" PRId64 "}",
+                    il > 0 ? ", " : "", t[BLOOM_PERF_QKV], t[BLOOM_PERF_ATTN], t[BLOOM_PERF_WO], t[BLOOM_PERF_FFN]);
+            json += buf;
+        }
+        json += "], \"mul_mat\": {";
+        for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+            snprintf(buf, sizeof(buf), "%s\"%s\": {\"bytes\": %" PRId64 ", \"flops\": %" PRId64 ", \"t_us\": %" PRId64 "}",
+                    ib > 0 ? ", " : "", BLOOM_PERF_BLOCK_NAME[ib], stats.mm_bytes[ib], stats.mm_flops[ib], stats.mm_time_us[ib]);
+            json += buf;
+        }
+        json += "}";
+
+        if (perf.hwc) {
+            // only the counters that could be opened
+            auto counters = [&](const std::array<int64_t, GGML_HWC_COUNT> & count) {
+                json += "{";
+                bool first = true;
+                for (int k = 0; k < GGML_HWC_COUNT; ++k) {
+                    if (!ggml_hwc_available(perf.hwc, (enum ggml_hwc_event) k)) {
+                        continue;
+                    }
+                    snprintf(buf, sizeof(buf), "%s\"%s\": %" PRId64, first ? "" : ", ", ggml_hwc_name((enum ggml_hwc_event) k), count[k]);
+                    json += buf;
+                    first = false;
+                }
+                json += "}";
+            };
+
+            json += ", \"hwc\": {\"ops\": {";
+            bool first = true;
+            for (int op = 0; op < GGML_OP_COUNT; ++op) {
+                if (stats.op_runs[op] == 0) {
+                    continue;
+                }
+                snprintf(buf, sizeof(buf), "%s\"%s\": ", first ? "" : ", ", ggml_op_name((enum ggml_op) op));
+                json += buf;
+                counters(stats.op_hwc[op]);
+                first = false;
+            }
+
+            json += "}, \"blocks\": {";
+            for (int ib = 0; ib < BLOOM_PERF_BLOCK_COUNT; ++ib) {
+                snprintf(buf, sizeof(buf), "%s\"%s\": ", ib > 0 ? ", " : "", BLOOM_PERF_BLOCK_NAME[ib]);
+                json += buf;
+                counters(stats.block_hwc[ib]);
+            }
+            json += "}}";
+        }
+
+        json += "}";
+    }
+
+    json += "}";
+
+    return json;
+}
+
+static const char * BLOOM_MEM_WEIGHTS_NAME[BLOOM_MEM_WEIGHTS_COUNT] = {
+    "embd",
+    "attn",
+    "ffn",
+    "norm",
+    "lm_head",
+};
+
+static bloom_mem_weights bloom_mem_class(const std::string & name) {
+    if (name.find("tok_embeddings") != std::string::npos) {
+        return BLOOM_MEM_EMBD;
+    }
+    if (name == "output.weight") {
+        return BLOOM_MEM_LM_HEAD;
+    }
+    if (name.find(".attention.") != std::string::npos) {
+        return BLOOM_MEM_ATTN;
+    }
+    if (name.find(".feed_forward.") != std::string::npos) {
+        return BLOOM_MEM_FFN;
+    }
+    return BLOOM_MEM_NORM;
+}
+
+// heap bytes of a string, the short strings are stored inline
+static size_t bloom_mem_string(const std::string & str) {
+    return str.capacity() > sizeof(std::string) - 2*sizeof(size_t) ? str.capacity() + 1 : 0;
+}
+
+static size_t bloom_mem_vocab(const gpt_vocab & vocab) {
+    // a red-black tree node has 3 pointers and the color on top of the key and the value
+    const size_t node = 4*sizeof(void *);
+
+    size_t size = 0;
+
+    for (const auto & kv : vocab.token_to_id) {
+        size += node + sizeof(kv) + bloom_mem_string(kv.first);
+    }
+    for (const auto & kv : vocab.id_to_token) {
+        size += node + sizeof(kv) + bloom_mem_string(kv.second);
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        for (const auto * words : { &vocab.words[i], &vocab.space_words[i] }) {
+            size += words->capacity()*sizeof(std::string);
+            for (const auto & word : *words) {
+                size += bloom_mem_string(word);
+            }
+        }
+    }
+
+    return size;
+}
+
+static void bloom_mem_rss(size_t & rss, size_t & peak_rss) {
+    rss      = 0;
+    peak_rss = 0;
+
+#if defined(__linux__)
+    // resident pages are the second field of statm, the peak is VmHWM in status
+    if (FILE * f = fopen("/proc/self/statm", "r")) {
+        unsigned long size = 0, resident = 0;
+        if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+            rss = (size_t) resident*sysconf(_SC_PAGESIZE);
+        }
+        fclose(f);
+    }
+
+    if (FILE * f = fopen("/proc/self/status", "r")) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long kb = 0;
+            if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+                peak_rss = (size_t) kb*1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+#elif defined(__APPLE__) && defined(__MACH__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        peak_rss = usage.ru_maxrss; // bytes on macOS
+    }
+#endif
+}
+
+bloom_mem_usage bloom_mem_report(const bloom_model & model, const gpt_vocab & vocab) {
+    bloom_mem_usage mem;
+
+    for (const auto & kv : model.tensors) {
+        mem.weights[bloom_mem_class(kv.first)] += ggml_nbytes(kv.second);
+    }
+
+    mem.kv_cache = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
+
+    mem.ctx_size = ggml_get_mem_size(model.ctx);
+    mem.ctx_used = ggml_used_mem(model.ctx);
+
+    mem.arena_size = bloom_eval_buf_size;
+    mem.arena_peak = bloom_eval_buf_peak;
+
+    mem.vocab = bloom_mem_vocab(vocab);
+
+    bloom_mem_rss(mem.rss, mem.peak_rss);
+
+    return mem;
+}
+
+void bloom_mem_print(const bloom_mem_usage & mem) {
+    const double MB = 1024.0*1024.0;
+
+    size_t weights = 0;
+    for (size_t w : mem.weights) {
+        weights += w;
+    }
+
+    printf("\n");
+    printf("%s: memory usage\n", __func__);
+    printf("  %-22s %12.2f MB\n", "weights", weights/MB);
+    for (int iw = 0; iw < BLOOM_MEM_WEIGHTS_COUNT; ++iw) {
+        printf("    %-20s %12.2f MB  %5.1f%%\n", BLOOM_MEM_WEIGHTS_NAME[iw], mem.weights[iw]/MB, 100.0*mem.weights[iw]/std::max<size_t>(weights, 1));
+    }
+    printf("  %-22s %12.2f MB\n", "kv cache", mem.kv_cache/MB);
+    printf("  %-22s %12.2f MB  (of %.2f MB reserved, with the tensor objects and padding)\n", "model ctx used", mem.ctx_used/MB, mem.ctx_size/MB);
+    printf("  %-22s %12.2f MB  (of %.2f MB allocated)\n", "compute peak", mem.arena_peak/MB, mem.arena_size/MB);
+    printf("  %-22s %12.2f MB\n", "vocab", mem.vocab/MB);
+    if (mem.rss > 0 || mem.peak_rss > 0) {
+        printf("  %-22s %12.2f MB  (peak %.2f MB)\n", "process rss", mem.rss/MB, mem.peak_rss/MB);
+    } else {
+        printf("  %-22s %12s\n", "process rss", "n/a");
+    }
+}
+
+std::string bloom_mem_json(const bloom_mem_usage & mem) {
+    char buf[256];
+
+    std::string json = "{\"weights\": {";
+    for (int iw = 0; iw < BLOOM_MEM_WEIGHTS_COUNT; ++iw) {
+        snprintf(buf, sizeof(buf), "%s\"%s\": %zu", iw > 0 ? ", " : "", BLOOM_MEM_WEIGHTS_NAME[iw], mem.weights[iw]);
+        json += buf;
+    }
+
+    snprintf(buf, sizeof(buf), "}, \"kv_cache\": %zu, \"ctx_size\": %zu, \"ctx_used\": %zu, \"arena_size\": %zu, \"arena_peak\": %zu, ",
+            mem.kv_cache, mem.ctx_size, mem.ctx_used, mem.arena_size, mem.arena_peak);
+    json += buf;
+
+    snprintf(buf, sizeof(buf), "\"vocab\": %zu, \"rss\": %zu, \"peak_rss\": %zu}", mem.vocab, mem.rss, mem.peak_rss);
+    json += buf;
+
+    return json;
+}
+
+const double * bloom_histogram_bounds() {
+    static const double bounds[BLOOM_HIST_BUCKETS - 1] = {
+        0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000,
+    };
+
+    return bounds;
+}
+
+void bloom_histogram_add(bloom_histogram & hist, double value) {
+    const double * bounds = bloom_histogram_bounds();
+
+    int i = 0;
+    while (i < BLOOM_HIST_BUCKETS - 1 && value > bounds[i]) {
+        ++i;
+    }
+
+    hist.count[i] += 1;
+    hist.n   += 1;
+    hist.sum += value;
+}
+
+void bloom_metrics_summary_add(bloom_metrics_summary & summary, const bloom_metrics & metrics) {
+    summary.n_requests  += 1;
+    summary.n_prompt    += metrics.n_prompt;
+    summary.n_cached    += metrics.n_cached;
+    summary.n_generated += metrics.n_generated;
+
+    bloom_histogram_add(summary.queue_ms, metrics.queue_ms);
+    bloom_histogram_add(summary.total_ms, metrics.total_ms);
+    if (metrics.n_generated > 0) {
+        bloom_histogram_add(summary.ttft_ms, metrics.ttft_ms);
+    }
+    for (int i = 0; i < metrics.n_decode; ++i) {
+        bloom_histogram_add(summary.decode_ms, metrics.decode_ms[i]);
+    }
+}
+
+std::string bloom_metrics_prometheus(const bloom_model & model, const bloom_metrics_summary & summary) {
+    std::string text;
+    char buf[256];
+
+    auto metric = [&](const char * name, const char * type, const char * help) {
+        snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        text += buf;
+    };
+
+    auto value = [&](const char * name, double v) {
+        snprintf(buf, sizeof(buf), "%s %.9g\n", name, v);
+        text += buf;
+    };
+
+    // the histograms are kept in ms, Prometheus expects seconds
+    auto histogram = [&](const char * name, const char * help, const bloom_histogram & hist) {
+        const double * bounds = bloom_histogram_bounds();
+
+        metric(name, "histogram", help);
+
+        int64_t n = 0;
+        for (int i = 0; i < BLOOM_HIST_BUCKETS - 1; ++i) {
+            n += hist.count[i];
+            snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %" PRId64 "\n", name, bounds[i]/1000.0, n);
+            text += buf;
+        }
+        snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %" PRId64 "\n%s_sum %.9g\n%s_count %" PRId64 "\n",
+                name, hist.n, name, hist.sum/1000.0, name, hist.n);
+        text += buf;
+    };
+
+    metric("bloom_requests_total", "counter", "Requests of bloom_run and forward_api.");
+    value ("bloom_requests_total", summary.n_requests);
+    metric("bloom_prompt_tokens_total", "counter", "Prompt tokens of the requests.");
+    value ("bloom_prompt_tokens_total", summary.n_prompt);
+    metric("bloom_prompt_cached_tokens_total", "counter", "Prompt tokens reused from the kv cache, the prefix cache hits.");
+    value ("bloom_prompt_cached_tokens_total", summary.n_cached);
+    metric("bloom_generated_tokens_total", "counter", "Sampled tokens.");
+    value ("bloom_generated_tokens_total", summary.n_generated);
+
+    histogram("bloom_queue_seconds",       "Time waiting for the previous request.", summary.queue_ms);
+    histogram("bloom_ttft_seconds",        "Time to the first token.",               summary.ttft_ms);
+    histogram("bloom_inter_token_seconds", "Latency of the decode steps.",           summary.decode_ms);
+    histogram("bloom_request_seconds",     "Total time of the requests.",            summary.total_ms);
+
+    metric("bloom_kv_cache_capacity_tokens", "gauge", "Size of the kv caches of all the sequences.");
+    value ("bloom_kv_cache_capacity_tokens", (double) model.hparams.n_ctx*model.hparams.n_seq);
+
+    if (model.counters) {
+        const bloom_counters & counters = *model.counters;
+
+        metric("bloom_kv_cache_tokens", "gauge", "Tokens in the kv caches.");
+        value ("bloom_kv_cache_tokens", counters.n_kv.load(std::memory_order_relaxed));
+
+        metric("bloom_eval_seconds_total", "counter", "Time in bloom_eval.");
+        value ("bloom_eval_seconds_total", counters.t_eval_us.load(std::memory_order_relaxed)/1e6);
+
+        metric("bloom_eval_batch_size", "histogram", "Tokens per bloom_eval.");
+        int64_t n = 0;
+        for (int i = 0; i < BLOOM_BATCH_BUCKETS - 1; ++i) {
+            n += counters.n_batch[i].load(std::memory_order_relaxed);
+            snprintf(buf, sizeof(buf), "bloom_eval_batch_size_bucket{le=\"%d\"} %" PRId64 "\n", 1 << i, n);
+            text += buf;
+        }
+        n += counters.n_batch[BLOOM_BATCH_BUCKETS - 1].load(std::memory_order_relaxed);
+        snprintf(buf, sizeof(buf), "bloom_eval_batch_size_bucket{le=\"+Inf\"} %" PRId64 "\nbloom_eval_batch_size_sum %" PRId64 "\nbloom_eval_batch_size_count %" PRId64 "\n",
+                n, counters.n_tokens.load(std::memory_order_relaxed), n);
+        text += buf;
+
+        metric("bloom_pool_seconds_total", "counter", "Time of the compute threads by state, busy/(busy + spin) is the pool utilization.");
+        value ("bloom_pool_seconds_total{state=\"busy\"}", counters.pool_busy_us.load(std::memory_order_relaxed)/1e6);
+        value ("bloom_pool_seconds_total{state=\"spin\"}", counters.pool_spin_us.load(std::memory_order_relaxed)/1e6);
+    }
+
+    return text;
+}
+
+struct bloom_exporter {
+    std::function<std::string()> fn;
+
+    int fd = -1;
+    std::string path; // of the unix socket, removed on stop
+
+    std::atomic<bool> stop {false};
+    std::thread thread;
+};
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+
+static void bloom_exporter_reply(bloom_exporter * exporter, int fd) {
+    // read the request line and headers, a scraper sends no body
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            return;
+        }
+
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return;
+        }
+        request.append(buf, n);
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics? ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+        body = exporter->fn();
+    } else {
+        status = "404 Not Found";
+        body   = "not found\n";
+    }
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            status.c_str(), body.size());
+
+    const std::string reply = buf + body;
+    for (size_t offs = 0; offs < reply.size(); ) {
+        const ssize_t n = send(fd, reply.data() + offs, reply.size() - offs, 0);
+        if (n <= 0) {
+            return;
+        }
+        offs += n;
+    }
+}
+
+bloom_exporter * bloom_exporter_start(const std::string & addr, std::function<std::string()> fn) {
+    int fd = -1;
+    std::string path;
+
+    if (addr.compare(0, 5, "unix:") == 0) {
+        path = addr.substr(5);
+
+        sockaddr_un sa = {};
+        if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+            fprintf(stderr, "%s: invalid unix socket path '%s'\n", __func__, path.c_str());
+            return nullptr;
+        }
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, path.c_str());
+
+        unlink(path.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (const sockaddr *) &sa, sizeof(sa)) != 0) {
+            fprintf(stderr, "%s: failed to bind '%s'\n", __func__, addr.c_str());
+            if (fd >= 0) {
+                close(fd);
+            }
+            return nullptr;
+        }
+    } else {
+        const size_t colon = addr.rfind(':');
+        if (colon == std::string::npos) {
+            fprintf(stderr, "%s: expected host:port or unix:path, got '%s'\n", __func__, addr.c_str());
+            return nullptr;
+        }
+        const std::string host = addr.substr(0, colon);
+        const std::string port = addr.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+
+        addrinfo * res = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) {
+            fprintf(stderr, "%s: failed to resolve '%s'\n", __func__, addr.c_str());
+            return nullptr;
+        }
+
+        for (addrinfo * ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            const int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            fprintf(stderr, "%s: failed to bind '%s'\n", __func__, addr.c_str());
+            return nullptr;
+        }
+    }
+
+    if (listen(fd, 16) != 0) {
+        fprintf(stderr, "%s: failed to listen on '%s'\n", __func__, addr.c_str());
+        close(fd);
+        return nullptr;
+    }
+
+    bloom_exporter * exporter = new bloom_exporter;
+    exporter->fn   = fn;
+    exporter->fd   = fd;
+    exporter->path = path;
+
+    // poll with a timeout, so that the thread sees the stop flag without closing the socket under it
+    exporter->thread = std::thread([exporter]() {
+        while (!exporter->stop.load()) {
+            pollfd pfd = { exporter->fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+
+            const int conn = accept(exporter->fd, nullptr, nullptr);
+            if (conn < 0) {
+                continue;
+            }
+
+            bloom_exporter_reply(exporter, conn);
+            close(conn);
+        }
+    });
+
+    return exporter;
+}
+
+void bloom_exporter_stop(bloom_exporter * exporter) {
+    if (exporter == nullptr) {
+        return;
+    }
+
+    exporter->stop = true;
+    exporter->thread.join();
+
+    close(exporter->fd);
+    if (!exporter->path.empty()) {
+        unlink(exporter->path.c_str());
+    }
+
+    delete exporter;
+}
+
+#else
+
+bloom_exporter * bloom_exporter_start(const std::string & addr, std::function<std::string()> fn) {
+    fprintf(stderr, "%s: the metrics exporter is not supported on this platform\n", __func__);
+    return nullptr;
+}
+
+void bloom_exporter_stop(bloom_exporter * exporter) {
+    delete exporter;
+}
+
+#endif
+
+extern "C" ChatContext* bloom_load(const char * fname, int n_ctx, int n_threads) {
+    ChatContext * ctx = new ChatContext{};
+
+    // init model and vocab
+    bool res = bloom_model_load(fname, ctx->model, ctx->vocab, n_ctx);
+    if (!res) {
+        return 0;
+    }
+
+    // determine the required inference memory per token:
+    res = bloom_eval(ctx->model,
+                     n_threads,
+                     0,
+                     { 0, 1, 2, 3 },
+                     ctx->logits,
+                     ctx->embeddings,
+                     ctx->mem_per_token);
+    if (!res) {
+        return 0;
+    }
+
+    ctx->model.counters = &ctx->counters;
+
+    ctx->cached_tokens.reserve(ctx->model.hparams.n_ctx);
+    ctx->decode_ms.reserve(ctx->model.hparams.n_ctx);
+
+    return ctx;
+}
+
+extern "C" void bloom_free(ChatContext* ctx) {
+    bloom_exporter_stop(ctx->exporter);
+    delete ctx;
+}
+
+// true once the request called at t_start_us is cancelled or past its deadline - a functor, a std::function of the
+// state would be allocated for every call
+struct bloom_stop_token {
+    ChatContext * ctx;
+    uint32_t gen;
+    int64_t  t_end_us;
+
+    bloom_stop_token(ChatContext *ctx, int64_t t_start_us) : ctx(ctx) {
+        const int32_t timeout_ms = ctx->timeout_ms.load();
+
+        gen      = ctx->cancel_gen.load();
+        t_end_us = timeout_ms > 0 ? t_start_us + (int64_t) timeout_ms*1000 : INT64_MAX;
+    }
+
+    bool operator()() const {
+        return ctx->cancel_gen.load() != gen || ggml_time_us() >= t_end_us;
+    }
+};
+
+// prefill, then sample and decode until the end of text or n_predict tokens, the timings go to metrics
+//
+// stop is checked before every eval, returns 0 when done, 1 when stopped and -1 on error.
+// tokens hold the evaluated tokens on return, they match the kv cache. last_n_tokens is used as a ring buffer.
+//
+// The generation is done after a token of params.eos_ids, or at the token that completes one of the stop strings,
+// and then the text ends before the stop string.
+//
+// With a grammar, only the tokens it allows are sampled, and the generation is done when it allows none. A token it
+// allows alone is taken without sampling, and is evaluated with the tokens before it: no eval runs for its logits.
+//
+// Nothing is allocated per generated token as long as tokens and decode_ms have the capacity for n_predict more.
+int inference(gpt_params & params,
+              const bloom_model & model,
+              const gpt_vocab & vocab,
+              size_t mem_per_token,
+              std::vector<gpt_vocab::id>& tokens,
+              std::vector<gpt_vocab::id>& last_n_tokens,
+              int n_past,
+              char * dst,
+              bloom_metrics & metrics,
+              std::vector<float> & decode_ms,
+              bloom_sampler_buf & sampler,
+              bloom_stop_matcher & stops,
+              bloom_grammar * grammar,
+              const bloom_stop_token & stop) {
+    ggml_time_init();
+    const int64_t t_start_us = ggml_time_us();
+
+    int64_t t_sample_us  = 0;
+    int64_t t_eval_us = 0;
+
+    std::mt19937 rng(params.seed);
+    std::vector<float> logits, embeddings;
+
+    while (n_past < tokens.size()) {
+        if (stop()) {
+            tokens.resize(n_past);
+            metrics.prefill_ms = t_eval_us/1000.0;
+            return 1;
+        }
+
+        // eval input prompt
+        const int64_t t_start_eval_us = ggml_time_us();
+
+        int n = std::min((size_t)params.n_batch, tokens.size() - n_past);
+        const bloom_seq seq = { 0, n_past, tokens.data() + n_past, n };
+        if (!bloom_eval_batch(model,
+                              params.n_threads,
+                              &seq,
+                              1,
+                              logits,
+                              embeddings,
+                              mem_per_token)) {
+            // todo: better error handling
+            fprintf(stderr, "Failed to predict\n");
+            tokens.resize(n_past);
+            return -1;
+        }
+        n_past += n;
+
+        t_eval_us += ggml_time_us() - t_start_eval_us;
+    }
+
+    bloom_stop_matcher_reset(stops);
+
+    int ret = 0;
+    int n_predict = 0;
+    size_t i_last = 0;
+    int32_t grammar_state = 0;
+    while (1) {
+        gpt_vocab::id id = 0;
+        bool done = false;
+        {
+            // sample next token
+            const int64_t t_start_sample_us = ggml_time_us();
+
+            const bloom_token_mask * mask = grammar ? &bloom_grammar_mask(*grammar, grammar_state) : nullptr;
+            if (mask && mask->n_allowed == 0) {
+                // no token goes on with a match
+                break;
+            }
+
+            if (mask && mask->n_allowed == 1) {
+                id = mask->ids[0];
+            } else {
+                id = bloom_sample_top_p(vocab,
+                                        logits.data() + (logits.size() - model.hparams.n_vocab),
+                                        last_n_tokens,
+                                        params.repeat_penalty,
+                                        params.top_p,
+                                        params.top_k,
+                                        params.temp,
+                                        rng,
+                                        sampler,
+                                        mask);
+            }
+            if (mask) {
+                grammar_state = bloom_grammar_next(*grammar, grammar_state, vocab, id);
+            }
+            if (!last_n_tokens.empty()) {
+                last_n_tokens[i_last] = id;
+                i_last = (i_last + 1) % last_n_tokens.size();
+            }
+            ++n_predict;
+
+            const auto& word = vocab.id_to_token.find(id)->second;
+            strcpy(dst, word.c_str());
+            dst += word.size();
+
+            int i_stop = -1;
+            const int n_stop = bloom_stop_matcher_feed(stops, word.data(), word.size(), i_stop);
+            if (n_stop >= 0) {
+                // the stop string may have started in the previous tokens
+                dst -= word.size() - n_stop + stops.stops[i_stop].size();
+                dst[0] = '\0';
+                done = true;
+            }
+            done = done || std::find(params.eos_ids.begin(), params.eos_ids.end(), id) != params.eos_ids.end();
+
+            t_sample_us += ggml_time_us() - t_start_sample_us;
+
+            if (n_predict == 1) {
+                metrics.ttft_ms += (ggml_time_us() - t_start_us)/1000.0;
+            }
+        }
+        if (done || n_predict >= params.n_predict) {
+            // end of text token, stop string or reach the token number limit
+            break;
+        }
+
+        tokens.push_back(id);
+
+        // the next token does not need the logits
+        if (grammar && bloom_grammar_forced(*grammar, grammar_state) >= 0) {
+            continue;
+        }
+
+        if (stop()) {
+            ret = 1;
+            break;
+        }
+
+        {
+            // predict the next token
+            const int64_t t_start_predict_us = ggml_time_us();
+
+            const bloom_seq seq = { 0, n_past, tokens.data() + n_past, (int) tokens.size() - n_past };
+            if (!bloom_eval_batch(model,
+                                  params.n_threads,
+                                  &seq,
+                                  1,
+                                  logits,
+                                  embeddings,
+                                  mem_per_token)) {
+                // todo: better error handling
+                fprintf(stderr, "Failed to predict\n");
+                ret = -1;
+                break;
+            }
+            n_past = tokens.size();
+
+            decode_ms.push_back((ggml_time_us() - t_start_predict_us)/1000.0f);
+        }
+    }
+
+    // the tokens taken after the last eval are not in the kv cache
+    tokens.resize(n_past);
+
+    metrics.n_generated = n_predict;
+    metrics.prefill_ms  = t_eval_us/1000.0;
+    metrics.sample_ms   = t_sample_us/1000.0;
+
+    return ret;
+}
+
+// the last repeat_last_n tokens, padded with 0 at the front - last_n_tokens keeps its capacity across the requests
+static void chat_last_n_tokens(const std::vector<gpt_vocab::id> & tokens, int repeat_last_n, std::vector<gpt_vocab::id> & last_n_tokens) {
+    const int n_tokens = tokens.size();
+
+    last_n_tokens.assign(std::max(repeat_last_n - n_tokens, 0), 0);
+    last_n_tokens.insert(last_n_tokens.end(), tokens.end() - std::min(n_tokens, repeat_last_n), tokens.end());
+}
+
+// the n_batch argument of the C API, 0 or less for the size tuned for the model and n_threads - must hold ctx->mutex
+static int32_t chat_n_batch(ChatContext *ctx, int32_t n_threads, int32_t n_batch) {
+    if (n_batch > 0) {
+        return n_batch;
+    }
+
+    // the tuning evals overwrite the kv cache
+    if (ctx->model.n_batch_tuned.count(n_threads) == 0) {
+        ctx->cached_tokens.clear();
+    }
+
+    return bloom_tune_n_batch(ctx->model, n_threads, ctx->mem_per_token);
+}
+
+// cancel the running request and the ones waiting for the context, the later ones are not affected
+//
+// bloom_run returns 1 with the text so far, forward_api returns -1.
+extern "C" void bloom_cancel(ChatContext *ctx) {
+    ctx->cancel_gen.fetch_add(1);
+}
+
+// stop the next requests timeout_ms after their call, the wait for the context included, 0 for no deadline
+extern "C" void bloom_set_timeout(ChatContext *ctx, int32_t timeout_ms) {
+    ctx->timeout_ms.store(std::max(timeout_ms, 0));
+}
+
+// the threads of the single token evals of the next requests, 0 for their n_threads argument, and less than 0 to
+// calibrate it up to -n_threads_decode threads (see bloom_tune_threads_decode) - returns the count set
+extern "C" int32_t bloom_set_threads_decode(ChatContext *ctx, int32_t n_threads_decode) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    if (n_threads_decode >= 0) {
+        ctx->model.n_threads_decode = n_threads_decode;
+        return n_threads_decode;
+    }
+
+    // the calibration evals overwrite the kv cache
+    ctx->cached_tokens.clear();
+
+    return bloom_tune_threads_decode(ctx->model, -n_threads_decode, ctx->mem_per_token);
+}
+
+// pin the compute threads of the prompt and of the single token evals to these CPUs, thread i on cpus[i % n_cpus],
+// n_cpus = 0 for thread i on CPU i
+extern "C" void bloom_set_cpus(ChatContext *ctx, const int32_t *cpus, int32_t n_cpus, const int32_t *cpus_decode, int32_t n_cpus_decode) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    ctx->model.cpus       .assign(cpus,        cpus        + std::max(n_cpus,        0));
+    ctx->model.cpus_decode.assign(cpus_decode, cpus_decode + std::max(n_cpus_decode, 0));
+}
+
+// the tokens that end the generation of the next bloom_run calls, 2 (</s>) by default, n_ids = 0 for none
+extern "C" void bloom_set_eos(ChatContext *ctx, const int32_t *ids, int32_t n_ids) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    ctx->eos_ids.assign(ids, ids + std::max(n_ids, 0));
+
+    // the masks of the regex allow the end of text tokens
+    if (!ctx->grammar.pattern.empty()) {
+        const std::string pattern = ctx->grammar.pattern;
+        std::string err;
+        bloom_grammar_init(ctx->grammar, pattern, ctx->trie, ctx->eos_ids, err);
+    }
+}
+
+// the strings that end the generation of the next bloom_run calls, n_stops = 0 for none
+//
+// They are matched in the generated text as it is decoded, also across the tokens: the generation stops at the token
+// that completes one, and the text returned ends before it.
+extern "C" void bloom_set_stop(ChatContext *ctx, const char * const *stops, int32_t n_stops) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    bloom_stop_matcher_init(ctx->stops, std::vector<std::string>(stops, stops + std::max(n_stops, 0)));
+}
+
+// constrain the text of the next bloom_run calls to the matches of a regular expression, nullptr or "" for none - see
+// bloom_grammar for the syntax. Returns 0, or -1 if the pattern is not valid and then the constraint does not change.
+//
+// The masks of the allowed tokens are computed as the states of the pattern are reached and kept until the next call.
+extern "C" int bloom_set_regex(ChatContext *ctx, const char *regex) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    if (!regex || !*regex) {
+        ctx->grammar = bloom_grammar();
+        return 0;
+    }
+
+    if (ctx->trie.ids.empty()) {
+        bloom_token_trie_init(ctx->trie, ctx->vocab);
+    }
+
+    bloom_grammar grammar;
+    std::string err;
+    if (!bloom_grammar_init(grammar, regex, ctx->trie, ctx->eos_ids, err)) {
+        fprintf(stderr, "%s: invalid regex '%s': %s\n", __func__, regex, err.c_str());
+        return -1;
+    }
+    ctx->grammar = std::move(grammar);
+
+    return 0;
+}
+
+extern "C" int bloom_run(ChatContext *ctx,
+                         int32_t seed,
+                         int32_t n_threads,
+                         int32_t n_batch,
+                         int32_t n_predict,
+                         bool match_str,
+                         const char* prompt,
+                         char* dst)
+{
+    const int64_t t_start_us = ggml_time_us();
+    const bloom_stop_token stop(ctx, t_start_us);
+
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    bloom_metrics & metrics = ctx->metrics;
+    metrics = {};
+    metrics.queue_ms = (ggml_time_us() - t_start_us)/1000.0;
+    ctx->decode_ms.clear();
+
+    gpt_params params;
+    params.seed = seed < 0 ? time(NULL) : seed;
+    params.n_threads = n_threads > 0 ? n_threads : params.n_threads;
+    params.n_batch = chat_n_batch(ctx, params.n_threads, n_batch);
+    params.eos_ids = ctx->eos_ids;
+
+    std::vector<gpt_vocab::id> & cached_tokens = ctx->cached_tokens;
+
+    int n_past = 0;
+    if (match_str) {
+        int n_chars = 0, match = true;
+        for (int id : cached_tokens) {
+            const std::string & str = ctx->vocab.id_to_token[id];
+            for (int j = 0; j < str.size(); ++j) {
+                if (prompt[n_chars + j] == '\0' || prompt[n_chars + j] != str[j]) {
+                    match = false;
+                    break;
+                }
+            }
+            if (match) {
+                n_past += 1;
+                n_chars += str.size();
+            } else {
+                break;
+            }
+        }
+        n_past = prompt[n_chars] == '\0' ? n_past-1 : n_past;
+        cached_tokens.resize(n_past);
+
+        params.prompt = std::string(prompt + n_chars);
+        std::vector<gpt_vocab::id> new_tokens = bloom_tokenize(ctx->vocab, params.prompt, false);
+        cached_tokens.insert(cached_tokens.end(), new_tokens.begin(), new_tokens.end());
+    } else {
+        params.prompt = std::string(prompt);
+        std::vector<gpt_vocab::id> input_tokens = bloom_tokenize(ctx->vocab, params.prompt, false);
+
+        while (n_past < cached_tokens.size() && n_past < input_tokens.size()) {
+            if (cached_tokens[n_past] == input_tokens[n_past]) {
+                ++n_past;
+            } else {
+                break;
+            }
+        }
+        n_past = std::min(n_past, (int)input_tokens.size() - 1);
+
+        cached_tokens.assign(input_tokens.begin(), input_tokens.end());
+    }
+
+    metrics.n_prompt = cached_tokens.size();
+    metrics.n_cached = n_past;
+
+    params.n_predict = std::min(n_predict, ctx->model.hparams.n_ctx - (int)cached_tokens.size());
+
+    std::vector<gpt_vocab::id> & last_n_tokens = ctx->last_n_tokens;
+    chat_last_n_tokens(cached_tokens, params.repeat_last_n, last_n_tokens);
+
+    strcpy(dst, prompt);
+    dst += strlen(prompt);
+
+    // inference adds the time to the first token from its own start
+    metrics.ttft_ms = (ggml_time_us() - t_start_us)/1000.0;
+
+    int ret = inference(params,
+                        ctx->model,
+                        ctx->vocab,
                         ctx->mem_per_token,
                         cached_tokens,
                         last_n_tokens,
                         n_past,
-                        dst);
+                        dst,
+                        metrics,
+                        ctx->decode_ms,
+                        ctx->sampler,
+                        ctx->stops,
+                        ctx->grammar.pattern.empty() ? nullptr : &ctx->grammar,
+                        stop);
+
+    metrics.total_ms  = (ggml_time_us() - t_start_us)/1000.0;
+    metrics.decode_ms = ctx->decode_ms.data();
+    metrics.n_decode  = ctx->decode_ms.size();
+
+    {
+        std::lock_guard<std::mutex> lock_summary(ctx->summary_mutex);
+        bloom_metrics_summary_add(ctx->summary, metrics);
+    }
+
     if (ret < 0) {
         dst[0] = '\0';
         return -1;
     }
 
-    return 0;
+    return ret;
 }
 
 extern "C" void c_free(void * p) {
@@ -1015,23 +2704,34 @@ extern "C" char* detokenize_api(ChatContext *ctx,
     return dst;
 }
 
+// the memory report as JSON, free it with c_free
+extern "C" char* mem_report_api(ChatContext *ctx) {
+    const std::string json = bloom_mem_json(bloom_mem_report(ctx->model, ctx->vocab));
+    char *dst = (char *)malloc(sizeof(char) * (json.size() + 1));
+    strcpy(dst, json.c_str());
+    return dst;
+}
+
 static bool eval_internal(ChatContext *ctx,
                           int32_t *tokens,
                           int32_t token_num,
                           int32_t n_threads,
                           int32_t n_batch,
                           bool logits_all = false,
-                          bool embed = false) {
-    gpt_params params;
-    params.n_threads = n_threads > 0 ? n_threads : params.n_threads;
-    params.n_batch = n_batch > 0 ? n_batch : params.n_batch;
+                          bool embed = false,
+                          int32_t *n_cached = nullptr,
+                          const bloom_stop_token *stop = nullptr) {
+    // the strings of a gpt_params per call would be allocated
+    static const gpt_params defaults;
+
+    n_threads = n_threads > 0 ? n_threads : defaults.n_threads;
+    n_batch = chat_n_batch(ctx, n_threads, n_batch);
 
     int n_past = 0;
     std::vector<gpt_vocab::id> & cached_tokens = ctx->cached_tokens;
-    std::vector<gpt_vocab::id> input_tokens(tokens, tokens + token_num);
     if (!logits_all) {
         while (n_past < cached_tokens.size() && n_past < token_num) {
-            if (cached_tokens[n_past] == input_tokens[n_past]) {
+            if (cached_tokens[n_past] == tokens[n_past]) {
                 ++n_past;
             } else {
                 break;
@@ -1040,30 +2740,38 @@ static bool eval_internal(ChatContext *ctx,
         n_past = std::min(n_past, token_num - 1);
     }
 
-    // printf("n_past: %d\n", n_past);
+    if (n_cached) {
+        *n_cached = n_past;
+    }
+
+    // cached_tokens grows with the evaluated tokens, in its capacity of n_ctx tokens
+    cached_tokens.resize(n_past);
+
+    while (n_past < token_num) {
+        if (stop && (*stop)()) {
+            return false;
+        }
 
-    while (n_past < input_tokens.size()) {
         // eval input prompt
-        int n = std::min((size_t)params.n_batch, input_tokens.size() - n_past);
-        std::vector<gpt_vocab::id> embd(input_tokens.cbegin() + n_past,
-                                        input_tokens.cbegin() + n_past + n);
-        if (!bloom_eval(ctx->model,
-                        params.n_threads,
-                        n_past,
-                        embd,
-                        ctx->logits,
-                        ctx->embeddings,
-                        ctx->mem_per_token,
-                        logits_all,
-                        embed)) {
+        int n = std::min(n_batch, token_num - n_past);
+        const bloom_seq seq = { 0, n_past, tokens + n_past, n };
+        if (!bloom_eval_batch(ctx->model,
+                              n_threads,
+                              &seq,
+                              1,
+                              ctx->logits,
+                              ctx->embeddings,
+                              ctx->mem_per_token,
+                              logits_all,
+                              embed)) {
             // todo: better error handling
-            printf("Failed to predict\n");
+            fprintf(stderr, "Failed to predict\n");
             return false;
         }
+        cached_tokens.insert(cached_tokens.end(), tokens + n_past, tokens + n_past + n);
         n_past += n;
     }
 
-    cached_tokens.swap(input_tokens);
     return true;
 }
 
@@ -1074,6 +2782,8 @@ extern "C" float* eval_api(ChatContext *ctx,
                            int32_t n_threads,
                            int32_t n_batch,
                            int64_t* len) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
     bool status = eval_internal(ctx, tokens, token_num, n_threads, n_batch, true);
     assert(status);
     *len = ctx->logits.size();
@@ -1087,12 +2797,80 @@ extern "C" float* embed_api(ChatContext *ctx,
                             int32_t n_threads,
                             int32_t n_batch,
                             int64_t* len) {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
     bool status = eval_internal(ctx, tokens, token_num, n_threads, n_batch, false, true);
     assert(status);
     *len = ctx->embeddings.size();
     return ctx->embeddings.data();
 }
 
+// the pooled embeddings of n_texts texts, n_embd floats per text in their order - free it with c_free
+//
+// The texts are tokenized on n_threads threads, then sorted by length and packed into evals of up to n_batch tokens
+// that end at the output norm. pooling is a bloom_pooling. Returns nullptr and a len of 0 if it fails.
+extern "C" float* embed_batch_api(ChatContext *ctx,
+                                  const char * const *texts,
+                                  int32_t n_texts,
+                                  bool bos,
+                                  int32_t pooling,
+                                  int32_t n_threads,
+                                  int32_t n_batch,
+                                  int64_t* len) {
+    *len = 0;
+    if (n_texts <= 0 || (pooling != BLOOM_POOLING_LAST && pooling != BLOOM_POOLING_MEAN)) {
+        return nullptr;
+    }
+
+    static const gpt_params defaults;
+
+    n_threads = n_threads > 0 ? n_threads : defaults.n_threads;
+
+    // bloom_tokenize only reads the vocab, the texts are split over the threads without the lock
+    std::vector<std::vector<gpt_vocab::id>> seqs(n_texts);
+    {
+        const int n_workers = std::max(1, std::min(n_threads, n_texts));
+
+        auto tokenize = [&](int first) {
+            for (int i = first; i < n_texts; i += n_workers) {
+                seqs[i] = bloom_tokenize(ctx->vocab, texts[i], bos);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_workers; ++i) {
+            workers.emplace_back(tokenize, i);
+        }
+        tokenize(0);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+
+    n_batch = chat_n_batch(ctx, n_threads, n_batch);
+
+    const int n_embd = ctx->model.hparams.n_embd;
+
+    float *dst = (float *)malloc(sizeof(float) * n_embd * n_texts);
+    if (dst == nullptr) {
+        return nullptr;
+    }
+
+    // the packed sequences overwrite the kv cache
+    ctx->cached_tokens.clear();
+
+    if (!bloom_embed_packed(ctx->model, n_threads, n_batch, seqs, (bloom_pooling) pooling, dst, ctx->mem_per_token)) {
+        fprintf(stderr, "Failed to embed\n");
+        free(dst);
+        return nullptr;
+    }
+
+    *len = (int64_t) n_embd * n_texts;
+    return dst;
+}
+
 
 extern "C" int32_t forward_api(ChatContext *ctx,
                                int32_t *tokens,
@@ -1100,27 +2878,39 @@ extern "C" int32_t forward_api(ChatContext *ctx,
                                int32_t seed,
                                int32_t n_threads,
                                int32_t n_batch) {
-    bool status = eval_internal(ctx, tokens, token_num, n_threads, n_batch);
-    assert(status);
+    const int64_t t_start_us = ggml_time_us();
+    const bloom_stop_token stop(ctx, t_start_us);
 
-    gpt_params params;
-    params.seed = seed < 0 ? time(NULL) : seed;
+    std::lock_guard<std::mutex> lock(ctx->mutex);
 
-    std::mt19937 rng(seed);
-    std::vector<gpt_vocab::id> & cached_tokens = ctx->cached_tokens;
-    std::vector<gpt_vocab::id> last_n_tokens{};
-    int n_tokens = cached_tokens.size();
-    if (n_tokens >= params.repeat_last_n) {
-        for (int i = n_tokens - params.repeat_last_n; i < n_tokens; ++i) {
-            last_n_tokens.push_back(cached_tokens[i]);
-        }
-    } else {
-        last_n_tokens.resize(params.repeat_last_n - n_tokens, 0);
-        for (int i = 0; i < n_tokens; ++i) {
-            last_n_tokens.push_back(cached_tokens[i]);
-        }
+    bloom_metrics & metrics = ctx->metrics;
+    metrics = {};
+    metrics.queue_ms = (ggml_time_us() - t_start_us)/1000.0;
+    metrics.n_prompt = token_num;
+    ctx->decode_ms.clear();
+
+    const int64_t t_start_eval_us = ggml_time_us();
+
+    bool status = eval_internal(ctx, tokens, token_num, n_threads, n_batch, false, false, &metrics.n_cached, &stop);
+
+    metrics.prefill_ms = (ggml_time_us() - t_start_eval_us)/1000.0;
+
+    if (!status) {
+        // cancelled, past the deadline or failed
+        metrics.total_ms = (ggml_time_us() - t_start_us)/1000.0;
+
+        std::lock_guard<std::mutex> lock_summary(ctx->summary_mutex);
+        bloom_metrics_summary_add(ctx->summary, metrics);
+        return -1;
     }
 
+    // the default sampling parameters, the strings of a gpt_params per call would be allocated
+    static const gpt_params params;
+
+    std::mt19937 rng(seed);
+    std::vector<gpt_vocab::id> & last_n_tokens = ctx->last_n_tokens;
+    chat_last_n_tokens(ctx->cached_tokens, params.repeat_last_n, last_n_tokens);
+
     gpt_vocab::id id = bloom_sample_top_p(ctx->vocab,
                                           ctx->logits.data() + (ctx->logits.size() - ctx->model.hparams.n_vocab),
                                           last_n_tokens,
@@ -1128,6 +2918,69 @@ extern "C" int32_t forward_api(ChatContext *ctx,
                                           params.top_p,
                                           params.top_k,
                                           params.temp,
-                                          rng);
+                                          rng,
+                                          ctx->sampler);
+
+    metrics.n_generated = 1;
+    metrics.sample_ms   = (ggml_time_us() - t_start_eval_us)/1000.0 - metrics.prefill_ms;
+    metrics.ttft_ms     = (ggml_time_us() - t_start_us)/1000.0;
+    metrics.total_ms    = metrics.ttft_ms;
+
+    {
+        std::lock_guard<std::mutex> lock_summary(ctx->summary_mutex);
+        bloom_metrics_summary_add(ctx->summary, metrics);
+    }
+
     return id;
 }
+
+// the timings of the last bloom_run or forward_api call, valid until the next one
+extern "C" const bloom_metrics* bloom_get_metrics(ChatContext *ctx) {
+    return &ctx->metrics;
+}
+
+// the requests since the load or the last reset, can be called while a request is running
+extern "C" void bloom_get_metrics_summary(ChatContext *ctx, bloom_metrics_summary *summary) {
+    std::lock_guard<std::mutex> lock(ctx->summary_mutex);
+    *summary = ctx->summary;
+}
+
+extern "C" void bloom_reset_metrics_summary(ChatContext *ctx) {
+    std::lock_guard<std::mutex> lock(ctx->summary_mutex);
+    ctx->summary = {};
+}
+
+static std::string metrics_prometheus(ChatContext *ctx) {
+    bloom_metrics_summary summary;
+    {
+        std::lock_guard<std::mutex> lock(ctx->summary_mutex);
+        summary = ctx->summary;
+    }
+
+    return bloom_metrics_prometheus(ctx->model, summary);
+}
+
+// the metrics in the Prometheus text format, free it with c_free
+extern "C" char* metrics_api(ChatContext *ctx) {
+    const std::string text = metrics_prometheus(ctx);
+    char *dst = (char *)malloc(sizeof(char) * (text.size() + 1));
+    strcpy(dst, text.c_str());
+    return dst;
+}
+
+// serve the metrics on addr ("host:port" or "unix:/path") until bloom_free
+extern "C" bool metrics_serve_api(ChatContext *ctx, const char *addr) {
+    if (ctx->exporter) {
+        fprintf(stderr, "%s: the metrics are already served\n", __func__);
+        return false;
+    }
+
+    ctx->exporter = bloom_exporter_start(addr, [ctx]() { return metrics_prometheus(ctx); });
+    return ctx->exporter != nullptr;
+}
+
+// the upper bounds of the histogram buckets, n is set to BLOOM_HIST_BUCKETS - 1
+extern "C" const double* bloom_histogram_bounds_api(int32_t *n) {
+    *n = BLOOM_HIST_BUCKETS - 1;
+    return bloom_histogram_bounds();
+}
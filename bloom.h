@@ -2,9 +2,14 @@
 
 #include "utils.h"
 
+#include <array>
+#include <atomic>
+#include <functional>
+
 struct bloom_hparams {
     int32_t n_vocab = 32000;
     int32_t n_ctx   = 512;   // this is provided as user input?
+    int32_t n_seq   = 1;     // sequences with their own kv cache of n_ctx tokens
     int32_t n_embd  = 4096;
     int32_t n_mult  = 256;
     int32_t n_head  = 32;
@@ -12,6 +17,157 @@ struct bloom_hparams {
     int32_t f16     = 1;
 };
 
+// how the attention of a layer is scheduled on the threads
+enum bloom_attn_mode {
+    BLOOM_ATTN_AUTO = 0, // whole heads per thread for single token decode, one op per step otherwise
+    BLOOM_ATTN_OPS,      // one graph node per step (kq, scale, alibi, mask, softmax, kqv), each split by rows
+    BLOOM_ATTN_HEADS,    // a single fused node, each thread computes whole heads end to end
+};
+
+// parts of the model that the profiler attributes the graph time to
+enum bloom_perf_block {
+    BLOOM_PERF_EMBD = 0, // token embeddings and their norm
+    BLOOM_PERF_QKV,      // attention norm, query_key_value and its bias
+    BLOOM_PERF_ATTN,     // kv cache store, scores, alibi, mask, softmax and the weighted sum of V
+    BLOOM_PERF_WO,       // output projection, its bias and the residual
+    BLOOM_PERF_FFN,      // ffn norm, w1, gelu, w2 and the residual
+    BLOOM_PERF_LM_HEAD,  // output norm and lm_head
+    BLOOM_PERF_BLOCK_COUNT,
+};
+
+// evals of more than one token are prompt processing, single token evals are decoding
+enum bloom_perf_phase {
+    BLOOM_PERF_PREFILL = 0,
+    BLOOM_PERF_DECODE,
+    BLOOM_PERF_PHASE_COUNT,
+};
+
+struct bloom_perf_stats {
+    int     n_eval     = 0;
+    int     n_tokens   = 0;
+    int64_t t_eval_us  = 0; // wall time of bloom_eval, including building the graph
+    int64_t t_graph_us = 0; // sum of the node times
+
+    std::array<int,     GGML_OP_COUNT> op_runs    {};
+    std::array<int64_t, GGML_OP_COUNT> op_time_us {};
+
+    std::array<int64_t, BLOOM_PERF_BLOCK_COUNT> block_time_us {};
+
+    // [n_layer][block], only the per layer blocks are set
+    std::vector<std::array<int64_t, BLOOM_PERF_BLOCK_COUNT>> layer_time_us;
+
+    // matrix multiplications per block: bytes of src0 (weights or kv cache) streamed, FLOPs and time
+    std::array<int64_t, BLOOM_PERF_BLOCK_COUNT> mm_bytes   {};
+    std::array<int64_t, BLOOM_PERF_BLOCK_COUNT> mm_flops   {};
+    std::array<int64_t, BLOOM_PERF_BLOCK_COUNT> mm_time_us {};
+
+    // hardware counters, summed over the threads
+    std::array<std::array<int64_t, GGML_HWC_COUNT>, GGML_OP_COUNT>          op_hwc    {};
+    std::array<std::array<int64_t, GGML_HWC_COUNT>, BLOOM_PERF_BLOCK_COUNT> block_hwc {};
+};
+
+// runtime profiler, set bloom_model.perf to accumulate the time of every bloom_eval
+struct bloom_perf {
+    bloom_perf_stats phase[BLOOM_PERF_PHASE_COUNT];
+
+    // if not NULL, the hardware counters are collected too (see ggml_hwc_new)
+    struct ggml_hwc * hwc = nullptr;
+
+    // machine peaks measured by bloom_perf_probe, 0 if not measured
+    double peak_gbps   = 0.0;
+    double peak_gflops = 0.0;
+};
+
+// classes of weights in the memory report
+enum bloom_mem_weights {
+    BLOOM_MEM_EMBD = 0, // tok_embeddings
+    BLOOM_MEM_ATTN,     // query_key_value, wo and their biases
+    BLOOM_MEM_FFN,      // w1, w2 and their biases
+    BLOOM_MEM_NORM,     // the layer norms
+    BLOOM_MEM_LM_HEAD,  // output
+    BLOOM_MEM_WEIGHTS_COUNT,
+};
+
+// memory used by a loaded model, in bytes
+struct bloom_mem_usage {
+    std::array<size_t, BLOOM_MEM_WEIGHTS_COUNT> weights {};
+
+    size_t kv_cache = 0;
+
+    size_t ctx_size = 0; // size of the ggml context of the model
+    size_t ctx_used = 0; // weights, kv cache, tensor objects and alignment padding
+
+    size_t arena_size = 0; // compute buffer of bloom_eval, shared by all the models of the process
+    size_t arena_peak = 0; // high-water mark of the compute buffer over all the evals so far
+
+    size_t vocab = 0; // token maps and word lists, estimated from the node and string sizes
+
+    size_t rss      = 0; // resident set size of the process, 0 if not available
+    size_t peak_rss = 0;
+};
+
+// timings and token counts of one request of the C API (bloom_run, forward_api)
+//
+// The layout is part of the C API, the Python bindings declare the same structs with ctypes.
+struct bloom_metrics {
+    int32_t n_prompt    = 0; // tokens of the prompt
+    int32_t n_cached    = 0; // prompt tokens reused from the kv cache of the previous request
+    int32_t n_generated = 0; // sampled tokens
+
+    double queue_ms   = 0.0; // waiting for the context to finish the previous request
+    double prefill_ms = 0.0; // evaluating the prompt tokens that were not cached
+    double ttft_ms    = 0.0; // from the call to the first sampled token, queue included
+    double sample_ms  = 0.0;
+    double total_ms   = 0.0;
+
+    // latency of every decode step, owned by the context and valid until its next request
+    const float * decode_ms = nullptr;
+    int32_t     n_decode    = 0;
+};
+
+// number of buckets of bloom_histogram, the bounds are returned by bloom_histogram_bounds
+#define BLOOM_HIST_BUCKETS 16
+
+// latency histogram in ms, count[i] holds the values in (bounds[i - 1], bounds[i]], the last bucket is unbounded
+struct bloom_histogram {
+    int64_t count[BLOOM_HIST_BUCKETS];
+    int64_t n;
+    double  sum;
+};
+
+// the requests of a context so far
+struct bloom_metrics_summary {
+    int64_t n_requests;
+    int64_t n_prompt;
+    int64_t n_cached;
+    int64_t n_generated;
+
+    bloom_histogram queue_ms;
+    bloom_histogram ttft_ms;
+    bloom_histogram decode_ms; // one value per decode step
+    bloom_histogram total_ms;
+};
+
+// number of buckets of the batch size distribution, bucket i counts the evals of (2^(i-1), 2^i] tokens and the last
+// bucket the larger ones
+#define BLOOM_BATCH_BUCKETS 12
+
+// counters of the evals of a model, set bloom_model.counters to update them in every bloom_eval
+// they are atomics so that an exporter thread can read them while the model evaluates
+struct bloom_counters {
+    std::atomic<int64_t> n_eval    {0};
+    std::atomic<int64_t> n_tokens  {0};
+    std::atomic<int64_t> t_eval_us {0};
+    std::atomic<int32_t> n_kv      {0}; // tokens in the kv cache after the last eval, set by the caller with n_seq > 1
+
+    std::atomic<int64_t> n_batch[BLOOM_BATCH_BUCKETS] {};
+
+    // threads of ggml_graph_compute, see ggml_pool_stats
+    std::atomic<int64_t> pool_wall_us {0};
+    std::atomic<int64_t> pool_busy_us {0};
+    std::atomic<int64_t> pool_spin_us {0};
+};
+
 struct bloom_layer {
     // normalization
     struct ggml_tensor * attention_norm;
@@ -55,11 +211,37 @@ struct bloom_model {
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+
+    bloom_attn_mode attn_mode = BLOOM_ATTN_AUTO;
+
+    // alignment of the weights, the kv cache and the compute buffer tensors (0 = GGML_DATA_ALIGN)
+    size_t data_align = 0;
+
+    // if not NULL, bloom_eval adds its per op and per layer timings to it
+    bloom_perf * perf = nullptr;
+
+    // if not NULL, bloom_eval records the per thread timeline of its graphs into it (see ggml_trace_new)
+    struct ggml_trace * trace = nullptr;
+
+    // if not NULL, bloom_eval adds its evals to it
+    bloom_counters * counters = nullptr;
+
+    // prompt batch size picked by bloom_tune_n_batch, by thread count
+    std::map<int, int> n_batch_tuned;
+
+    // if > 0, the threads of the evals of one token per sequence instead of the n_threads argument of bloom_eval
+    int n_threads_decode = 0;
+
+    // if not empty, the CPUs the compute threads are pinned to, thread i on cpus[i % size], for the prompt evals
+    // and for the evals of one token per sequence - CPU i for thread i otherwise
+    std::vector<int> cpus;
+    std::vector<int> cpus_decode;
 };
 
 
 // load the model's weights from a file
-bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab & vocab, int n_ctx);
+// n_seq kv caches of n_ctx tokens are allocated, one per sequence evaluated by bloom_eval_batch
+bool bloom_model_load(const std::string & fname, bloom_model & model, gpt_vocab & vocab, int n_ctx, int n_seq = 1);
 
 // evaluate the transformer
 //
@@ -81,3 +263,134 @@ bool bloom_eval(
               size_t                     & mem_per_token,
               bool logits_all = false,
               bool embed = false);
+
+// a sequence of bloom_eval_batch: n_tokens tokens appended after the first n_past tokens of the kv cache seq
+//
+// kv_base puts the sequence that many rows into the cache, so that several short ones fit side by side in one cache -
+// it is 0 when left out of the initializer.
+struct bloom_seq {
+    int32_t seq;
+    int32_t n_past;
+    const gpt_vocab::id * tokens;
+    int32_t n_tokens;
+    int32_t kv_base;
+};
+
+// evaluate the tokens of several sequences in one graph - the matrix multiplications by the weights are shared,
+// the attention of every sequence reads its own kv cache
+//
+//   - embd_w:     the logits of the last token of every sequence, or of all the tokens with logits_all
+//   - embeddings: with embed, the final hidden state of the last token of every sequence
+//
+// bloom_eval is the single sequence case, with seq 0
+bool bloom_eval_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const std::vector<bloom_seq> & batch,
+              std::vector<float>     & embd_w,
+              std::vector<float>     & embeddings,
+              size_t                 & mem_per_token,
+              bool logits_all = false,
+              bool embed = false);
+
+// the same with the n_batch sequences of an array, nothing is allocated once embd_w and embeddings have their size
+bool bloom_eval_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const bloom_seq * batch,
+        const int n_batch,
+              std::vector<float> & embd_w,
+              std::vector<float> & embeddings,
+              size_t             & mem_per_token,
+              bool logits_all = false,
+              bool embed = false);
+
+// how the final hidden states of the tokens of a sequence make its embedding
+enum bloom_pooling {
+    BLOOM_POOLING_LAST = 0, // the state of the last token, like the embeddings of bloom_eval_batch
+    BLOOM_POOLING_MEAN = 1, // the mean of the states of all the tokens
+};
+
+// the pooled embeddings of the sequences of a batch, n_embd floats per sequence - the graph ends at the output norm,
+// without the lm_head
+bool bloom_embed_batch(
+        const bloom_model & model,
+        const int n_threads,
+        const bloom_seq * batch,
+        const int n_batch,
+        bloom_pooling pooling,
+              std::vector<float> & embeddings,
+              size_t             & mem_per_token);
+
+// the pooled embeddings of many token sequences into dst, n_embd floats per sequence in their order
+//
+// The sequences are sorted by length and packed, longest first, into evals of up to n_batch tokens, side by side in
+// the kv cache of sequence 0: a graph embeds many short texts and reads the weights once for all of them. A sequence
+// longer than n_batch is evaluated alone, in slices of n_batch tokens. The ones longer than the context are cut to
+// n_ctx tokens, the empty ones get zeros. The kv cache of sequence 0 is overwritten.
+bool bloom_embed_packed(
+        const bloom_model & model,
+        const int n_threads,
+        int n_batch,
+        const std::vector<std::vector<gpt_vocab::id>> & seqs,
+        bloom_pooling pooling,
+        float * dst,
+        size_t & mem_per_token);
+
+// pick the number of prompt tokens per eval for the model and n_threads
+//
+// The time per token of a prompt eval is measured for batch sizes doubling from 8, until two sizes in a row improve it
+// by less than 5%, the compute buffer would exceed mem_max bytes (0 for no limit) or the size reaches 512 or the
+// context size. The smallest size within 5% of the best time wins: the larger ones cost compute buffer memory for
+// nothing.
+//
+// The result is kept in model.n_batch_tuned and in a cache file for the next runs, $XDG_CACHE_HOME/bloomz.cpp/n_batch
+// or ~/.cache/bloomz.cpp/n_batch, keyed by the hyperparameters, the weight type and the thread count. The evals
+// overwrite the first tokens of the kv cache of sequence 0.
+int bloom_tune_n_batch(bloom_model & model, int n_threads, size_t & mem_per_token, size_t mem_max = 0);
+
+// set model.n_threads_decode to the fewest threads, up to n_threads_max, whose single token decode is within 5% of the
+// fastest - the decode is bound by the memory bandwidth, the threads past the plateau only wait at the barriers
+//
+// The thread counts are measured in increasing order, on model.cpus_decode if set, until two in a row improve the
+// time by less than 5%. The result is cached like the one of bloom_tune_n_batch, in $XDG_CACHE_HOME/bloomz.cpp/
+// n_threads_decode, keyed by the CPUs too. The evals overwrite the first tokens of the kv cache of sequence 0.
+int bloom_tune_threads_decode(bloom_model & model, int n_threads_max, size_t & mem_per_token);
+
+// measure the memory read bandwidth and the FMA throughput of the machine with n_threads threads, so that the
+// matrix multiplications can be reported as a fraction of the peak (roofline)
+void bloom_perf_probe(bloom_perf & perf, int n_threads);
+
+// print the profile as tables: time per op, per sub-block and per layer, for prefill and decode
+void bloom_perf_print(const bloom_perf & perf);
+
+// the same data as JSON
+std::string bloom_perf_json(const bloom_perf & perf);
+
+// collect the memory used by the model, its vocab, the compute buffer and the process
+bloom_mem_usage bloom_mem_report(const bloom_model & model, const gpt_vocab & vocab);
+
+// print the memory report as a table
+void bloom_mem_print(const bloom_mem_usage & mem);
+
+// the same data as JSON
+std::string bloom_mem_json(const bloom_mem_usage & mem);
+
+// the BLOOM_HIST_BUCKETS - 1 upper bounds of the bounded buckets of bloom_histogram, in ms
+const double * bloom_histogram_bounds();
+
+void bloom_histogram_add(bloom_histogram & hist, double value);
+
+// add a request to the summary
+void bloom_metrics_summary_add(bloom_metrics_summary & summary, const bloom_metrics & metrics);
+
+// the counters of the model and the summary of the requests in the Prometheus text format
+std::string bloom_metrics_prometheus(const bloom_model & model, const bloom_metrics_summary & summary);
+
+struct bloom_exporter;
+
+// serve the text returned by fn as /metrics from a background thread
+// addr is "host:port" for HTTP over TCP or "unix:/path" for HTTP over a unix socket, returns NULL on failure
+bloom_exporter * bloom_exporter_start(const std::string & addr, std::function<std::string()> fn);
+
+void bloom_exporter_stop(bloom_exporter * exporter);
@@ -21,7 +21,7 @@
 #include <float.h>
 #include <limits.h>
 
-int64_t op_time[50];
+int64_t op_time[GGML_OP_COUNT];
 int64_t thread_time[48];
 
 // if C99 - static_assert is noop
@@ -81,6 +81,12 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // __FMA__ and __F16C__ are not defined in MSVC, however they are implied with AVX2/AVX512
 #if defined(_MSC_VER) && (defined(__AVX2__) || defined(__AVX512F__))
 #ifndef __FMA__
@@ -118,21 +124,30 @@ typedef void* thread_ret_t;
     #define GGML_MEM_ALIGN 16
 #endif
 
+// default alignment of the tensor data, can be changed per context with ggml_init_params.data_align
+// build with -DGGML_DATA_ALIGN=64 so that AVX-512 loads of tensor rows do not split cache lines
+#ifndef GGML_DATA_ALIGN
+    #define GGML_DATA_ALIGN GGML_MEM_ALIGN
+#endif
+
+static_assert(GGML_DATA_ALIGN % GGML_MEM_ALIGN == 0 && (GGML_DATA_ALIGN & (GGML_DATA_ALIGN - 1)) == 0,
+        "GGML_DATA_ALIGN must be a power of 2 multiple of GGML_MEM_ALIGN");
+
 #if defined(_MSC_VER) || defined(__MINGW32__)
-#define GGML_ALIGNED_MALLOC(size)  _aligned_malloc(size, GGML_MEM_ALIGN)
-#define GGML_ALIGNED_FREE(ptr)     _aligned_free(ptr)
+#define GGML_ALIGNED_MALLOC(size, align)  _aligned_malloc(size, align)
+#define GGML_ALIGNED_FREE(ptr)            _aligned_free(ptr)
 #else
-inline static void* ggml_aligned_malloc(size_t size) {
+inline static void* ggml_aligned_malloc(size_t size, size_t align) {
     void* aligned_memory = NULL;
-    int result = posix_memalign(&aligned_memory, GGML_MEM_ALIGN, size);
+    int result = posix_memalign(&aligned_memory, align, size);
     if (result != 0) {
         // Handle allocation failure
         return NULL;
     }
     return aligned_memory;
 }
-#define GGML_ALIGNED_MALLOC(size)  ggml_aligned_malloc(size)
-#define GGML_ALIGNED_FREE(ptr)     free(ptr)
+#define GGML_ALIGNED_MALLOC(size, align)  ggml_aligned_malloc(size, align)
+#define GGML_ALIGNED_FREE(ptr)            free(ptr)
 #endif
 
 #define UNUSED(x) (void)(x)
@@ -2302,6 +2317,11 @@ inline static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t
     *s = sumf;
 }
 
+// For internal test use
+void ggml_internal_vec_dot_f16(const int n, float * restrict s, const ggml_fp16_t * restrict x, const ggml_fp16_t * restrict y) {
+    ggml_vec_dot_f16(n, s, (ggml_fp16_t *) x, (ggml_fp16_t *) y);
+}
+
 static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -3535,6 +3555,83 @@ inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float
 #endif
 }
 
+//
+// attention kernels for a head size D that is known at compile time
+//
+// the loops over the head are fully unrolled and in ggml_vec_wsum_f32_D the whole output
+// row stays in registers while accumulating over all value rows
+//
+//   ggml_vec_dot_f32_D:  s = x.y
+//   ggml_vec_wsum_f32_D: y = sum_k w[k]*x_k, with x_k = x + k*nbx bytes
+//
+
+#if defined(GGML_SIMD)
+
+#define GGML_VEC_HEAD_KERNELS(D)                                                                                    \
+inline static void ggml_vec_dot_f32_##D(float * restrict s, const float * restrict x, const float * restrict y) {   \
+    GGML_F32_VEC sum[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };                                                         \
+                                                                                                                    \
+    for (int i = 0; i < (D); i += GGML_F32_STEP) {                                                                  \
+        for (int j = 0; j < GGML_F32_ARR; j++) {                                                                    \
+            sum[j] = GGML_F32_VEC_FMA(sum[j],                                                                       \
+                    GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR));          \
+        }                                                                                                           \
+    }                                                                                                               \
+                                                                                                                    \
+    float sumf = 0.0f;                                                                                              \
+    GGML_F32_VEC_REDUCE(sumf, sum);                                                                                 \
+                                                                                                                    \
+    *s = sumf;                                                                                                      \
+}                                                                                                                   \
+                                                                                                                    \
+inline static void ggml_vec_wsum_f32_##D(const int n, float * restrict y, const float * restrict x, const size_t nbx, const float * restrict w) { \
+    GGML_F32_VEC acc[(D)/GGML_F32_EPR] = { GGML_F32_VEC_ZERO };                                                     \
+                                                                                                                    \
+    for (int k = 0; k < n; ++k) {                                                                                   \
+        const float * restrict xk = (const float *) ((const char *) x + k*nbx);                                    \
+        const GGML_F32_VEC wk = GGML_F32_VEC_SET1(w[k]);                                                            \
+                                                                                                                    \
+        for (int j = 0; j < (D)/GGML_F32_EPR; j++) {                                                                \
+            acc[j] = GGML_F32_VEC_FMA(acc[j], GGML_F32_VEC_LOAD(xk + j*GGML_F32_EPR), wk);                          \
+        }                                                                                                           \
+    }                                                                                                               \
+                                                                                                                    \
+    for (int j = 0; j < (D)/GGML_F32_EPR; j++) {                                                                    \
+        GGML_F32_VEC_STORE(y + j*GGML_F32_EPR, acc[j]);                                                             \
+    }                                                                                                               \
+}
+
+#else
+
+#define GGML_VEC_HEAD_KERNELS(D)                                                                                    \
+inline static void ggml_vec_dot_f32_##D(float * restrict s, const float * restrict x, const float * restrict y) {   \
+    ggml_float sumf = 0.0;                                                                                          \
+    for (int i = 0; i < (D); ++i) {                                                                                 \
+        sumf += (ggml_float)(x[i]*y[i]);                                                                            \
+    }                                                                                                               \
+    *s = sumf;                                                                                                      \
+}                                                                                                                   \
+                                                                                                                    \
+inline static void ggml_vec_wsum_f32_##D(const int n, float * restrict y, const float * restrict x, const size_t nbx, const float * restrict w) { \
+    float acc[(D)] = { 0.0f };                                                                                      \
+                                                                                                                    \
+    for (int k = 0; k < n; ++k) {                                                                                   \
+        const float * restrict xk = (const float *) ((const char *) x + k*nbx);                                    \
+        for (int i = 0; i < (D); ++i) {                                                                             \
+            acc[i] += xk[i]*w[k];                                                                                   \
+        }                                                                                                           \
+    }                                                                                                               \
+                                                                                                                    \
+    for (int i = 0; i < (D); ++i) {                                                                                 \
+        y[i] = acc[i];                                                                                              \
+    }                                                                                                               \
+}
+
+#endif
+
+GGML_VEC_HEAD_KERNELS(64)
+GGML_VEC_HEAD_KERNELS(128)
+
 //inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #if defined(GGML_SIMD)
@@ -3838,11 +3935,15 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "FLASH_ATTN",
     "FLASH_FF",
 
+    "ATTN_KQ",
+    "ATTN_KQV",
+    "ATTN_ALIBI",
+
     "MAP_UNARY",
     "MAP_BINARY",
 };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 54, "GGML_OP_COUNT != 54");
 
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
@@ -3900,11 +4001,15 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "flash_attn(x)",
     "flash_ff(x)",
 
+    "attn_kq(x,y)",
+    "attn_kqv(x,y)",
+    "attn_alibi(x,y,z)",
+
     "f(x)",
     "f(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 54, "GGML_OP_COUNT != 54");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -3918,6 +4023,7 @@ struct ggml_context {
     void * mem_buffer;
     bool   mem_buffer_owned;
     bool   no_alloc;
+    size_t data_align;
 
     int    n_objects;
 
@@ -4038,6 +4144,10 @@ const char * ggml_type_name(enum ggml_type type) {
     return GGML_TYPE_NAME[type];
 }
 
+const char * ggml_op_name(enum ggml_op op) {
+    return GGML_OP_LABEL[op];
+}
+
 
 size_t ggml_element_size(const struct ggml_tensor * tensor) {
     return GGML_TYPE_SIZE[tensor->type];
@@ -4242,11 +4352,16 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
 
     const size_t mem_size = (params.mem_size + GGML_MEM_ALIGN - 1) & ~(GGML_MEM_ALIGN - 1);
 
+    const size_t data_align = params.data_align ? params.data_align : GGML_DATA_ALIGN;
+
+    GGML_ASSERT(data_align % GGML_MEM_ALIGN == 0 && (data_align & (data_align - 1)) == 0);
+
     *ctx = (struct ggml_context) {
         /*.mem_size           =*/ mem_size,
-        /*.mem_buffer         =*/ params.mem_buffer ? params.mem_buffer : GGML_ALIGNED_MALLOC(mem_size),
+        /*.mem_buffer         =*/ params.mem_buffer ? params.mem_buffer : GGML_ALIGNED_MALLOC(mem_size, data_align),
         /*.mem_buffer_owned   =*/ params.mem_buffer ? false : true,
         /*.no_alloc           =*/ params.no_alloc,
+        /*.data_align         =*/ data_align,
         /*.n_objects          =*/ 0,
         /*.objects_begin      =*/ NULL,
         /*.objects_end        =*/ NULL,
@@ -4298,6 +4413,10 @@ size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end == NULL ? 0 : ctx->objects_end->offs + ctx->objects_end->size;
 }
 
+size_t ggml_get_mem_size(const struct ggml_context * ctx) {
+    return ctx->mem_size;
+}
+
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch) {
     const size_t result = ctx->scratch.data ? ctx->scratch.offs : 0;
 
@@ -4347,24 +4466,36 @@ struct ggml_tensor * ggml_new_tensor_impl(
     }
 
     char * const mem_buffer = ctx->mem_buffer;
-    struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
+
+    // the data is placed right after the tensor - pad in front of the object to align it
+    size_t pad = 0;
+    if (size_needed > 0 && ctx->scratch.data == NULL) {
+        const uintptr_t data_addr = (uintptr_t) (mem_buffer + cur_end + GGML_OBJECT_SIZE + sizeof(struct ggml_tensor));
+        pad = (ctx->data_align - data_addr%ctx->data_align)%ctx->data_align;
+    }
+
+    struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end + pad);
 
     if (ctx->scratch.data == NULL || data != NULL) {
         size_needed += sizeof(struct ggml_tensor);
 
-        if (cur_end + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
+        if (cur_end + pad + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
             GGML_PRINT("%s: not enough space in the context's memory pool (needed %zu, available %zu)\n",
-                    __func__, cur_end + size_needed + GGML_OBJECT_SIZE, ctx->mem_size);
+                    __func__, cur_end + pad + size_needed + GGML_OBJECT_SIZE, ctx->mem_size);
             assert(false);
             return NULL;
         }
 
         *obj_new = (struct ggml_object) {
-            .offs = cur_end + GGML_OBJECT_SIZE,
+            .offs = cur_end + pad + GGML_OBJECT_SIZE,
             .size = size_needed,
             .next = NULL,
         };
     } else {
+        // align the data in the scratch buffer
+        const uintptr_t data_addr = (uintptr_t) ((char *) ctx->scratch.data + ctx->scratch.offs);
+        ctx->scratch.offs += (ctx->data_align - data_addr%ctx->data_align)%ctx->data_align;
+
         if (ctx->scratch.offs + size_needed > ctx->scratch.size) {
             GGML_PRINT("%s: not enough space in the scratch memory\n", __func__);
             assert(false);
@@ -6728,6 +6859,106 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_attn_kq
+
+struct ggml_tensor * ggml_attn_kq(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * q) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(k->type == GGML_TYPE_F32 && q->type == GGML_TYPE_F32);
+
+    bool is_node = false;
+
+    if (k->grad || q->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = { k->ne[1], q->ne[1], q->ne[2], q->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MIN(k->n_dims, q->n_dims), ne);
+
+    result->op   = GGML_OP_ATTN_KQ;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = k;
+    result->src1 = q;
+
+    return result;
+}
+
+// ggml_attn_kqv
+
+struct ggml_tensor * ggml_attn_kqv(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * kq) {
+    GGML_ASSERT(v->ne[1] == kq->ne[2] && v->ne[2] == kq->ne[0]);
+    GGML_ASSERT(v->ne[3] == 1 && kq->ne[3] == 1);
+    GGML_ASSERT(v->type == GGML_TYPE_F32 && kq->type == GGML_TYPE_F32);
+
+    bool is_node = false;
+
+    if (v->grad || kq->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, v->ne[0], v->ne[1], kq->ne[1]);
+
+    result->op   = GGML_OP_ATTN_KQV;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = v;
+    result->src1 = kq;
+
+    return result;
+}
+
+// ggml_attn_alibi
+
+struct ggml_tensor * ggml_attn_alibi(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        int                   n_past,
+        float                 scale,
+        float                 max_bias) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(v->ne[0] == q->ne[0] && v->ne[1] == q->ne[2] && v->ne[2] == k->ne[1]);
+    GGML_ASSERT(q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1);
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && k->type == GGML_TYPE_F32 && v->type == GGML_TYPE_F32);
+    GGML_ASSERT(n_past >= 0 && n_past + q->ne[1] == k->ne[1]);
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, q->ne[0], q->ne[2], q->ne[1]);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * c = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+
+    GGML_ASSERT(sizeof(float) == sizeof(int32_t));
+    ((int32_t *) c->data)[0] = n_past;
+    ((float *)   c->data)[1] = scale;
+    ((float *)   c->data)[2] = max_bias;
+
+    ggml_scratch_load(ctx);
+
+    result->op     = GGML_OP_ATTN_ALIBI;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = q;
+    result->src1   = k;
+    result->opt[0] = v;
+    result->opt[1] = c;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -7495,7 +7726,12 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    // src1 can be broadcast across the rows of src0 and an optional third operand is
+    // accumulated from opt[0] - both are only produced by ggml_graph_optimize
+    const struct ggml_tensor * src2 = dst->opt[0];
+
+    GGML_ASSERT(ggml_can_repeat_rows(src1, src0) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src2 == NULL || (ggml_are_same_shape(src0, src2) && src2->nb[0] == sizeof(float)));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -7509,6 +7745,10 @@ static void ggml_compute_forward_add_f32(
     const int64_t ne1 = src0->ne[1];
     const int64_t ne2 = src0->ne[2];
 
+    const int64_t ne11 = src1->ne[1];
+    const int64_t ne12 = src1->ne[2];
+    const int64_t ne13 = src1->ne[3];
+
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
     const size_t nb02 = src0->nb[2];
@@ -7536,42 +7776,61 @@ static void ggml_compute_forward_add_f32(
 
     if (nb10 == sizeof(float)) {
         for (int ir = ir0; ir < ir1; ++ir) {
-            // src0, src1 and dst are same shape => same indices
+            // src0 and dst are same shape => same indices
+            // src1 is broadcastable across src0 and dst in i1, i2, i3
             const int i3 = ir/(ne2*ne1);
             const int i2 = (ir - i3*ne2*ne1)/ne1;
             const int i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
+            const int64_t i13 = i3 % ne13;
+            const int64_t i12 = i2 % ne12;
+            const int64_t i11 = i1 % ne11;
+
+            float * dst_ptr = (float *) ((char *) dst->data + i3*nb3 + i2*nb2 + i1*nb1);
 
 #ifdef GGML_USE_ACCELERATE
             vDSP_vadd(
                     (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01), 1,
-                    (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11), 1,
-                    (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 ), 1,
+                    (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), 1,
+                    dst_ptr, 1,
                     ne0);
 #else
             ggml_vec_add_f32(ne0,
-                    (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 ),
+                    dst_ptr,
                     (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01),
-                    (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11));
+                    (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11));
 #endif
-                // }
-            // }
+
+            if (src2) {
+                ggml_vec_acc_f32(ne0, dst_ptr,
+                        (float *) ((char *) src2->data + i3*src2->nb[3] + i2*src2->nb[2] + i1*src2->nb[1]));
+            }
         }
     } else {
         // src1 is not contiguous
         for (int ir = ir0; ir < ir1; ++ir) {
-            // src0, src1 and dst are same shape => same indices
+            // src0 and dst are same shape => same indices
+            // src1 is broadcastable across src0 and dst in i1, i2, i3
             const int i3 = ir/(ne2*ne1);
             const int i2 = (ir - i3*ne2*ne1)/ne1;
             const int i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
+            const int64_t i13 = i3 % ne13;
+            const int64_t i12 = i2 % ne12;
+            const int64_t i11 = i1 % ne11;
+
             float * dst_ptr  = (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1 );
             float * src0_ptr = (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01);
             for (int i0 = 0; i0 < ne0; i0++) {
-                float * src1_ptr = (float *) ((char *) src1->data + i3*nb13 + i2*nb12 + i1*nb11 + i0*nb10);
+                float * src1_ptr = (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i0*nb10);
 
                 dst_ptr[i0] = src0_ptr[i0] + *src1_ptr;
             }
+
+            if (src2) {
+                ggml_vec_acc_f32(ne0, dst_ptr,
+                        (float *) ((char *) src2->data + i3*src2->nb[3] + i2*src2->nb[2] + i1*src2->nb[1]));
+            }
         }
     }
 }
@@ -9217,10 +9476,21 @@ static void ggml_compute_forward_gelu_f32(
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
+    // optional bias row fused in by ggml_graph_optimize: dst = gelu(src0 + b)
+    const struct ggml_tensor * b = dst->opt[0];
+
+    GGML_ASSERT(b == NULL || (b->ne[0] == nc && ggml_nrows(b) == 1 && b->type == GGML_TYPE_F32));
+
     for (int i1 = ir0; i1 < ir1; i1++) {
-        ggml_vec_gelu_f32(nc,
-                (float *) ((char *) dst->data  + i1*( dst->nb[1])),
-                (float *) ((char *) src0->data + i1*(src0->nb[1])));
+        if (b) {
+            float * y = (float *) ((char *) dst->data + i1*( dst->nb[1]));
+            ggml_vec_add_f32(nc, y, (float *) ((char *) src0->data + i1*(src0->nb[1])), (float *) b->data);
+            ggml_vec_gelu_f32(nc, y, y);
+        } else {
+            ggml_vec_gelu_f32(nc,
+                    (float *) ((char *) dst->data  + i1*( dst->nb[1])),
+                    (float *) ((char *) src0->data + i1*(src0->nb[1])));
+        }
 
 #ifndef NDEBUG
         for (int k = 0; k < nc; k++) {
@@ -9407,6 +9677,13 @@ static void ggml_compute_forward_norm_f32(
 
     const float eps = 1e-5f; // TODO: make this a parameter
 
+    // optional affine transform fused in by ggml_graph_optimize: y = norm(x)*w + b
+    const struct ggml_tensor * w = dst->opt[0];
+    const struct ggml_tensor * b = dst->opt[1];
+
+    GGML_ASSERT(w == NULL || (w->ne[0] == ne00 && ggml_nrows(w) == 1 && w->type == GGML_TYPE_F32));
+    GGML_ASSERT(b == NULL || (b->ne[0] == ne00 && ggml_nrows(b) == 1 && b->type == GGML_TYPE_F32));
+
     // TODO: optimize
     for (int64_t i03 = 0; i03 < ne03; i03++) {
         for (int64_t i02 = 0; i02 < ne02; i02++) {
@@ -9433,6 +9710,13 @@ static void ggml_compute_forward_norm_f32(
                 const float scale = 1.0f/sqrtf(variance + eps);
 
                 ggml_vec_scale_f32(ne00, y, scale);
+
+                if (w) {
+                    ggml_vec_mul_f32(ne00, y, y, (float *) w->data);
+                }
+                if (b) {
+                    ggml_vec_add_f32(ne00, y, y, (float *) b->data);
+                }
             }
         }
     }
@@ -12838,102 +13122,388 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
-// ggml_compute_forward_flash_ff
+// ggml_compute_forward_attn_kq
 
-static void ggml_compute_forward_flash_ff_f16(
+static void ggml_compute_forward_attn_kq_f32(
         const struct ggml_compute_params * params,
-        const struct ggml_tensor * a,  // F16
-        const struct ggml_tensor * b0, // F16 fc_w
-        const struct ggml_tensor * b1, // F32 fc_b
-        const struct ggml_tensor * c0, // F16 proj_w
-        const struct ggml_tensor * c1, // F32 proj_b
-        struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
-    const int64_t nea0 = a->ne[0];
-    const int64_t nea1 = a->ne[1];
-    const int64_t nea2 = a->ne[2];
-    const int64_t nea3 = a->ne[3];
-
-    const int64_t neb00 = b0->ne[0];
-    const int64_t neb01 = b0->ne[1];
-    //const int64_t neb02 = b0->ne[2];
-    //const int64_t neb03 = b0->ne[3];
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * q,
+              struct ggml_tensor * dst) {
+    const int64_t D = k->ne[0];
+    const int64_t M = k->ne[1];
+    const int64_t N = q->ne[1];
+    const int64_t H = q->ne[2];
+
+    GGML_ASSERT(q->ne[0] == D);
+    GGML_ASSERT(k->ne[2] == H && k->ne[3] == q->ne[3]);
+    GGML_ASSERT(k->nb[0] == sizeof(float));
+    GGML_ASSERT(q->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
 
-    const int64_t neb10 = b1->ne[0];
-    const int64_t neb11 = b1->ne[1];
-    //const int64_t neb12 = b1->ne[2];
-    //const int64_t neb13 = b1->ne[3];
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
-    const int64_t nec00 = c0->ne[0];
-    const int64_t nec01 = c0->ne[1];
-    //const int64_t nec02 = c0->ne[2];
-    //const int64_t nec03 = c0->ne[3];
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-    const int64_t nec10 = c1->ne[0];
-    const int64_t nec11 = c1->ne[1];
-    //const int64_t nec12 = c1->ne[2];
-    //const int64_t nec13 = c1->ne[3];
+    // parallelize by query rows over all heads
+    const int nr = N*H*q->ne[3];
 
-    const int64_t ne0 = dst->ne[0];
-    const int64_t ne1 = dst->ne[1];
-    const int64_t ne2 = dst->ne[2];
-    //const int64_t ne3 = dst->ne[3];
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-    const int nba0 = a->nb[0];
-    const int nba1 = a->nb[1];
-    const int nba2 = a->nb[2];
-    const int nba3 = a->nb[3];
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-    const int nbb00 = b0->nb[0];
-    const int nbb01 = b0->nb[1];
-    const int nbb02 = b0->nb[2];
-    const int nbb03 = b0->nb[3];
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i3 = ir/(H*N);
+        const int i2 = (ir - i3*H*N)/N;
+        const int i1 = (ir - i3*H*N - i2*N);
+
+        const float * qr = (float *) ((char *) q->data + i1*q->nb[1] + i2*q->nb[2] + i3*q->nb[3]);
+        const char  * kr =            (char *) k->data                + i2*k->nb[2] + i3*k->nb[3];
+
+        float * s = (float *) ((char *) dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+
+        switch (D) {
+            case 64:
+                for (int64_t m = 0; m < M; ++m) {
+                    ggml_vec_dot_f32_64(s + m, (const float *) (kr + m*k->nb[1]), qr);
+                } break;
+            case 128:
+                for (int64_t m = 0; m < M; ++m) {
+                    ggml_vec_dot_f32_128(s + m, (const float *) (kr + m*k->nb[1]), qr);
+                } break;
+            default:
+                for (int64_t m = 0; m < M; ++m) {
+                    ggml_vec_dot_f32(D, s + m, (float *) (kr + m*k->nb[1]), (float *) qr);
+                } break;
+        }
+    }
+}
 
-    const int nbb10 = b1->nb[0];
-    //const int nbb11 = b1->nb[1];
-    //const int nbb12 = b1->nb[2];
-    //const int nbb13 = b1->nb[3];
+static void ggml_compute_forward_attn_kq(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * q,
+              struct ggml_tensor * dst) {
+    switch (k->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_attn_kq_f32(params, k, q, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
 
-    const int nbc00 = c0->nb[0];
-    const int nbc01 = c0->nb[1];
-    const int nbc02 = c0->nb[2];
-    const int nbc03 = c0->nb[3];
+// ggml_compute_forward_attn_kqv
 
-    const int nbc10 = c1->nb[0];
-    //const int nbc11 = c1->nb[1];
-    //const int nbc12 = c1->nb[2];
-    //const int nbc13 = c1->nb[3];
+static void ggml_compute_forward_attn_kqv_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * kq,
+              struct ggml_tensor * dst) {
+    const int64_t D = v->ne[0];
+    const int64_t H = v->ne[1];
+    const int64_t M = v->ne[2];
+    const int64_t N = kq->ne[1];
+
+    GGML_ASSERT(kq->ne[0] == M && kq->ne[2] == H);
+    GGML_ASSERT(v->nb[0] == sizeof(float));
+    GGML_ASSERT(kq->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
 
-    const int nb0 = dst->nb[0];
-    const int nb1 = dst->nb[1];
-    const int nb2 = dst->nb[2];
-    const int nb3 = dst->nb[3];
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int64_t D = nea0;
-    //const int64_t N = nea1;
-    const int64_t M = neb01;
-
-    GGML_ASSERT(ne0 == nea0);
-    GGML_ASSERT(ne1 == nea1);
-    GGML_ASSERT(ne2 == nea2);
+    // parallelize by output rows (one per head and query)
+    const int nr = H*N;
 
-    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbb10 == sizeof(float));
-    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbc10 == sizeof(float));
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-    GGML_ASSERT(neb00 == D);
-    GGML_ASSERT(neb01 == M);
-    GGML_ASSERT(neb10 == M);
-    GGML_ASSERT(neb11 == 1);
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-    GGML_ASSERT(nec00 == M);
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i2 = ir/H;
+        const int i1 = ir - i2*H;
+
+        const float * w  = (float *) ((char *) kq->data + i2*kq->nb[1] + i1*kq->nb[2]);
+        const float * vr = (float *) ((char *)  v->data + i1*v->nb[1]);
+
+        float * y = (float *) ((char *) dst->data + i1*dst->nb[1] + i2*dst->nb[2]);
+
+        switch (D) {
+            case 64:
+                ggml_vec_wsum_f32_64(M, y, vr, v->nb[2], w);
+                break;
+            case 128:
+                ggml_vec_wsum_f32_128(M, y, vr, v->nb[2], w);
+                break;
+            default:
+                ggml_vec_set_f32(D, y, 0.0f);
+                for (int64_t m = 0; m < M; ++m) {
+                    ggml_vec_mad_f32(D, y, (float *) ((char *) vr + m*v->nb[2]), w[m]);
+                } break;
+        }
+    }
+}
+
+static void ggml_compute_forward_attn_kqv(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * kq,
+              struct ggml_tensor * dst) {
+    switch (v->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_attn_kqv_f32(params, v, kq, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_attn_alibi
+
+static void ggml_compute_forward_attn_alibi_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * c,
+              struct ggml_tensor * dst) {
+    const int64_t D = q->ne[0];
+    const int64_t N = q->ne[1];
+    const int64_t H = q->ne[2];
+    const int64_t M = k->ne[1];
+
+    GGML_ASSERT(k->ne[0] == D && k->ne[2] == H);
+    GGML_ASSERT(v->ne[0] == D && v->ne[1] == H && v->ne[2] == M);
+    GGML_ASSERT(q->nb[0] == sizeof(float));
+    GGML_ASSERT(k->nb[0] == sizeof(float));
+    GGML_ASSERT(v->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+
+    const int   n_past   = ((int32_t *) c->data)[0];
+    const float scale    = ((float *)   c->data)[1];
+    const float max_bias = ((float *)   c->data)[2];
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // scores of the current query row
+    float * S = (float *) params->wdata + ith*(M + CACHE_LINE_SIZE_F32);
+
+    // same slopes as ggml_compute_forward_alibi_f32
+    const int n_heads_log2_floor = 1 << (int) floor(log2(H));
+
+    const float m0 = powf(2.0f, -(max_bias) / n_heads_log2_floor);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_heads_log2_floor);
+
+    // parallelize by heads - every step of a head is done by the same thread
+    for (int64_t ih = ith; ih < H; ih += nth) {
+        const float m_h = ih < n_heads_log2_floor ? powf(m0, ih + 1) : powf(m1, 2*(ih - n_heads_log2_floor) + 1);
+
+        const char * kh = (char *) k->data + ih*k->nb[2];
+        const char * vh = (char *) v->data + ih*v->nb[1];
+
+        for (int64_t iq = 0; iq < N; ++iq) {
+            const float * qr = (float *) ((char *) q->data + iq*q->nb[1] + ih*q->nb[2]);
+
+            // causal mask: the keys after n_past + iq do not take part at all
+            const int64_t Mq = MIN(M, n_past + iq + 1);
+
+            switch (D) {
+                case 64:
+                    for (int64_t j = 0; j < Mq; ++j) {
+                        ggml_vec_dot_f32_64(S + j, (const float *) (kh + j*k->nb[1]), qr);
+                    } break;
+                case 128:
+                    for (int64_t j = 0; j < Mq; ++j) {
+                        ggml_vec_dot_f32_128(S + j, (const float *) (kh + j*k->nb[1]), qr);
+                    } break;
+                default:
+                    for (int64_t j = 0; j < Mq; ++j) {
+                        ggml_vec_dot_f32(D, S + j, (float *) (kh + j*k->nb[1]), (float *) qr);
+                    } break;
+            }
+
+            // scale + alibi
+            float max = -INFINITY;
+            for (int64_t j = 0; j < Mq; ++j) {
+                S[j] = (j - M + 1)*m_h + S[j]*scale;
+                max  = MAX(max, S[j]);
+            }
+
+            // softmax
+            ggml_float sum = 0.0;
+
+            uint16_t scvt;
+            for (int64_t j = 0; j < Mq; ++j) {
+                ggml_fp16_t s = GGML_FP32_TO_FP16(S[j] - max);
+                memcpy(&scvt, &s, sizeof(scvt));
+                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+                sum += (ggml_float)val;
+                S[j] = val;
+            }
+
+            assert(sum > 0.0);
+
+            ggml_vec_scale_f32(Mq, S, 1.0/sum);
+
+            // weighted sum of the values
+            float * y = (float *) ((char *) dst->data + ih*dst->nb[1] + iq*dst->nb[2]);
+
+            switch (D) {
+                case 64:
+                    ggml_vec_wsum_f32_64(Mq, y, (const float *) vh, v->nb[2], S);
+                    break;
+                case 128:
+                    ggml_vec_wsum_f32_128(Mq, y, (const float *) vh, v->nb[2], S);
+                    break;
+                default:
+                    ggml_vec_set_f32(D, y, 0.0f);
+                    for (int64_t j = 0; j < Mq; ++j) {
+                        ggml_vec_mad_f32(D, y, (float *) (vh + j*v->nb[2]), S[j]);
+                    } break;
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_attn_alibi(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * c,
+              struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_attn_alibi_f32(params, q, k, v, c, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_flash_ff
+
+static void ggml_compute_forward_flash_ff_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * a,  // F16
+        const struct ggml_tensor * b0, // F16 fc_w
+        const struct ggml_tensor * b1, // F32 fc_b
+        const struct ggml_tensor * c0, // F16 proj_w
+        const struct ggml_tensor * c1, // F32 proj_b
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int64_t nea0 = a->ne[0];
+    const int64_t nea1 = a->ne[1];
+    const int64_t nea2 = a->ne[2];
+    const int64_t nea3 = a->ne[3];
+
+    const int64_t neb00 = b0->ne[0];
+    const int64_t neb01 = b0->ne[1];
+    //const int64_t neb02 = b0->ne[2];
+    //const int64_t neb03 = b0->ne[3];
+
+    const int64_t neb10 = b1->ne[0];
+    const int64_t neb11 = b1->ne[1];
+    //const int64_t neb12 = b1->ne[2];
+    //const int64_t neb13 = b1->ne[3];
+
+    const int64_t nec00 = c0->ne[0];
+    const int64_t nec01 = c0->ne[1];
+    //const int64_t nec02 = c0->ne[2];
+    //const int64_t nec03 = c0->ne[3];
+
+    const int64_t nec10 = c1->ne[0];
+    const int64_t nec11 = c1->ne[1];
+    //const int64_t nec12 = c1->ne[2];
+    //const int64_t nec13 = c1->ne[3];
+
+    const int64_t ne0 = dst->ne[0];
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+    //const int64_t ne3 = dst->ne[3];
+
+    const int nba0 = a->nb[0];
+    const int nba1 = a->nb[1];
+    const int nba2 = a->nb[2];
+    const int nba3 = a->nb[3];
+
+    const int nbb00 = b0->nb[0];
+    const int nbb01 = b0->nb[1];
+    const int nbb02 = b0->nb[2];
+    const int nbb03 = b0->nb[3];
+
+    const int nbb10 = b1->nb[0];
+    //const int nbb11 = b1->nb[1];
+    //const int nbb12 = b1->nb[2];
+    //const int nbb13 = b1->nb[3];
+
+    const int nbc00 = c0->nb[0];
+    const int nbc01 = c0->nb[1];
+    const int nbc02 = c0->nb[2];
+    const int nbc03 = c0->nb[3];
+
+    const int nbc10 = c1->nb[0];
+    //const int nbc11 = c1->nb[1];
+    //const int nbc12 = c1->nb[2];
+    //const int nbc13 = c1->nb[3];
+
+    const int nb0 = dst->nb[0];
+    const int nb1 = dst->nb[1];
+    const int nb2 = dst->nb[2];
+    const int nb3 = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = nea0;
+    //const int64_t N = nea1;
+    const int64_t M = neb01;
+
+    GGML_ASSERT(ne0 == nea0);
+    GGML_ASSERT(ne1 == nea1);
+    GGML_ASSERT(ne2 == nea2);
+
+    GGML_ASSERT(nba0  == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbb10 == sizeof(float));
+    GGML_ASSERT(nbc00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbc10 == sizeof(float));
+
+    GGML_ASSERT(neb00 == D);
+    GGML_ASSERT(neb01 == M);
+    GGML_ASSERT(neb10 == M);
+    GGML_ASSERT(neb11 == 1);
+
+    GGML_ASSERT(nec00 == M);
     GGML_ASSERT(nec01 == D);
     GGML_ASSERT(nec10 == D);
     GGML_ASSERT(nec11 == 1);
@@ -13338,6 +13908,18 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
             } break;
+        case GGML_OP_ATTN_KQ:
+            {
+                ggml_compute_forward_attn_kq(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_ATTN_KQV:
+            {
+                ggml_compute_forward_attn_kqv(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_ATTN_ALIBI:
+            {
+                ggml_compute_forward_attn_alibi(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor);
+            } break;
         case GGML_OP_MAP_UNARY:
             {
                 const ggml_unary_op_f32_t fun = *((ggml_unary_op_f32_t *)tensor->opt[0]->data);
@@ -14032,6 +14614,12 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_ATTN_KQ:
+        case GGML_OP_ATTN_KQV:
+        case GGML_OP_ATTN_ALIBI:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_MAP_UNARY:
         case GGML_OP_MAP_BINARY:
             {
@@ -14136,6 +14724,11 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
+        /*.trace        =*/ NULL,
+        /*.hwc          =*/ NULL,
+        /*.pool         =*/ NULL,
+        /*.cpus         =*/ NULL,
+        /*.n_cpus       =*/ 0,
     };
 
     ggml_build_forward_impl(&result, tensor, false);
@@ -14182,81 +14775,779 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 }
 
 //
-// thread data
-//
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+// graph optimization
 //
-
-#ifdef __APPLE__
-
-//#include <os/lock.h>
+// ggml_graph_optimize rewrites a forward graph in place before it is computed:
 //
-//typedef os_unfair_lock ggml_lock_t;
+//   - broadcast operands of ADD/MUL are taken directly instead of through ggml_repeat
+//   - norm -> mul(w) -> add(b), add(b) -> gelu and add(b) -> add(residual) chains are fused
+//   - ggml_cpy into a fresh tensor is turned into a view when the source is already densely packed
+//   - ggml_diag_mask_inf is dropped when it would not mask anything (single token decode)
+//   - element-wise ops reuse the buffer of their input when nothing else reads it
+//   - nodes that no longer contribute to an output and no-op view nodes are removed
 //
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
+// the outputs of the graph are the nodes that are not used by any other node plus the last node.
+// intermediate results are not guaranteed to hold meaningful data after the optimized graph is
+// computed, since they may have been fused away or overwritten by an in-place op
 //
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
 
-typedef int ggml_lock_t;
+struct ggml_graph_opt_node {
+    int    n_uses;
+    bool   is_output;
+    bool   is_live;
+    struct ggml_tensor * alias; // tensor whose data this tensor points into
+    size_t offs;                // byte offset into alias->data
+};
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+static inline bool ggml_op_is_view(enum ggml_op op) {
+    return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
 
-#define GGML_LOCK_INITIALIZER 0
+// the tensor owns the data that was allocated right after it by ggml_new_tensor
+static inline bool ggml_owns_data(const struct ggml_tensor * tensor) {
+    return tensor->data == (void *) (tensor + 1);
+}
 
-typedef pthread_t ggml_thread_t;
+// elements are stored in order without gaps, dimensions of size 1 may have any stride
+static bool ggml_is_dense(const struct ggml_tensor * tensor) {
+    if (GGML_BLCK_SIZE[tensor->type] != 1) {
+        return false;
+    }
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+    size_t nb = GGML_TYPE_SIZE[tensor->type];
+    for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+        if (tensor->ne[i] != 1) {
+            if (tensor->nb[i] != nb) {
+                return false;
+            }
+            nb *= tensor->ne[i];
+        }
+    }
 
-#else
+    return true;
+}
 
-//typedef pthread_spinlock_t ggml_lock_t;
+// a single row of f32 values that can be broadcast over the rows of t
+static inline bool ggml_is_f32_row_of(const struct ggml_tensor * row, const struct ggml_tensor * t) {
+    return row->type == GGML_TYPE_F32 && row->ne[0] == t->ne[0] && ggml_nrows(row) == 1 && row->nb[0] == sizeof(float);
+}
 
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
+static inline struct ggml_graph_opt_node * ggml_graph_opt_get(struct ggml_graph_opt_node * info, const struct ggml_tensor * tensor) {
+    return &info[tensor->n_tasks];
+}
 
-typedef int ggml_lock_t;
+// data of the tensor can be overwritten by its single consumer
+static bool ggml_graph_opt_can_overwrite(struct ggml_graph_opt_node * info, struct ggml_tensor * tensor) {
+    while (true) {
+        const struct ggml_graph_opt_node * ti = ggml_graph_opt_get(info, tensor);
+        if (ti->n_uses != 1 || ti->is_output) {
+            return false;
+        }
+        if (ti->alias == NULL) {
+            break;
+        }
+        tensor = ti->alias;
+    }
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
-#define ggml_lock_lock(x)    _mm_pause()
-#else
-#define ggml_lock_lock(x)    UNUSED(x)
-#endif
-#define ggml_lock_unlock(x)  UNUSED(x)
+    // only buffers of intermediate results can be reused - never weights, inputs or the kv cache
+    return tensor->op != GGML_OP_NONE && ggml_owns_data(tensor);
+}
 
-#define GGML_LOCK_INITIALIZER 0
+static void ggml_graph_opt_count_uses(struct ggml_cgraph * cgraph, struct ggml_graph_opt_node * info) {
+    const int n_total = cgraph->n_nodes + cgraph->n_leafs;
 
-typedef pthread_t ggml_thread_t;
+    for (int i = 0; i < n_total; ++i) {
+        info[i].n_uses  = 0;
+        info[i].is_live = false;
+    }
 
-#define ggml_thread_join   pthread_join
+    for (int i = cgraph->n_nodes - 1; i >= 0; --i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-#endif
+        if (!info[i].is_output && !info[i].is_live) {
+            continue;
+        }
+        info[i].is_live = true;
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; ++j) {
+            srcs[2 + j] = node->opt[j];
+        }
 
-    atomic_int n_done;
-    atomic_bool start;
-    atomic_bool finish;
-    atomic_bool stop; // stop all threads
+        for (int j = 0; j < 2 + GGML_MAX_OPT; ++j) {
+            if (srcs[j]) {
+                ggml_graph_opt_get(info, srcs[j])->n_uses++;
+                ggml_graph_opt_get(info, srcs[j])->is_live = true;
+            }
+        }
+    }
+}
+
+// ADD/MUL: move the broadcast operand to src1 and drop the ggml_repeat in front of it
+static void ggml_graph_opt_canonicalize(struct ggml_graph_opt_node * info, struct ggml_tensor * node) {
+    if ((node->op != GGML_OP_ADD && node->op != GGML_OP_MUL) || node->opt[0] != NULL) {
+        return;
+    }
+
+    struct ggml_tensor * a = node->src0;
+    struct ggml_tensor * b = node->src1;
+
+    if (node->type != GGML_TYPE_F32 || a->type != GGML_TYPE_F32 || b->type != GGML_TYPE_F32) {
+        return;
+    }
+
+    if (a->op == GGML_OP_REPEAT && b->op != GGML_OP_REPEAT) {
+        struct ggml_tensor * t = a; a = b; b = t;
+    } else if (a->op == GGML_OP_NONE && b->op != GGML_OP_NONE && b->op != GGML_OP_REPEAT) {
+        struct ggml_tensor * t = a; a = b; b = t;
+    }
+
+    if (a->nb[0] != sizeof(float) || !ggml_are_same_shape(a, node)) {
+        return;
+    }
+
+    if (b->op == GGML_OP_REPEAT && b->src0->type == GGML_TYPE_F32 && ggml_can_repeat_rows(b->src0, a)) {
+        struct ggml_graph_opt_node * ri = ggml_graph_opt_get(info, b);
+
+        // the repeat is dead once nothing else uses it - release its sources (including the shape template)
+        if (--ri->n_uses == 0) {
+            ggml_graph_opt_get(info, b->src1)->n_uses--;
+        } else {
+            ggml_graph_opt_get(info, b->src0)->n_uses++;
+        }
+
+        b = b->src0;
+    }
+
+    node->src0 = a;
+    node->src1 = b;
+}
+
+static bool ggml_graph_opt_fuse(struct ggml_graph_opt_node * info, struct ggml_tensor * node) {
+    // add(mul(norm(x), w), b) -> norm(x) with affine w, b
+    if (node->op == GGML_OP_ADD && node->opt[0] == NULL && node->src0->op == GGML_OP_MUL) {
+        struct ggml_tensor * mul  = node->src0;
+        struct ggml_tensor * norm = mul->src0;
+
+        if (norm->op == GGML_OP_NORM && norm->opt[0] == NULL && norm->type == GGML_TYPE_F32 &&
+            ggml_graph_opt_get(info, mul)->n_uses == 1 && ggml_graph_opt_get(info, norm)->n_uses == 1 &&
+            ggml_is_f32_row_of(mul->src1, node) && ggml_is_f32_row_of(node->src1, node)) {
+            node->op     = GGML_OP_NORM;
+            node->opt[0] = mul->src1;
+            node->opt[1] = node->src1;
+            node->src0   = norm->src0;
+            node->src1   = NULL;
+            return true;
+        }
+    }
+
+    // gelu(add(x, b)) -> gelu(x) with bias b
+    if (node->op == GGML_OP_GELU && node->opt[0] == NULL && node->src0->op == GGML_OP_ADD) {
+        struct ggml_tensor * add = node->src0;
+
+        if (add->opt[0] == NULL && ggml_graph_opt_get(info, add)->n_uses == 1 &&
+            ggml_is_f32_row_of(add->src1, node) && ggml_is_contiguous(add->src0)) {
+            node->opt[0] = add->src1;
+            node->src0   = add->src0;
+            return true;
+        }
+    }
+
+    // add(add(x, b), r) -> add(x, b) + r
+    if (node->op == GGML_OP_ADD && node->opt[0] == NULL && node->type == GGML_TYPE_F32) {
+        for (int k = 0; k < 2; ++k) {
+            struct ggml_tensor * add = k == 0 ? node->src0 : node->src1;
+            struct ggml_tensor * res = k == 0 ? node->src1 : node->src0;
+
+            if (add->op == GGML_OP_ADD && add->opt[0] == NULL && ggml_graph_opt_get(info, add)->n_uses == 1 &&
+                ggml_are_same_shape(add, node) && ggml_is_f32_row_of(add->src1, node) &&
+                res->type == GGML_TYPE_F32 && ggml_are_same_shape(res, node) && res->nb[0] == sizeof(float)) {
+                node->src0   = add->src0;
+                node->src1   = add->src1;
+                node->opt[0] = res;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool ggml_graph_opt_elide(struct ggml_graph_opt_node * info, struct ggml_tensor * node) {
+    struct ggml_graph_opt_node * ni = ggml_graph_opt_get(info, node);
+
+    // cpy(x, fresh) -> view(x) when x already has the memory layout of the destination
+    if (node->op == GGML_OP_CPY && !ni->is_output) {
+        struct ggml_tensor * src = node->src0;
+        struct ggml_tensor * dst = node->src1;
+
+        if (dst->op == GGML_OP_NONE && ggml_owns_data(dst) && ggml_graph_opt_get(info, dst)->n_uses == 1 &&
+            src->type == dst->type && ggml_is_dense(src) && ggml_is_dense(dst)) {
+            // the data must come from an intermediate buffer that is not overwritten later on
+            struct ggml_tensor * root = src;
+            while (ggml_graph_opt_get(info, root)->alias) {
+                root = ggml_graph_opt_get(info, root)->alias;
+            }
+
+            if (root->op != GGML_OP_NONE) {
+                node->op    = GGML_OP_VIEW;
+                node->src1  = NULL;
+                ni->alias   = src;
+                ni->offs    = 0;
+                return true;
+            }
+        }
+    }
+
+    // diag_mask_inf(x, n_past) -> x when no element is past the diagonal
+    if (node->op == GGML_OP_DIAG_MASK_INF && node->src1->type == GGML_TYPE_I32) {
+        const int n_past = ((int32_t *) node->src1->data)[0];
+
+        if (node->src0->ne[0] <= n_past + 1 && ggml_is_contiguous(node->src0) && ggml_is_contiguous(node)) {
+            node->op   = GGML_OP_VIEW;
+            node->src1 = NULL;
+            ni->alias  = node->src0;
+            ni->offs   = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ggml_graph_opt_inplace(struct ggml_graph_opt_node * info, struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_MUL:
+        case GGML_OP_SCALE:
+        case GGML_OP_GELU:
+        case GGML_OP_NORM:
+        case GGML_OP_SOFT_MAX:
+            break;
+        default:
+            return false;
+    }
+
+    struct ggml_tensor * src = node->src0;
+
+    if (node->type != GGML_TYPE_F32 || src->type != GGML_TYPE_F32 || !ggml_owns_data(node) ||
+        !ggml_are_same_shape(src, node) || !ggml_is_contiguous(src) || !ggml_is_contiguous(node) ||
+        !ggml_graph_opt_can_overwrite(info, src)) {
+        return false;
+    }
+
+    struct ggml_graph_opt_node * ni = ggml_graph_opt_get(info, node);
+
+    ni->alias = src;
+    ni->offs  = 0;
+
+    return true;
+}
+
+int ggml_graph_optimize(struct ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+    const int n_leafs = cgraph->n_leafs;
+
+    if (n_nodes == 0) {
+        return 0;
+    }
+
+    // the rewrites below are only valid for inference graphs
+    for (int i = 0; i < n_nodes; ++i) {
+        if (cgraph->nodes[i]->grad || cgraph->nodes[i]->is_param) {
+            return 0;
+        }
+    }
+
+    struct ggml_graph_opt_node info[2*GGML_MAX_NODES];
+
+    // n_tasks is recomputed by ggml_graph_compute - use it as the index of the tensor in the meantime
+    for (int i = 0; i < n_nodes; ++i) {
+        cgraph->nodes[i]->n_tasks = i;
+    }
+    for (int i = 0; i < n_leafs; ++i) {
+        cgraph->leafs[i]->n_tasks = n_nodes + i;
+    }
+
+    for (int i = 0; i < n_nodes + n_leafs; ++i) {
+        info[i].is_output = false;
+        info[i].alias     = NULL;
+        info[i].offs      = 0;
+    }
+
+    for (int i = 0; i < n_nodes; ++i) {
+        info[i].is_output = true;
+    }
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        if (node->src0) ggml_graph_opt_get(info, node->src0)->is_output = false;
+        if (node->src1) ggml_graph_opt_get(info, node->src1)->is_output = false;
+        for (int j = 0; j < GGML_MAX_OPT; ++j) {
+            if (node->opt[j]) ggml_graph_opt_get(info, node->opt[j])->is_output = false;
+        }
+    }
+    info[n_nodes - 1].is_output = true;
+
+    // record which tensors share their data with one of their sources
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_op_is_view(node->op)) {
+            info[i].alias = node->src0;
+            info[i].offs  = (char *) node->data - (char *) node->src0->data;
+        } else if (node->src0 && node->data == node->src0->data) {
+            info[i].alias = node->src0;
+        } else if (node->src1 && node->data == node->src1->data) {
+            info[i].alias = node->src1;
+        }
+    }
+
+    ggml_graph_opt_count_uses(cgraph, info);
+
+    int n_fused  = 0;
+    int n_elided = 0;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        ggml_graph_opt_canonicalize(info, node);
+
+        n_fused  += ggml_graph_opt_fuse (info, node);
+        n_elided += ggml_graph_opt_elide(info, node);
+    }
+
+    // the fused and elided nodes changed the uses of their sources
+    ggml_graph_opt_count_uses(cgraph, info);
+
+    int n_inplace = 0;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (info[i].is_live) {
+            n_inplace += ggml_graph_opt_inplace(info, node);
+        }
+    }
+
+    // point the aliased tensors to their new data, in topological order
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (info[i].alias) {
+            node->data = (char *) info[i].alias->data + info[i].offs;
+        }
+    }
+
+    // drop dead nodes and views - their data has already been set up above
+    int n_kept = 0;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        node->n_tasks = 0;
+
+        if (!info[i].is_live || (ggml_op_is_view(node->op) && i != n_nodes - 1)) {
+            continue;
+        }
+
+        cgraph->nodes[n_kept] = node;
+        cgraph->grads[n_kept] = cgraph->grads[i];
+        n_kept++;
+    }
+
+    for (int i = n_kept; i < n_nodes; ++i) {
+        cgraph->nodes[i] = NULL;
+        cgraph->grads[i] = NULL;
+    }
+
+    for (int i = 0; i < n_leafs; ++i) {
+        cgraph->leafs[i]->n_tasks = 0;
+    }
+
+    cgraph->n_nodes = n_kept;
+
+    GGML_PRINT_DEBUG("%s: fused %d, elided %d, in-place %d, removed %d of %d nodes\n",
+            __func__, n_fused, n_elided, n_inplace, n_nodes - n_kept, n_nodes);
+
+    return n_nodes - n_kept;
+}
+
+//
+// thread data
+//
+// synchronization is done via busy loops
+// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+//
+
+#ifdef __APPLE__
+
+//#include <os/lock.h>
+//
+//typedef os_unfair_lock ggml_lock_t;
+//
+//#define ggml_lock_init(x)    UNUSED(x)
+//#define ggml_lock_destroy(x) UNUSED(x)
+//#define ggml_lock_lock       os_unfair_lock_lock
+//#define ggml_lock_unlock     os_unfair_lock_unlock
+//
+//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+typedef pthread_t ggml_thread_t;
+
+#define ggml_thread_create pthread_create
+#define ggml_thread_join   pthread_join
+
+#else
+
+//typedef pthread_spinlock_t ggml_lock_t;
+
+//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
+//#define ggml_lock_destroy pthread_spin_destroy
+//#define ggml_lock_lock    pthread_spin_lock
+//#define ggml_lock_unlock  pthread_spin_unlock
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+#define ggml_lock_lock(x)    _mm_pause()
+#else
+#define ggml_lock_lock(x)    UNUSED(x)
+#endif
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+typedef pthread_t ggml_thread_t;
+
+#define ggml_thread_join   pthread_join
+
+#endif
+
+//
+// trace
+//
+// timeline of ggml_graph_compute: one event per node phase and per spin-wait, on every thread
+//
+
+// the phases are the task types, plus the spin-waits
+#define GGML_TRACE_WAIT (GGML_TASK_FINALIZE + 1)
+
+struct ggml_trace_event {
+    int64_t t_start_us;
+    int64_t t_end_us;
+
+    int32_t i_graph;
+    int32_t i_node;
+    int16_t op;
+    int8_t  phase;
+    int8_t  tid; // 0 is the main thread, the workers follow
+};
+
+struct ggml_trace {
+    struct ggml_trace_event * events;
+
+    int        max_events;
+    atomic_int n_events; // can exceed max_events, the events that did not fit are dropped
+
+    int n_graphs;
+};
+
+struct ggml_trace * ggml_trace_new(int max_events) {
+    struct ggml_trace * trace = malloc(sizeof(struct ggml_trace));
+
+    *trace = (struct ggml_trace) {
+        /*.events     =*/ malloc(sizeof(struct ggml_trace_event)*max_events),
+        /*.max_events =*/ max_events,
+        /*.n_events   =*/ 0,
+        /*.n_graphs   =*/ 0,
+    };
+
+    GGML_ASSERT(trace->events != NULL);
+
+    return trace;
+}
+
+void ggml_trace_free(struct ggml_trace * trace) {
+    free(trace->events);
+    free(trace);
+}
+
+inline static void ggml_trace_add(
+        struct ggml_trace * trace,
+        int tid,
+        int phase,
+        int i_graph,
+        int i_node,
+        const struct ggml_tensor * node,
+        int64_t t_start_us,
+        int64_t t_end_us) {
+    const int i = atomic_fetch_add(&trace->n_events, 1);
+    if (i >= trace->max_events) {
+        return;
+    }
+
+    trace->events[i] = (struct ggml_trace_event) {
+        /*.t_start_us =*/ t_start_us,
+        /*.t_end_us   =*/ t_end_us,
+        /*.i_graph    =*/ i_graph,
+        /*.i_node     =*/ i_node,
+        /*.op         =*/ node->op,
+        /*.phase      =*/ phase,
+        /*.tid        =*/ tid,
+    };
+}
+
+bool ggml_trace_write(const struct ggml_trace * trace, const char * fname) {
+    static const char * phase_names[] = { "INIT", "COMPUTE", "FINALIZE", "WAIT" };
+
+    FILE * fp = fopen(fname, "w");
+    if (!fp) {
+        GGML_PRINT("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    const int n_recorded = atomic_load((atomic_int *) &trace->n_events);
+    const int n_events   = MIN(n_recorded, trace->max_events);
+
+    if (n_recorded > n_events) {
+        GGML_PRINT("%s: %d events were dropped, the trace holds %d\n", __func__, n_recorded - n_events, trace->max_events);
+    }
+
+    int64_t t_origin_us = INT64_MAX;
+    int     n_tid       = 0;
+    for (int i = 0; i < n_events; i++) {
+        t_origin_us = MIN(t_origin_us, trace->events[i].t_start_us);
+        n_tid       = MAX(n_tid, trace->events[i].tid + 1);
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    for (int tid = 0; tid < n_tid; tid++) {
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": ", tid);
+        if (tid == 0) {
+            fprintf(fp, "\"main\"}},\n");
+        } else {
+            fprintf(fp, "\"worker %d\"}},\n", tid - 1);
+        }
+    }
+
+    for (int i = 0; i < n_events; i++) {
+        const struct ggml_trace_event * e = &trace->events[i];
+
+        fprintf(fp, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", "
+                "\"pid\": 0, \"tid\": %d, \"args\": {\"graph\": %d, \"node\": %d}}%s\n",
+                e->phase == GGML_TRACE_WAIT ? "wait" : GGML_OP_LABEL[e->op], phase_names[e->phase],
+                e->t_start_us - t_origin_us, e->t_end_us - e->t_start_us,
+                e->tid, e->i_graph, e->i_node, i + 1 < n_events ? "," : "");
+    }
+
+    fprintf(fp, "]}\n");
+    fclose(fp);
+
+    return true;
+}
+
+//
+// hardware counters
+//
+// each thread of ggml_graph_compute opens its own perf_event group and reads it around the nodes it computes
+//
+
+static const char * GGML_HWC_NAME[GGML_HWC_COUNT] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "mem_reads",
+    "dtlb_misses",
+};
+
+struct ggml_hwc {
+    bool    available[GGML_HWC_COUNT];
+    int     n_nodes;
+    int64_t node[GGML_MAX_NODES][GGML_HWC_COUNT];
+};
+
+struct ggml_hwc * ggml_hwc_new(void) {
+    struct ggml_hwc * hwc = calloc(1, sizeof(struct ggml_hwc));
+    GGML_ASSERT(hwc != NULL);
+
+    return hwc;
+}
+
+void ggml_hwc_free(struct ggml_hwc * hwc) {
+    free(hwc);
+}
+
+const char * ggml_hwc_name(enum ggml_hwc_event event) {
+    return GGML_HWC_NAME[event];
+}
+
+bool ggml_hwc_available(const struct ggml_hwc * hwc, enum ggml_hwc_event event) {
+    return hwc->available[event];
+}
+
+int64_t ggml_hwc_get(const struct ggml_hwc * hwc, int i_node, enum ggml_hwc_event event) {
+    GGML_ASSERT(i_node >= 0 && i_node < hwc->n_nodes);
+    return hwc->node[i_node][event];
+}
+
+// counters of one thread
+struct ggml_hwc_thread {
+    int     fd;                     // group leader, -1 if no counter could be opened
+    int     fds[GGML_HWC_COUNT];
+    int     slot[GGML_HWC_COUNT];   // position of the event in a group read, -1 if not available
+    int64_t start[GGML_HWC_COUNT];
 };
 
+#if defined(__linux__)
+
+static void ggml_hwc_thread_open(struct ggml_hwc_thread * t, struct ggml_hwc * hwc, bool set_available) {
+    static const struct { uint32_t type; uint64_t config; } events[GGML_HWC_COUNT] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES   },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        // reads served by a memory node, not implemented on every CPU
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16) },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS   << 16) },
+    };
+
+    t->fd = -1;
+
+    int n = 0;
+    for (int k = 0; k < GGML_HWC_COUNT; k++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.type           = events[k].type;
+        attr.size           = sizeof(attr);
+        attr.config         = events[k].config;
+        attr.read_format    = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        // pid = 0, cpu = -1: the calling thread on any cpu
+        t->fds[k]  = syscall(__NR_perf_event_open, &attr, 0, -1, t->fd, 0);
+        t->slot[k] = t->fds[k] >= 0 ? n++ : -1;
+
+        if (t->fd < 0) {
+            t->fd = t->fds[k];
+        }
+
+        if (set_available) {
+            hwc->available[k] = t->fds[k] >= 0;
+        }
+    }
+}
+
+static void ggml_hwc_thread_close(struct ggml_hwc_thread * t) {
+    for (int k = 0; k < GGML_HWC_COUNT; k++) {
+        if (t->fds[k] >= 0) {
+            close(t->fds[k]);
+        }
+    }
+}
+
+static void ggml_hwc_thread_read(const struct ggml_hwc_thread * t, int64_t * values) {
+    struct {
+        uint64_t nr;
+        uint64_t values[GGML_HWC_COUNT];
+    } data = { 0 };
+
+    if (t->fd < 0 || read(t->fd, &data, sizeof(data)) <= 0) {
+        memset(values, 0, sizeof(int64_t)*GGML_HWC_COUNT);
+        return;
+    }
+
+    for (int k = 0; k < GGML_HWC_COUNT; k++) {
+        values[k] = t->slot[k] >= 0 ? (int64_t) data.values[t->slot[k]] : 0;
+    }
+}
+
+#else
+
+static void ggml_hwc_thread_open(struct ggml_hwc_thread * t, struct ggml_hwc * hwc, bool set_available) {
+    UNUSED(hwc);
+    UNUSED(set_available);
+
+    t->fd = -1;
+}
+
+static void ggml_hwc_thread_close(struct ggml_hwc_thread * t) {
+    UNUSED(t);
+}
+
+static void ggml_hwc_thread_read(const struct ggml_hwc_thread * t, int64_t * values) {
+    UNUSED(t);
+
+    memset(values, 0, sizeof(int64_t)*GGML_HWC_COUNT);
+}
+
+#endif
+
+inline static void ggml_hwc_thread_start(struct ggml_hwc_thread * t) {
+    ggml_hwc_thread_read(t, t->start);
+}
+
+// add the counts since ggml_hwc_thread_start to the node, other threads may be adding to it at the same time
+inline static void ggml_hwc_thread_stop(struct ggml_hwc_thread * t, struct ggml_hwc * hwc, int i_node) {
+    int64_t end[GGML_HWC_COUNT];
+    ggml_hwc_thread_read(t, end);
+
+    for (int k = 0; k < GGML_HWC_COUNT; k++) {
+#if defined(_MSC_VER)
+        InterlockedExchangeAdd64(&hwc->node[i_node][k], end[k] - t->start[k]);
+#else
+        __atomic_fetch_add(&hwc->node[i_node][k], end[k] - t->start[k], __ATOMIC_RELAXED);
+#endif
+    }
+}
+
+struct ggml_compute_state_shared {
+    ggml_lock_t spin;
+
+    atomic_int n_done;
+    atomic_bool start;
+    atomic_bool finish;
+    atomic_bool stop; // stop all threads
+
+    struct ggml_trace * trace;
+    int i_graph;
+
+    struct ggml_hwc * hwc;
+
+    bool pool;
+
+    const int * cpus;
+    int n_cpus;
+};
+
+// the CPU of compute thread ith, see ggml_cgraph.cpus
+static int ggml_thread_cpu(const struct ggml_compute_state_shared * shared, int ith) {
+    return shared->n_cpus > 0 ? shared->cpus[ith % shared->n_cpus] : ith;
+}
+
 struct ggml_compute_state {
     ggml_thread_t thrd;
 
     struct ggml_compute_params params;
     struct ggml_tensor * node;
+    int i_node;
+    int tid;
+
+    // written by the thread only, read by the main thread after the join
+    int64_t busy_us;
+    int64_t spin_us;
 
     struct ggml_compute_state_shared * shared;
 };
@@ -14272,8 +15563,9 @@ static int ggml_thread_create(pthread_t *thread,
         return -1;
     }
 
-    int n = ((struct ggml_compute_state*) arg)->params.ith;
-    DWORD_PTR new_affinity_mask = 1 << n;
+    const struct ggml_compute_state * state = (struct ggml_compute_state*) arg;
+    int n = ggml_thread_cpu(state->shared, state->params.ith);
+    DWORD_PTR new_affinity_mask = (DWORD_PTR) 1 << n;
     DWORD_PTR prev_affinity_mask = SetThreadAffinityMask(*thread, new_affinity_mask);
     if (prev_affinity_mask == 0) {
         return -1;
@@ -14292,25 +15584,44 @@ static int ggml_thread_create(pthread_t *thread,
     pthread_attr_t attr;
     pthread_attr_init(&attr);
 
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(((struct ggml_compute_state*) arg)->params.ith, &cpuset);
-    pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
-
     pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
 
     struct sched_param param = {sched_get_priority_max(SCHED_FIFO)};
     pthread_attr_setschedparam(&attr, &param);
 
-    return pthread_create(thread, &attr, start_routine, arg);
+    const int rc = pthread_create(thread, &attr, start_routine, arg);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // set on the thread, pthread_attr_setaffinity_np would allocate a copy of the set for every graph
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    const struct ggml_compute_state * state = (struct ggml_compute_state*) arg;
+    CPU_SET(ggml_thread_cpu(state->shared, state->params.ith), &cpuset);
+    pthread_setaffinity_np(*thread, sizeof(cpuset), &cpuset);
+
+    return 0;
 }
 #endif
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
+    struct ggml_trace * trace = state->shared->trace;
+
+    const bool timed = trace || state->shared->pool;
+
+    struct ggml_hwc * hwc = state->shared->hwc;
+    struct ggml_hwc_thread hwc_thread;
+    if (hwc) {
+        ggml_hwc_thread_open(&hwc_thread, hwc, false);
+    }
+
     while (true) {
         atomic_fetch_sub(&state->shared->n_done, 1);
+        const int64_t t_wait_us = timed ? ggml_time_us() : 0;
 #ifdef __linux__
         while (!atomic_load_explicit(&state->shared->start, memory_order_relaxed)) {
 #else
@@ -14327,9 +15638,27 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         }
 
         if (state->node) {
+            const int64_t t_start_us = timed ? ggml_time_us() : 0;
+            state->spin_us += t_start_us - t_wait_us;
+            if (trace) {
+                ggml_trace_add(trace, state->tid, GGML_TRACE_WAIT, state->shared->i_graph, state->i_node, state->node, t_wait_us, t_start_us);
+            }
             if (state->params.ith < state->params.nth) {
+                if (hwc) {
+                    ggml_hwc_thread_start(&hwc_thread);
+                }
                 ggml_compute_forward(&state->params, state->node);
+                if (hwc) {
+                    ggml_hwc_thread_stop(&hwc_thread, hwc, state->i_node);
+                }
+            }
+            const int64_t t_end_us = timed ? ggml_time_us() : 0;
+            state->busy_us += t_end_us - t_start_us;
+            if (trace && state->params.ith < state->params.nth) {
+                ggml_trace_add(trace, state->tid, state->params.type, state->shared->i_graph, state->i_node, state->node, t_start_us, t_end_us);
             }
+            const struct ggml_tensor * node = state->node;
+            const int i_node = state->i_node;
             state->node = NULL;
             atomic_fetch_add(&state->shared->n_done, 1);
 #ifdef __linux__
@@ -14341,11 +15670,22 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 // ggml_lock_lock(&state->shared->spin);
                 // ggml_lock_unlock(&state->shared->spin);
             }
+            if (timed) {
+                const int64_t t_done_us = ggml_time_us();
+                state->spin_us += t_done_us - t_end_us;
+                if (trace) {
+                    ggml_trace_add(trace, state->tid, GGML_TRACE_WAIT, state->shared->i_graph, i_node, node, t_end_us, t_done_us);
+                }
+            }
         } else {
             break;
         }
     }
 
+    if (hwc) {
+        ggml_hwc_thread_close(&hwc_thread);
+    }
+
     return 0;
 }
 
@@ -14358,7 +15698,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         /* start     =*/ false,
         /* finish    =*/ false,
         /* stop      =*/ false,
+        /* trace     =*/ cgraph->trace,
+        /* i_graph   =*/ cgraph->trace ? cgraph->trace->n_graphs++ : 0,
+        /* hwc       =*/ cgraph->hwc,
+        /* pool      =*/ cgraph->pool != NULL,
+        /* cpus      =*/ cgraph->cpus,
+        /* n_cpus    =*/ cgraph->n_cpus,
     };
+
+    struct ggml_hwc * hwc = cgraph->hwc;
+    struct ggml_hwc_thread hwc_thread;
+    if (hwc) {
+        hwc->n_nodes = cgraph->n_nodes;
+        memset(hwc->node, 0, sizeof(hwc->node[0])*cgraph->n_nodes);
+
+        ggml_hwc_thread_open(&hwc_thread, hwc, true);
+    }
     struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
 
     // create thread pool
@@ -14374,8 +15729,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                     .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
                     .wdata = cgraph->work ? cgraph->work->data : NULL,
                 },
-                .node   = NULL,
-                .shared = &state_shared,
+                .node    = NULL,
+                .i_node  = -1,
+                .tid     = j + 1,
+                .busy_us = 0,
+                .spin_us = 0,
+                .shared  = &state_shared,
             };
 
             int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
@@ -14385,12 +15744,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 #if defined(_WIN32)
     pthread_t self = GetCurrentThread();
-    SetThreadAffinityMask(self, 1);
+    SetThreadAffinityMask(self, (DWORD_PTR) 1 << ggml_thread_cpu(&state_shared, 0));
 #elif defined(__linux__)
     pthread_t self = pthread_self();
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(0, &cpuset);
+    CPU_SET(ggml_thread_cpu(&state_shared, 0), &cpuset);
     pthread_setaffinity_np(self, sizeof(cpuset), &cpuset);
 #endif
 
@@ -14613,6 +15972,20 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                             cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
                         }
 
+                        work_size = MAX(work_size, cur);
+                    } break;
+                case GGML_OP_ATTN_KQ:
+                case GGML_OP_ATTN_KQV:
+                    {
+                        node->n_tasks = n_threads - 1;
+                    } break;
+                case GGML_OP_ATTN_ALIBI:
+                    {
+                        // no point in more threads than heads
+                        node->n_tasks = MIN(n_threads - 1, node->src0->ne[2]);
+
+                        const size_t cur = sizeof(float)*(node->src1->ne[1] + CACHE_LINE_SIZE_F32)*node->n_tasks;
+
                         work_size = MAX(work_size, cur);
                     } break;
                 case GGML_OP_MAP_UNARY:
@@ -14646,6 +16019,13 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
+    struct ggml_trace * trace = cgraph->trace;
+
+    // the main thread is busy in INIT and in the nodes it computes alone, it spins while the workers compute
+    struct ggml_pool_stats * pool = cgraph->pool;
+    const int64_t pool_start_us = pool ? ggml_time_us() : 0;
+    int64_t pool_busy_us = 0;
+
     for (int i = 0; i < cgraph->n_nodes; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
 
@@ -14669,7 +16049,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
         };
 
+        if (hwc) {
+            ggml_hwc_thread_start(&hwc_thread);
+        }
         ggml_compute_forward(&params, node);
+        if (hwc) {
+            ggml_hwc_thread_stop(&hwc_thread, hwc, i);
+        }
+
+        int64_t t_trace_us = 0;
+        if (trace || pool) {
+            t_trace_us = ggml_time_us();
+        }
+        if (trace) {
+            ggml_trace_add(trace, 0, GGML_TASK_INIT, state_shared.i_graph, i, node, st, t_trace_us);
+        }
+        const int64_t t_init_us = t_trace_us;
 
         // COMPUTE
         if (node->n_tasks > 1) {
@@ -14682,7 +16077,8 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                     .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
                     .wdata = cgraph->work ? cgraph->work->data : NULL,
                 };
-                workers[j].node = node;
+                workers[j].node   = node;
+                workers[j].i_node = i;
             }
 
             // launch thread pool
@@ -14714,13 +16110,32 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             }
             atomic_store(&state_shared.start, false);
             atomic_store(&state_shared.finish, true);
+
+            if (trace) {
+                const int64_t t_end_us = ggml_time_us();
+                ggml_trace_add(trace, 0, GGML_TRACE_WAIT, state_shared.i_graph, i, node, t_trace_us, t_end_us);
+                t_trace_us = t_end_us;
+            }
         } else {
             params.type = GGML_TASK_COMPUTE;
+            if (hwc) {
+                ggml_hwc_thread_start(&hwc_thread);
+            }
             ggml_compute_forward(&params, node);
+            if (hwc) {
+                ggml_hwc_thread_stop(&hwc_thread, hwc, i);
+            }
+
+            if (trace) {
+                const int64_t t_end_us = ggml_time_us();
+                ggml_trace_add(trace, 0, GGML_TASK_COMPUTE, state_shared.i_graph, i, node, t_trace_us, t_end_us);
+                t_trace_us = t_end_us;
+            }
         }
 
         if (node->op != GGML_OP_MUL_MAT && node->op != GGML_OP_RMS_NORM && node->op != GGML_OP_CPY && node->op != GGML_OP_ROPE &&
-            node->op != GGML_OP_ADD && node->op != GGML_OP_SILU && node->op != GGML_OP_SCALE && node->op != GGML_OP_MUL) {
+            node->op != GGML_OP_ADD && node->op != GGML_OP_SILU && node->op != GGML_OP_SCALE && node->op != GGML_OP_MUL &&
+            node->op != GGML_OP_ATTN_KQ && node->op != GGML_OP_ATTN_KQV && node->op != GGML_OP_ATTN_ALIBI) {
             // FINALIZE
             if (node->n_tasks > 1) {
                 // init task
@@ -14732,7 +16147,8 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
                         .wdata = cgraph->work ? cgraph->work->data : NULL,
                     };
-                    workers[j].node = node;
+                    workers[j].node   = node;
+                    workers[j].i_node = i;
                 }
 
                 // launch thread pool
@@ -14760,22 +16176,42 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 }
                 atomic_store(&state_shared.start, false);
                 atomic_store(&state_shared.finish, true);
+
+                if (trace) {
+                    ggml_trace_add(trace, 0, GGML_TRACE_WAIT, state_shared.i_graph, i, node, t_trace_us, ggml_time_us());
+                }
             } else {
                 params.type = GGML_TASK_FINALIZE;
+                if (hwc) {
+                    ggml_hwc_thread_start(&hwc_thread);
+                }
                 ggml_compute_forward(&params, node);
+                if (hwc) {
+                    ggml_hwc_thread_stop(&hwc_thread, hwc, i);
+                }
+
+                if (trace) {
+                    ggml_trace_add(trace, 0, GGML_TASK_FINALIZE, state_shared.i_graph, i, node, t_trace_us, ggml_time_us());
+                }
             }
         }
 
-        op_time[node->op] += ggml_time_us() - st;
+        const int64_t perf_time_us_cur = ggml_time_us() - st;
+
+        op_time[node->op] += perf_time_us_cur;
+
+        if (pool) {
+            pool_busy_us += node->n_tasks > 1 ? t_init_us - st : perf_time_us_cur;
+        }
 
         // performance stats (node)
+        // the wall time is always recorded, it is read back by the callers that profile the graph
         {
             // int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            // int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
 
             node->perf_runs++;
             // node->perf_cycles  += perf_cycles_cur;
-            // node->perf_time_us += perf_time_us_cur;
+            node->perf_time_us += perf_time_us_cur;
         }
     }
 
@@ -14793,6 +16229,24 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         ggml_lock_destroy(&state_shared.spin);
     }
 
+    if (hwc) {
+        ggml_hwc_thread_close(&hwc_thread);
+    }
+
+    if (pool) {
+        const int64_t wall_us = ggml_time_us() - pool_start_us;
+
+        pool->n_graphs  += 1;
+        pool->n_threads += n_threads;
+        pool->wall_us   += wall_us*n_threads;
+        pool->busy_us   += pool_busy_us;
+        pool->spin_us   += wall_us - pool_busy_us;
+        for (int j = 0; j < n_threads - 1; j++) {
+            pool->busy_us += workers[j].busy_us;
+            pool->spin_us += workers[j].spin_us;
+        }
+    }
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -321,6 +321,10 @@ extern "C" {
         GGML_OP_FLASH_ATTN,
         GGML_OP_FLASH_FF,
 
+        GGML_OP_ATTN_KQ,
+        GGML_OP_ATTN_KQV,
+        GGML_OP_ATTN_ALIBI,
+
         GGML_OP_MAP_UNARY,
         GGML_OP_MAP_BINARY,
 
@@ -377,6 +381,10 @@ extern "C" {
         char padding[16];
     };
 
+    struct ggml_trace;
+    struct ggml_hwc;
+    struct ggml_pool_stats;
+
     // computation graph
     struct ggml_cgraph {
         int n_nodes;
@@ -394,6 +402,19 @@ extern "C" {
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
+
+        // if not NULL, ggml_graph_compute records the per thread timeline of the nodes into it
+        struct ggml_trace * trace;
+
+        // if not NULL, ggml_graph_compute counts hardware events per node into it
+        struct ggml_hwc * hwc;
+
+        // if not NULL, ggml_graph_compute adds the busy and spin time of its threads to it
+        struct ggml_pool_stats * pool;
+
+        // if n_cpus > 0, compute thread ith runs on CPU cpus[ith % n_cpus] instead of CPU ith (Linux and Windows)
+        const int * cpus;
+        int         n_cpus;
     };
 
     // scratch buffer
@@ -408,6 +429,7 @@ extern "C" {
         size_t mem_size;   // bytes
         void * mem_buffer; // if NULL, memory will be allocated internally
         bool   no_alloc;   // don't allocate memory for the tensor data
+        size_t data_align; // alignment of the tensor data, 0 for the build default (GGML_DATA_ALIGN)
     };
 
     // misc
@@ -429,6 +451,7 @@ extern "C" {
     GGML_API float   ggml_type_sizef(enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
 
     GGML_API const char * ggml_type_name(enum ggml_type type);
+    GGML_API const char * ggml_op_name  (enum ggml_op   op);
 
     GGML_API size_t  ggml_element_size(const struct ggml_tensor * tensor);
 
@@ -443,6 +466,7 @@ extern "C" {
     GGML_API void    ggml_free(struct ggml_context * ctx);
 
     GGML_API size_t  ggml_used_mem(const struct ggml_context * ctx);
+    GGML_API size_t  ggml_get_mem_size(const struct ggml_context * ctx);
 
     GGML_API size_t  ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
 
@@ -939,6 +963,33 @@ extern "C" {
             struct ggml_tensor  * c0,
             struct ggml_tensor  * c1);
 
+    // attention scores of every query row against every key row, per head
+    // same result as ggml_mul_mat(k, q), with kernels specialized for head sizes 64 and 128
+    // k: [D, M, H], q: [D, N, H] -> [M, N, H]
+    GGML_API struct ggml_tensor * ggml_attn_kq(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * q);
+
+    // attention output from the (softmaxed) scores and the values as they are stored in the kv cache
+    // v: [D, H, M], kq: [M, N, H] -> [D, H, N]
+    GGML_API struct ggml_tensor * ggml_attn_kqv(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * kq);
+
+    // fused attention with alibi and causal mask: softmax(scale*k*q + alibi)*v
+    // each thread computes whole heads end to end, so there is no synchronization between the steps
+    // q: [D, N, H], k: [D, M, H], v: [D, H, M] -> [D, H, N]
+    GGML_API struct ggml_tensor * ggml_attn_alibi(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            int                   n_past,
+            float                 scale,
+            float                 max_bias);
+
     // Mapping operations
     typedef void (*ggml_unary_op_f32_t)(const int, float *, const float *);
     typedef void (*ggml_binary_op_f32_t)(const int, float *, const float *, const float *);
@@ -967,9 +1018,55 @@ extern "C" {
     GGML_API struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
     GGML_API struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
+    // fuse, simplify and prune a forward graph before computing it
+    // only the outputs of the graph (nodes without consumers and the last node) keep meaningful data
+    // returns the number of nodes that were removed from the graph
+    GGML_API int ggml_graph_optimize(struct ggml_cgraph * cgraph);
+
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // timeline of the INIT, COMPUTE and FINALIZE phase of every node and of the spin-waits, on every thread
+    // set cgraph->trace to record, one trace can collect many graphs
+    // events beyond max_events are dropped
+    GGML_API struct ggml_trace * ggml_trace_new  (int max_events);
+    GGML_API void                ggml_trace_free (struct ggml_trace * trace);
+
+    // write the trace in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+    GGML_API bool                ggml_trace_write(const struct ggml_trace * trace, const char * fname);
+
+    // hardware performance counters (perf_event_open, Linux only)
+    // set cgraph->hwc to count the events of every thread, summed per node of the graph
+    // only user space is counted, so that it works with the default perf_event_paranoid
+    enum ggml_hwc_event {
+        GGML_HWC_CYCLES = 0,
+        GGML_HWC_INSTRUCTIONS,
+        GGML_HWC_LLC_MISSES,
+        GGML_HWC_MEM_READS,   // reads served by memory, not available on every CPU
+        GGML_HWC_DTLB_MISSES,
+        GGML_HWC_COUNT,
+    };
+
+    GGML_API struct ggml_hwc * ggml_hwc_new      (void);
+    GGML_API void              ggml_hwc_free     (struct ggml_hwc * hwc);
+    GGML_API const char *      ggml_hwc_name     (enum ggml_hwc_event event);
+
+    // false if the event could not be opened in the last ggml_graph_compute
+    GGML_API bool              ggml_hwc_available(const struct ggml_hwc * hwc, enum ggml_hwc_event event);
+
+    // count of node i_node of the last computed graph
+    GGML_API int64_t           ggml_hwc_get      (const struct ggml_hwc * hwc, int i_node, enum ggml_hwc_event event);
+
+    // time of the threads of ggml_graph_compute, summed over the threads and the graphs
+    // every thread counts into its own state, the main thread adds the totals after the join
+    struct ggml_pool_stats {
+        int64_t n_graphs;
+        int64_t n_threads; // threads of all the graphs, the main thread included
+        int64_t wall_us;   // wall time of the graphs times their number of threads
+        int64_t busy_us;   // computing the nodes
+        int64_t spin_us;   // spin-waiting for work or for the other threads
+    };
+
     // print info and performance information for the graph
     GGML_API void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -1134,6 +1231,8 @@ extern "C" {
 
     quantize_fns_t ggml_internal_get_quantize_fn(size_t i);
 
+    void ggml_internal_vec_dot_f16(const int n, float * GGML_RESTRICT s, const ggml_fp16_t * GGML_RESTRICT x, const ggml_fp16_t * GGML_RESTRICT y);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -1,10 +1,14 @@
 #include "bloom.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iostream>
 #include <map>
 #include <string>
 #include <vector>
@@ -16,6 +20,18 @@
 #include <signal.h>
 #endif
 
+// set by Ctrl+C in interactive mode, the turn goes back to the user after the current token
+static volatile sig_atomic_t is_interacting = 0;
+
+static void sigint_handler(int signo) {
+    if (signo == SIGINT) {
+        if (is_interacting) {
+            _Exit(130);
+        }
+        is_interacting = 1;
+    }
+}
+
 int main(int argc, char ** argv) {
     ggml_time_init();
     const int64_t t_main_start_us = ggml_time_us();
@@ -50,8 +66,7 @@ int main(int argc, char ** argv) {
     // load the model
     {
         const int64_t t_start_us = ggml_time_us();
-        const int n_ctx = 512;
-        if (!bloom_model_load(params.model, model, vocab, n_ctx)) {  // TODO: set context from user input ??
+        if (!bloom_model_load(params.model, model, vocab, params.n_ctx)) {
             fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return 1;
         }
@@ -59,6 +74,9 @@ int main(int argc, char ** argv) {
         t_load_us = ggml_time_us() - t_start_us;
     }
 
+    model.cpus        = params.cpus;
+    model.cpus_decode = params.cpus_decode;
+
     int n_past = 0;
 
     int64_t t_sample_us  = 0;
@@ -69,7 +87,10 @@ int main(int argc, char ** argv) {
     // tokenize the prompt
     std::vector<gpt_vocab::id> embd_inp = ::bloom_tokenize(vocab, params.prompt, false); //TODO: set bos to true?
 
-    params.n_predict = std::min(params.n_predict, model.hparams.n_ctx - (int) embd_inp.size());
+    // with -i the turns share the context, the evals stop when it is full
+    if (!params.interactive) {
+        params.n_predict = std::min(params.n_predict, model.hparams.n_ctx - (int) embd_inp.size());
+    }
 
     printf("\n");
     printf("%s: prompt: '%s'\n", __func__, params.prompt.c_str());
@@ -79,6 +100,29 @@ int main(int argc, char ** argv) {
     }
     printf("\n");
     printf("sampling parameters: temp = %f, top_k = %d, top_p = %f, repeat_last_n = %i, repeat_penalty = %f\n", params.temp, params.top_k, params.top_p, params.repeat_last_n, params.repeat_penalty);
+    for (const auto & antiprompt : params.antiprompt) {
+        printf("reverse prompt: '%s'\n", antiprompt.c_str());
+    }
+
+    // the generated text of every turn matches params.regex
+    bloom_token_trie trie;
+    bloom_grammar    grammar;
+    int32_t          grammar_state = 0;
+    if (!params.regex.empty()) {
+        std::string err;
+        bloom_token_trie_init(trie, vocab);
+        if (!bloom_grammar_init(grammar, params.regex, trie, params.eos_ids, err)) {
+            fprintf(stderr, "%s: invalid regex '%s': %s\n", __func__, params.regex.c_str(), err.c_str());
+            return 1;
+        }
+        printf("regex: '%s' (%zu DFA states)\n", params.regex.c_str(), grammar.accept.size());
+    }
+    if (params.interactive) {
+        signal(SIGINT, sigint_handler);
+
+        printf("interactive mode: the model stops at the end of text, a reverse prompt or after n_predict tokens, then the\n");
+        printf("next line from stdin is appended - end it with '\\' to go on with another line. Ctrl+C interjects, Ctrl+D exits.\n");
+    }
     printf("\n\n");
 
     std::vector<gpt_vocab::id> embd;
@@ -87,13 +131,67 @@ int main(int argc, char ** argv) {
     size_t mem_per_token = 0;
     bloom_eval(model, params.n_threads, 0, { 0, 1, 2, 3 }, logits, embeddings, mem_per_token);
 
+    if (params.n_batch <= 0) {
+        params.n_batch = bloom_tune_n_batch(model, params.n_threads, mem_per_token);
+    }
+
+    if (params.n_threads_decode < 0) {
+        bloom_tune_threads_decode(model, params.n_threads, mem_per_token);
+    } else {
+        model.n_threads_decode = params.n_threads_decode;
+    }
+
+    // profile after the warm-up eval
+    bloom_perf perf;
+    if (params.profile) {
+        model.perf = &perf;
+        bloom_perf_probe(perf, params.n_threads);
+    }
+    if (params.profile_hwc) {
+        perf.hwc = ggml_hwc_new();
+    }
+    if (!params.trace.empty()) {
+        model.trace = ggml_trace_new(1 << 22);
+    }
+
+    // a ring buffer, the repetition penalty does not depend on the order of the tokens
     int last_n_size = params.repeat_last_n;
     std::vector<gpt_vocab::id> last_n_tokens(last_n_size);
     std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
 
-    for (int i = embd.size(); i < embd_inp.size() + params.n_predict; i++) {
+    int i_last = 0;
+    auto last_n_push = [&](gpt_vocab::id id) {
+        if (last_n_size > 0) {
+            last_n_tokens[i_last] = id;
+            i_last = (i_last + 1) % last_n_size;
+        }
+    };
+
+    // the buffers of the sampler and embd are reused, the generation loop does not allocate
+    bloom_sampler_buf sampler;
+    embd.reserve(params.n_batch);
+
+    // the tokens of embd_inp are evaluated in order, the user text of every turn is appended to it
+    int n_consumed = 0;
+    int n_remain   = params.n_predict; // of the turn with -i
+    bool input_echo = true;            // the prompt is printed, the user text was already echoed by the terminal
+
+    // the reverse prompts are matched in the generated text as it comes
+    bloom_stop_matcher antiprompt;
+    bloom_stop_matcher_init(antiprompt, params.antiprompt);
+
+    auto is_eos = [&](gpt_vocab::id id) {
+        return std::find(params.eos_ids.begin(), params.eos_ids.end(), id) != params.eos_ids.end();
+    };
+
+    while (n_remain != 0 || n_consumed < (int) embd_inp.size() || params.interactive) {
         // predict
         if (embd.size() > 0) {
+            if (n_past + (int) embd.size() > model.hparams.n_ctx) {
+                printf("\n[context full]\n");
+                break;
+            }
+
             const int64_t t_start_us = ggml_time_us();
 
             if (!bloom_eval(model, params.n_threads, n_past, embd, logits, embeddings, mem_per_token)) { // update logits
@@ -107,7 +205,7 @@ int main(int argc, char ** argv) {
         n_past += embd.size();
         embd.clear();
 
-        if (i >= embd_inp.size()) {
+        if (n_consumed >= (int) embd_inp.size() && !is_interacting) {
             // sample next token
             const float top_p = params.top_p;
             const float temp  = params.temp;
@@ -115,48 +213,132 @@ int main(int argc, char ** argv) {
 
             const int n_vocab = model.hparams.n_vocab;
 
-            gpt_vocab::id id = 0;
+            // with a regex, the tokens it allows alone are taken without the logits and evaluated with this one
+            do {
+                gpt_vocab::id id = 0;
 
-            {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                id = bloom_sample_top_p(vocab, logits.data() + (logits.size() - n_vocab), last_n_tokens, repeat_penalty, top_p, params.top_k, temp, rng);
+                const bloom_token_mask * mask = params.regex.empty() ? nullptr : &bloom_grammar_mask(grammar, grammar_state);
+                if (mask && mask->n_allowed == 0) {
+                    // no token goes on with a match
+                    n_remain = 0;
+                    break;
+                }
+
+                if (mask && mask->n_allowed == 1) {
+                    id = mask->ids[0];
+                } else {
+                    id = bloom_sample_top_p(vocab, logits.data() + (logits.size() - n_vocab), last_n_tokens, repeat_penalty, top_p, params.top_k, temp, rng, sampler, mask);
+                }
 
                 // // print
                 // printf("\ngenerated token: '%s' (%d)\n", vocab.id_to_token[id].c_str(), id);
 
-                last_n_tokens.erase(last_n_tokens.begin());
-                last_n_tokens.push_back(id);
+                last_n_push(id);
+                if (mask) {
+                    grammar_state = bloom_grammar_next(grammar, grammar_state, vocab, id);
+                }
 
                 t_sample_us += ggml_time_us() - t_start_sample_us;
-            }
 
-            // add it to the context
-            embd.push_back(id);
+                // add it to the context
+                embd.push_back(id);
+                --n_remain;
+            } while (!params.regex.empty() && n_remain > 0 && !is_eos(embd.back()) && bloom_grammar_forced(grammar, grammar_state) >= 0);
+
+            input_echo = true;
         } else {
             // if here, it means we are still processing the input prompt
-            for (int k = i; k < embd_inp.size(); k++) {
-                embd.push_back(embd_inp[k]);
-                last_n_tokens.erase(last_n_tokens.begin());
-                last_n_tokens.push_back(embd_inp[k]);
-                if (embd.size() > params.n_batch) {
+            while (n_consumed < (int) embd_inp.size()) {
+                embd.push_back(embd_inp[n_consumed]);
+                last_n_push(embd_inp[n_consumed]);
+                ++n_consumed;
+                if (embd.size() >= params.n_batch) {
                     break;
                 }
             }
-            i += embd.size() - 1;
+        }
+
+        bool done = false;
+
+        // with -i the end of text token ends the turn, without going to the context
+        if (params.interactive && !embd.empty() && is_eos(embd.back())) {
+            embd.pop_back();
+            done = true;
         }
 
         // display text
-        for (auto id : embd) {
-            printf("%s", vocab.id_to_token[id].c_str());
+        if (input_echo) {
+            for (auto id : embd) {
+                printf("%s", vocab.id_to_token[id].c_str());
+            }
+            fflush(stdout);
         }
-        fflush(stdout);
 
         // end of text token
-        if (embd.back() == 2) {
+        if (!embd.empty() && is_eos(embd.back())) {
             printf(" [end of text]\n");
             break;
         }
+
+        // a reverse prompt completed by the generated token
+        if (n_consumed >= (int) embd_inp.size()) {
+            for (auto id : embd) {
+                const std::string & text = vocab.id_to_token[id];
+
+                int i_stop = -1;
+                if (bloom_stop_matcher_feed(antiprompt, text.data(), text.size(), i_stop) >= 0) {
+                    done = true;
+                }
+            }
+        }
+
+        if (!params.interactive) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        if (n_remain <= 0 || done) {
+            is_interacting = 1;
+        }
+
+        // the turn of the user once the prompt and the last sampled token are evaluated, only the new text is tokenized
+        if (is_interacting && embd.empty() && n_consumed >= (int) embd_inp.size()) {
+            std::string buffer;
+            std::string line;
+            bool another_line = true;
+            while (another_line) {
+                if (!std::getline(std::cin, line)) {
+                    // end of input
+                    another_line = false;
+                    buffer.clear();
+                    break;
+                }
+                another_line = !line.empty() && line.back() == '\\';
+                if (another_line) {
+                    line.pop_back();
+                }
+                buffer += line + "\n";
+            }
+
+            if (buffer.empty()) {
+                printf("\n");
+                break;
+            }
+
+            const std::vector<gpt_vocab::id> line_inp = ::bloom_tokenize(vocab, buffer, false);
+            embd_inp.insert(embd_inp.end(), line_inp.begin(), line_inp.end());
+
+            bloom_stop_matcher_reset(antiprompt);
+            grammar_state = 0;
+            n_remain   = params.n_predict;
+            input_echo = false;
+
+            is_interacting = 0;
+        }
     }
 
     // report timing
@@ -171,6 +353,41 @@ int main(int argc, char ** argv) {
         printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
     }
 
+    if (params.profile) {
+        bloom_perf_print(perf);
+
+        if (!params.profile_json.empty()) {
+            std::ofstream fout(params.profile_json);
+            fout << bloom_perf_json(perf) << std::endl;
+            if (!fout) {
+                fprintf(stderr, "%s: failed to write the profile to '%s'\n", __func__, params.profile_json.c_str());
+            }
+        }
+
+        if (perf.hwc) {
+            ggml_hwc_free(perf.hwc);
+        }
+    }
+
+    if (params.mem_report) {
+        const bloom_mem_usage mem = bloom_mem_report(model, vocab);
+
+        bloom_mem_print(mem);
+
+        if (!params.mem_report_json.empty()) {
+            std::ofstream fout(params.mem_report_json);
+            fout << bloom_mem_json(mem) << std::endl;
+            if (!fout) {
+                fprintf(stderr, "%s: failed to write the memory report to '%s'\n", __func__, params.mem_report_json.c_str());
+            }
+        }
+    }
+
+    if (model.trace) {
+        ggml_trace_write(model.trace, params.trace.c_str());
+        ggml_trace_free(model.trace);
+    }
+
     ggml_free(model.ctx);
 
     return 0;
@@ -0,0 +1,280 @@
+// Perplexity of one or more models on a text file
+//
+// usage:
+//
+//   ./perplexity -m model-f16.bin -m model-q4_0.bin -m model-q4_1.bin -f wiki.test.raw [-c 512] [-b 512] [-t 8]
+//
+// The text is tokenized and split into chunks of n_ctx tokens. Every chunk is evaluated from an empty context in
+// batches of n_batch tokens with the logits of all the tokens. Only the second half of each chunk is scored, so that
+// every scored token has at least n_ctx/2 tokens of context. With more than one model the same chunks are evaluated
+// by each of them in turn and the results are summarized in a table, to compare the quality and the speed of the
+// weight types.
+//
+
+#include "bloom.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct perplexity_params {
+    std::vector<std::string> models;
+
+    std::string file;
+
+    int n_ctx     = 512;
+    int n_batch   = 0; // 0 for n_ctx, the whole chunk in one eval
+    int n_chunks  = -1;
+    int n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+};
+
+struct perplexity_result {
+    std::string model;
+    int32_t     f16;
+
+    double model_size_mb;
+    double ppl;
+    double nll_stderr; // standard error of the mean negative log-likelihood
+
+    int     n_chunks;
+    int     n_scored;
+    int64_t t_eval_us;
+    int     n_evaluated;
+};
+
+static void print_usage(const char * argv0, const perplexity_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path, can be repeated to compare models\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME\n");
+    fprintf(stderr, "                        text file to evaluate\n");
+    fprintf(stderr, "  -c N, --ctx N         chunk size in tokens (default: %d)\n", params.n_ctx);
+    fprintf(stderr, "  -b N, --batch_size N  tokens per eval (default: the chunk size)\n");
+    fprintf(stderr, "  --chunks N            evaluate at most N chunks (default: all)\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "\n");
+}
+
+static bool perplexity_params_parse(int argc, char ** argv, perplexity_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0], params);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") {
+            params.models.push_back(argv[++i]);
+        } else if (arg == "-f" || arg == "--file") {
+            params.file = argv[++i];
+        } else if (arg == "-c" || arg == "--ctx") {
+            params.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch_size") {
+            params.n_batch = std::stoi(argv[++i]);
+        } else if (arg == "--chunks") {
+            params.n_chunks = std::stoi(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0], params);
+            return false;
+        }
+    }
+
+    if (params.models.empty() || params.file.empty()) {
+        fprintf(stderr, "error: a model and a text file are required\n");
+        print_usage(argv[0], params);
+        return false;
+    }
+
+    if (params.n_ctx < 4) {
+        fprintf(stderr, "error: the chunk size must be at least 4 tokens\n");
+        return false;
+    }
+
+    if (params.n_batch <= 0 || params.n_batch > params.n_ctx) {
+        params.n_batch = params.n_ctx;
+    }
+
+    return true;
+}
+
+// negative log-likelihood of the token id under the logits
+static double nll(const float * logits, int n_vocab, gpt_vocab::id id) {
+    const float max = *std::max_element(logits, logits + n_vocab);
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += exp((double) logits[i] - max);
+    }
+
+    return log(sum) - ((double) logits[id] - max);
+}
+
+static bool perplexity(const perplexity_params & params, const std::string & fname, const std::string & text, perplexity_result & result) {
+    gpt_vocab vocab;
+    bloom_model model;
+
+    if (!bloom_model_load(fname, model, vocab, params.n_ctx)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const int n_ctx   = params.n_ctx;
+    const int n_vocab = model.hparams.n_vocab;
+
+    const std::vector<gpt_vocab::id> tokens = ::bloom_tokenize(vocab, text, false);
+
+    int n_chunks = tokens.size()/n_ctx;
+    if (params.n_chunks >= 0) {
+        n_chunks = std::min(n_chunks, params.n_chunks);
+    }
+
+    if (n_chunks == 0) {
+        fprintf(stderr, "%s: the text has %zu tokens, at least %d are needed\n", __func__, tokens.size(), n_ctx);
+        ggml_free(model.ctx);
+        return false;
+    }
+
+    fprintf(stderr, "%s: %zu tokens, %d chunks of %d tokens, batch size %d\n", __func__, tokens.size(), n_chunks, n_ctx, params.n_batch);
+
+    // determine the required inference memory per token
+    size_t mem_per_token = 0;
+    {
+        std::vector<float> logits;
+        std::vector<float> embeddings;
+        bloom_eval(model, params.n_threads, 0, { 0, 1, 2, 3 }, logits, embeddings, mem_per_token);
+    }
+
+    const int first = n_ctx/2;
+
+    double nll_sum  = 0.0;
+    double nll_sum2 = 0.0;
+    int    n_scored = 0;
+
+    int64_t t_eval_us = 0;
+
+    std::vector<float> logits;
+    std::vector<float> logits_chunk(n_ctx*(size_t) n_vocab);
+    std::vector<float> embeddings;
+
+    for (int ic = 0; ic < n_chunks; ++ic) {
+        const int start = ic*n_ctx;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int n_past = 0; n_past < n_ctx; n_past += params.n_batch) {
+            const int n = std::min(params.n_batch, n_ctx - n_past);
+            const std::vector<gpt_vocab::id> embd(tokens.begin() + start + n_past, tokens.begin() + start + n_past + n);
+
+            if (!bloom_eval(model, params.n_threads, n_past, embd, logits, embeddings, mem_per_token, true)) {
+                fprintf(stderr, "%s: failed to eval\n", __func__);
+                ggml_free(model.ctx);
+                return false;
+            }
+
+            memcpy(logits_chunk.data() + n_past*(size_t) n_vocab, logits.data(), n*(size_t) n_vocab*sizeof(float));
+        }
+
+        t_eval_us += ggml_time_us() - t_start_us;
+
+        // the logits of token j predict token j + 1
+        for (int j = first; j < n_ctx - 1; ++j) {
+            const double v = nll(logits_chunk.data() + j*(size_t) n_vocab, n_vocab, tokens[start + j + 1]);
+
+            nll_sum  += v;
+            nll_sum2 += v*v;
+            n_scored += 1;
+        }
+
+        fprintf(stderr, "[%d]%.4f,", ic + 1, exp(nll_sum/n_scored));
+        fflush(stderr);
+    }
+    fprintf(stderr, "\n");
+
+    const double mean = nll_sum/n_scored;
+    const double var  = std::max(0.0, nll_sum2/n_scored - mean*mean);
+
+    size_t model_size = 0;
+    for (const auto & kv : model.tensors) {
+        model_size += ggml_nbytes(kv.second);
+    }
+
+    result.model         = fname;
+    result.f16           = model.hparams.f16;
+    result.model_size_mb = model_size/1024.0/1024.0;
+    result.ppl           = exp(mean);
+    result.nll_stderr    = n_scored > 1 ? sqrt(var/(n_scored - 1)) : 0.0;
+    result.n_chunks      = n_chunks;
+    result.n_scored      = n_scored;
+    result.t_eval_us     = t_eval_us;
+    result.n_evaluated   = n_chunks*n_ctx;
+
+    ggml_free(model.ctx);
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    perplexity_params params;
+    if (!perplexity_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    std::string text;
+    {
+        std::ifstream fin(params.file, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.file.c_str());
+            return 1;
+        }
+
+        std::stringstream ss;
+        ss << fin.rdbuf();
+        text = ss.str();
+    }
+
+    std::vector<perplexity_result> results;
+
+    for (const auto & fname : params.models) {
+        perplexity_result result;
+        if (!perplexity(params, fname, text, result)) {
+            return 1;
+        }
+
+        results.push_back(result);
+    }
+
+    static const char * ftype_str[] = { "f32", "f16", "q4_0", "q4_1", };
+
+    printf("\n");
+    printf("| model | type | size MB | chunks | ppl | +/- | tokens/s |\n");
+    printf("| ---   | ---  | ---:    | ---:   | ---: | ---: | ---:    |\n");
+    for (const auto & r : results) {
+        // the standard error of the perplexity, from the one of the mean nll
+        const double ppl_err = r.ppl*r.nll_stderr;
+
+        printf("| %s | %s | %.2f | %d | %.4f | %.4f | %.2f |\n",
+                r.model.c_str(), r.f16 >= 0 && r.f16 < 4 ? ftype_str[r.f16] : "?", r.model_size_mb, r.n_chunks,
+                r.ppl, ppl_err, 1e6*r.n_evaluated/std::max<int64_t>(r.t_eval_us, 1));
+    }
+
+    return 0;
+}
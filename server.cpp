@@ -0,0 +1,1635 @@
+// HTTP inference server with OpenAI-compatible endpoints
+//
+// usage:
+//
+//   ./server -m models/ggml-model-bloomz-7b1-f16-q4_0.bin [--host 127.0.0.1] [--port 8080] [-np 4] [-c 512] [-t 8] [-ns 128]
+//
+//   curl http://127.0.0.1:8080/v1/completions -d '{"prompt": "Je vais", "max_tokens": 16}'
+//   curl -N http://127.0.0.1:8080/v1/completions -d '{"prompt": "Je vais", "max_tokens": 32, "stream": true}'
+//   curl http://127.0.0.1:8080/v1/embeddings -d '{"input": ["first text", "second text"]}'
+//
+// The model is loaded once with -np kv caches, the slots. A single scheduler thread owns the model: every step it
+// admits the queued requests into the free slots, preferring the slot whose cached tokens share the longest prefix
+// with the prompt, and evaluates the next tokens of all the active slots with one bloom_eval_batch - one token of every
+// generating request together with slices of up to n_batch prompt tokens of the new ones. While some requests
+// generate, a step holds at most -ns tokens (at least one prompt token), so a long prompt is evaluated over several
+// steps and the inter-token latency stays bounded; otherwise every prompt gets a full slice. Every HTTP connection is
+// served by its own thread, which waits for the results of its requests.
+//
+// A request can have a deadline, "deadline_ms" in the body or --timeout, counted from its arrival. The queue is
+// ordered by deadline, the requests without one last, and a queued request preempts the active request with the
+// latest deadline that is still evaluating its prompt when no slot is free; the evaluated tokens stay in the cache of
+// the slot. The prompts share the step budget in the same order. A request that passes its deadline or whose client
+// disconnects is stopped before the next step, with the finish reason "deadline" or "cancelled".
+//
+// Also served: GET /health, GET /v1/models and GET /metrics (Prometheus, see bloom_metrics_prometheus).
+//
+
+#include "bloom.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// end of text
+static const gpt_vocab::id BLOOM_TOKEN_EOS = 2;
+
+struct server_params {
+    std::string model = "models/ggml-model-bloomz-7b1-f16-q4_0.bin";
+
+    std::string host = "127.0.0.1";
+    int         port = 8080;
+
+    int n_threads  = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int n_threads_decode = 0; // steps of generating slots only, 0 for n_threads, -1 to calibrate
+
+    std::vector<int> cpus;
+    std::vector<int> cpus_decode;
+    int n_ctx      = 512; // per slot
+    int n_parallel = 4;   // slots
+    int n_batch    = 64;  // prompt tokens per slot and step
+    int n_step     = 128; // tokens per step while some slots generate
+    int timeout_ms = 0;   // default deadline of a request, 0 for none
+
+    std::vector<int> eos_ids = { BLOOM_TOKEN_EOS }; // the tokens that end a completion
+};
+
+static void print_usage(const char * argv0, const server_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  --host HOST           address to listen on (default: %s)\n", params.host.c_str());
+    fprintf(stderr, "  --port N              port to listen on (default: %d)\n", params.port);
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -td N, --threads_decode N\n");
+    fprintf(stderr, "                        threads of the steps without prompt tokens, 0 for -t, -1 to calibrate (default: %d)\n", params.n_threads_decode);
+    fprintf(stderr, "  --cpus LIST           CPUs of the compute threads, like 0-7,16 (default: thread i on CPU i)\n");
+    fprintf(stderr, "  --cpus_decode LIST    CPUs of the compute threads of the steps without prompt tokens\n");
+    fprintf(stderr, "  -c N, --ctx N         context size of every slot (default: %d)\n", params.n_ctx);
+    fprintf(stderr, "  -np N, --parallel N   number of slots, the requests processed at the same time (default: %d)\n", params.n_parallel);
+    fprintf(stderr, "  -b N, --batch_size N  prompt tokens per slot and step (default: %d)\n", params.n_batch);
+    fprintf(stderr, "  -ns N, --step_tokens N\n");
+    fprintf(stderr, "                        tokens per step while some slots generate, the prompts share what is left (default: %d)\n", params.n_step);
+    fprintf(stderr, "  --timeout N           default deadline of a request in ms, 0 for none (default: %d)\n", params.timeout_ms);
+    fprintf(stderr, "  --eos LIST            end of text token ids, like 2,0 (default: %d)\n", BLOOM_TOKEN_EOS);
+    fprintf(stderr, "\n");
+}
+
+static bool server_params_parse(int argc, char ** argv, server_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0], params);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "--host") {
+            params.host = argv[++i];
+        } else if (arg == "--port") {
+            params.port = std::stoi(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::stoi(argv[++i]);
+        } else if (arg == "-td" || arg == "--threads_decode") {
+            params.n_threads_decode = std::stoi(argv[++i]);
+        } else if (arg == "--cpus" || arg == "--cpus_decode") {
+            std::vector<int> & cpus = arg == "--cpus" ? params.cpus : params.cpus_decode;
+            if (!gpt_parse_cpus(argv[++i], cpus)) {
+                fprintf(stderr, "error: invalid CPU list for %s: %s\n", arg.c_str(), argv[i]);
+                return false;
+            }
+        } else if (arg == "-c" || arg == "--ctx") {
+            params.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "-np" || arg == "--parallel") {
+            params.n_parallel = std::stoi(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch_size") {
+            params.n_batch = std::stoi(argv[++i]);
+        } else if (arg == "-ns" || arg == "--step_tokens") {
+            params.n_step = std::stoi(argv[++i]);
+        } else if (arg == "--timeout") {
+            params.timeout_ms = std::stoi(argv[++i]);
+        } else if (arg == "--eos") {
+            if (!gpt_parse_ids(argv[++i], params.eos_ids)) {
+                fprintf(stderr, "error: invalid token id list for %s: %s\n", arg.c_str(), argv[i]);
+                return false;
+            }
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0], params);
+            return false;
+        }
+    }
+
+    if (params.n_parallel < 1 || params.n_ctx < 8 || params.n_batch < 1 || params.n_step < 1) {
+        fprintf(stderr, "error: invalid number of slots, context, batch or step size\n");
+        return false;
+    }
+
+    return true;
+}
+
+//
+// JSON
+//
+
+struct json_value {
+    enum json_type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+    json_type   type = JSON_NULL;
+    bool        b    = false;
+    double      num  = 0.0;
+    std::string str;
+
+    std::vector<json_value> arr;
+    std::vector<std::pair<std::string, json_value>> obj;
+
+    // the member key of an object, NULL if there is none
+    const json_value * get(const std::string & key) const {
+        for (const auto & kv : obj) {
+            if (kv.first == key) {
+                return &kv.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+struct json_parser {
+    const char * p;
+    const char * end;
+
+    void skip_ws() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            ++p;
+        }
+    }
+
+    bool literal(const char * s) {
+        const size_t n = strlen(s);
+        if ((size_t) (end - p) < n || strncmp(p, s, n) != 0) {
+            return false;
+        }
+        p += n;
+        return true;
+    }
+
+    static void append_utf8(std::string & out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char) cp;
+        } else if (cp < 0x800) {
+            out += (char) (0xc0 | (cp >> 6));
+            out += (char) (0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += (char) (0xe0 | (cp >> 12));
+            out += (char) (0x80 | ((cp >> 6) & 0x3f));
+            out += (char) (0x80 | (cp & 0x3f));
+        } else {
+            out += (char) (0xf0 | (cp >> 18));
+            out += (char) (0x80 | ((cp >> 12) & 0x3f));
+            out += (char) (0x80 | ((cp >> 6) & 0x3f));
+            out += (char) (0x80 | (cp & 0x3f));
+        }
+    }
+
+    bool hex4(uint32_t & cp) {
+        if (end - p < 4) {
+            return false;
+        }
+        cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = *p++;
+            cp <<= 4;
+            if (c >= '0' && c <= '9') {
+                cp |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                cp |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                cp |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool string(std::string & out) {
+        ++p; // "
+        while (p < end && *p != '"') {
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+
+            if (++p >= end) {
+                return false;
+            }
+            switch (*p++) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u':
+                    {
+                        uint32_t cp;
+                        if (!hex4(cp)) {
+                            return false;
+                        }
+                        // surrogate pair
+                        if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                            p += 2;
+                            uint32_t lo;
+                            if (!hex4(lo) || lo < 0xdc00 || lo >= 0xe000) {
+                                return false;
+                            }
+                            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        }
+                        append_utf8(out, cp);
+                    } break;
+                default:
+                    return false;
+            }
+        }
+        if (p >= end) {
+            return false;
+        }
+        ++p; // "
+        return true;
+    }
+
+    bool value(json_value & v, int depth) {
+        if (depth > 64) {
+            return false;
+        }
+
+        skip_ws();
+        if (p >= end) {
+            return false;
+        }
+
+        switch (*p) {
+            case '{':
+                {
+                    v.type = json_value::JSON_OBJECT;
+                    ++p;
+                    skip_ws();
+                    if (p < end && *p == '}') {
+                        ++p;
+                        return true;
+                    }
+                    while (true) {
+                        skip_ws();
+                        if (p >= end || *p != '"') {
+                            return false;
+                        }
+                        std::string key;
+                        if (!string(key)) {
+                            return false;
+                        }
+                        skip_ws();
+                        if (p >= end || *p++ != ':') {
+                            return false;
+                        }
+                        v.obj.emplace_back(key, json_value());
+                        if (!value(v.obj.back().second, depth + 1)) {
+                            return false;
+                        }
+                        skip_ws();
+                        if (p < end && *p == ',') {
+                            ++p;
+                        } else if (p < end && *p == '}') {
+                            ++p;
+                            return true;
+                        } else {
+                            return false;
+                        }
+                    }
+                }
+            case '[':
+                {
+                    v.type = json_value::JSON_ARRAY;
+                    ++p;
+                    skip_ws();
+                    if (p < end && *p == ']') {
+                        ++p;
+                        return true;
+                    }
+                    while (true) {
+                        v.arr.emplace_back();
+                        if (!value(v.arr.back(), depth + 1)) {
+                            return false;
+                        }
+                        skip_ws();
+                        if (p < end && *p == ',') {
+                            ++p;
+                        } else if (p < end && *p == ']') {
+                            ++p;
+                            return true;
+                        } else {
+                            return false;
+                        }
+                    }
+                }
+            case '"':
+                v.type = json_value::JSON_STRING;
+                return string(v.str);
+            case 't':
+                v.type = json_value::JSON_BOOL;
+                v.b    = true;
+                return literal("true");
+            case 'f':
+                v.type = json_value::JSON_BOOL;
+                v.b    = false;
+                return literal("false");
+            case 'n':
+                v.type = json_value::JSON_NULL;
+                return literal("null");
+            default:
+                {
+                    // the text is NUL terminated, strtod stops there at the latest
+                    char * num_end = nullptr;
+                    v.type = json_value::JSON_NUMBER;
+                    v.num  = strtod(p, &num_end);
+                    if (num_end == p || num_end > end) {
+                        return false;
+                    }
+                    p = num_end;
+                    return true;
+                }
+        }
+    }
+};
+
+static bool json_parse(const std::string & text, json_value & v) {
+    json_parser parser = { text.c_str(), text.c_str() + text.size() };
+    if (!parser.value(v, 0)) {
+        return false;
+    }
+    parser.skip_ws();
+    return parser.p == parser.end;
+}
+
+// a quoted JSON string, invalid UTF-8 bytes are replaced by U+FFFD
+static std::string json_string(const std::string & s) {
+    std::string out = "\"";
+    char buf[8];
+
+    for (size_t i = 0; i < s.size(); ) {
+        const uint8_t c = s[i];
+
+        if (c < 0x80) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n";  break;
+                case '\r': out += "\\r";  break;
+                case '\t': out += "\\t";  break;
+                default:
+                    if (c < 0x20) {
+                        snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        out += buf;
+                    } else {
+                        out += (char) c;
+                    }
+            }
+            ++i;
+            continue;
+        }
+
+        const int n = (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+
+        bool valid = n > 0 && i + n <= s.size();
+        for (int k = 1; valid && k < n; ++k) {
+            valid = ((uint8_t) s[i + k] >> 6) == 0x2;
+        }
+
+        if (valid) {
+            out.append(s, i, n);
+            i += n;
+        } else {
+            out += "\\ufffd";
+            ++i;
+        }
+    }
+
+    return out + "\"";
+}
+
+static double json_number(const json_value & obj, const char * key, double def) {
+    const json_value * v = obj.get(key);
+    return v && v->type == json_value::JSON_NUMBER ? v->num : def;
+}
+
+static bool json_bool(const json_value & obj, const char * key, bool def) {
+    const json_value * v = obj.get(key);
+    return v && v->type == json_value::JSON_BOOL ? v->b : def;
+}
+
+// length of the longest prefix of the first n bytes of s that does not end inside a UTF-8 sequence, the tokens are byte
+// level so a character can be split over two tokens
+static size_t utf8_complete(const std::string & s, size_t n) {
+    size_t i = n;
+    int    n_cont = 0;
+    while (i > 0 && n_cont < 3 && ((uint8_t) s[i - 1] >> 6) == 0x2) {
+        --i;
+        ++n_cont;
+    }
+    if (i == 0) {
+        return n;
+    }
+
+    const uint8_t c = s[i - 1];
+    const int n_seq = (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+
+    return n_seq > n_cont + 1 ? i - 1 : n;
+}
+
+//
+// HTTP
+//
+
+struct http_request {
+    std::string method;
+    std::string path;
+    std::string body;
+
+    std::vector<std::pair<std::string, std::string>> headers; // lower case names
+};
+
+static bool http_write(int fd, const std::string & data) {
+    for (size_t offs = 0; offs < data.size(); ) {
+        const ssize_t n = send(fd, data.data() + offs, data.size() - offs, 0);
+        if (n <= 0) {
+            return false;
+        }
+        offs += n;
+    }
+    return true;
+}
+
+static const char * http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 500: return "Internal Server Error";
+        case 504: return "Gateway Timeout";
+        default:  return "Error";
+    }
+}
+
+// false once the client closed the connection, the request has been read so any data left is ignored
+static bool http_connected(int fd) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0) {
+        return true;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return false;
+    }
+
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+static void http_reply(int fd, int status, const char * content_type, const std::string & body) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            status, http_status_text(status), content_type, body.size());
+
+    http_write(fd, buf + body);
+}
+
+static void http_reply_error(int fd, int status, const std::string & message) {
+    http_reply(fd, status, "application/json",
+            "{\"error\": {\"message\": " + json_string(message) + ", \"type\": \"invalid_request_error\"}}\n");
+}
+
+// returns the HTTP status to reply with if the request cannot be read, 0 on success
+static int http_read_request(int fd, http_request & req) {
+    const size_t max_header = 64*1024;
+    const size_t max_body   = 16*1024*1024;
+
+    std::string data;
+    char buf[4096];
+
+    size_t header_end = std::string::npos;
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+        if (data.size() > max_header) {
+            return 413;
+        }
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        data.append(buf, n);
+    }
+
+    // request line
+    size_t line_end = data.find("\r\n");
+    {
+        const std::string line = data.substr(0, line_end);
+        const size_t sp0 = line.find(' ');
+        const size_t sp1 = line.find(' ', sp0 + 1);
+        if (sp0 == std::string::npos || sp1 == std::string::npos) {
+            return 400;
+        }
+        req.method = line.substr(0, sp0);
+        req.path   = line.substr(sp0 + 1, sp1 - sp0 - 1);
+
+        const size_t query = req.path.find('?');
+        if (query != std::string::npos) {
+            req.path.resize(query);
+        }
+    }
+
+    // headers
+    size_t content_length = 0;
+    while (line_end < header_end) {
+        const size_t begin = line_end + 2;
+        line_end = data.find("\r\n", begin);
+
+        const std::string line  = data.substr(begin, line_end - begin);
+        const size_t      colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        const size_t value_begin = line.find_first_not_of(' ', colon + 1);
+        const std::string value  = value_begin == std::string::npos ? "" : line.substr(value_begin);
+
+        if (name == "content-length") {
+            content_length = strtoull(value.c_str(), nullptr, 10);
+        }
+        req.headers.emplace_back(name, value);
+    }
+
+    if (content_length > max_body) {
+        return 413;
+    }
+
+    req.body = data.substr(header_end + 4);
+    while (req.body.size() < content_length) {
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        req.body.append(buf, n);
+    }
+    req.body.resize(content_length);
+
+    return 0;
+}
+
+//
+// scheduler
+//
+
+// a completion or an embedding of one prompt
+struct server_request {
+    bool embed = false;
+
+    std::vector<gpt_vocab::id> prompt;
+
+    int   n_predict      = 16;
+    float temp           = 0.80f;
+    float top_p          = 0.95f;
+    int   top_k          = 40;
+    float repeat_penalty = 1.30f;
+    int   repeat_last_n  = 64;
+    int   seed           = -1;
+
+    std::vector<std::string> stop; // strings that end the completion, the text ends before them
+
+    std::shared_ptr<bloom_grammar> grammar; // the text is a match of its regex, nullptr for any text
+
+    int     deadline_ms   = 0; // from the submission, 0 for none
+    int64_t t_submit_us   = 0;
+    int64_t t_deadline_us = 0;
+
+    // set by the connection when the client goes away
+    std::atomic<bool> cancelled {false};
+
+    // written by the scheduler, read by the connection
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::string        text; // generated and not yet taken by the connection
+    std::vector<float> embedding;
+    int                n_generated   = 0;
+    const char *       finish_reason = nullptr;
+    std::string        error;
+    bool               done = false;
+};
+
+// a kv cache of the model and the request that uses it
+struct server_slot {
+    int seq;
+
+    // the first n_past tokens are in the kv cache, the others are evaluated in the next steps
+    std::vector<gpt_vocab::id> tokens;
+    int n_past = 0;
+
+    std::shared_ptr<server_request> req;
+
+    std::vector<gpt_vocab::id> last_n_tokens; // a ring buffer, the next token goes to i_last
+    int i_last = 0;
+    std::mt19937 rng;
+    bloom_sampler_buf sampler;
+    std::string  pending; // bytes of an incomplete UTF-8 character or of a possible stop string
+    bloom_stop_matcher stops;
+    int32_t      grammar_state = 0;
+
+    bloom_metrics      metrics;
+    std::vector<float> decode_ms;
+    int64_t            t_admit_us = 0;
+    int64_t            t_token_us = 0; // of the last sampled token
+};
+
+struct server_context {
+    server_params params;
+
+    bloom_model model;
+    gpt_vocab   vocab;
+    size_t      mem_per_token = 0;
+    std::string model_name;
+
+    bloom_counters counters;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<server_request>> queue;
+
+    // only accessed by the scheduler thread
+    std::vector<server_slot> slots;
+
+    // the compiled regexes, shared by the requests with the same one - the connections add them, and their masks are
+    // filled by the scheduler thread
+    std::mutex       grammar_mutex;
+    bloom_token_trie trie;
+    std::map<std::string, std::shared_ptr<bloom_grammar>> grammars;
+
+    std::mutex            summary_mutex;
+    bloom_metrics_summary summary {};
+
+    std::atomic<int64_t> next_id {0};
+};
+
+static int64_t server_deadline(const server_request & req) {
+    return req.t_deadline_us > 0 ? req.t_deadline_us : INT64_MAX;
+}
+
+// the finish reason of a request to stop before the next step, nullptr to go on
+static const char * server_stop_reason(const server_request & req, int64_t t_us) {
+    if (req.cancelled) {
+        return "cancelled";
+    }
+    if (t_us >= server_deadline(req)) {
+        return "deadline";
+    }
+    return nullptr;
+}
+
+// the earlier deadlines first, in the order of arrival otherwise - sc.mutex must be held
+static void server_enqueue(server_context & sc, const std::shared_ptr<server_request> & req) {
+    auto it = std::upper_bound(sc.queue.begin(), sc.queue.end(), req,
+            [](const std::shared_ptr<server_request> & a, const std::shared_ptr<server_request> & b) {
+                return server_deadline(*a) < server_deadline(*b);
+            });
+    sc.queue.insert(it, req);
+}
+
+static void server_submit(server_context & sc, const std::shared_ptr<server_request> & req) {
+    req->t_submit_us   = ggml_time_us();
+    req->t_deadline_us = req->deadline_ms > 0 ? req->t_submit_us + (int64_t) req->deadline_ms*1000 : 0;
+
+    std::lock_guard<std::mutex> lock(sc.mutex);
+    server_enqueue(sc, req);
+    sc.cv.notify_one();
+}
+
+// hand the result to the connection
+static void server_request_done(server_context & sc, server_request & req, bloom_metrics & metrics, const char * finish_reason, const std::string & error) {
+    metrics.total_ms = (ggml_time_us() - req.t_submit_us)/1000.0;
+    {
+        std::lock_guard<std::mutex> lock(sc.summary_mutex);
+        bloom_metrics_summary_add(sc.summary, metrics);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        req.n_generated   = metrics.n_generated;
+        req.finish_reason = finish_reason;
+        req.error         = error;
+        req.done          = true;
+    }
+    req.cv.notify_all();
+}
+
+// pass text to the connection, the incomplete UTF-8 characters and the bytes that may start a stop string are held back
+// until the next token
+static void server_slot_emit(server_slot & slot, const std::string & text, bool flush) {
+    slot.pending += text;
+
+    const size_t n_held = std::min(slot.pending.size(), (size_t) bloom_stop_matcher_held(slot.stops));
+    const size_t n = flush ? slot.pending.size() : utf8_complete(slot.pending, slot.pending.size() - n_held);
+    if (n == 0) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(slot.req->mutex);
+        slot.req->text += slot.pending.substr(0, n);
+    }
+    slot.req->cv.notify_all();
+
+    slot.pending.erase(0, n);
+}
+
+static void server_slot_finish(server_context & sc, server_slot & slot, const char * finish_reason, const std::string & error = "") {
+    server_slot_emit(slot, "", true);
+
+    slot.metrics.decode_ms = slot.decode_ms.data();
+    slot.metrics.n_decode  = slot.decode_ms.size();
+
+    server_request_done(sc, *slot.req, slot.metrics, finish_reason, error);
+
+    // the sampled token that was not evaluated is not in the cache
+    slot.tokens.resize(slot.n_past);
+    slot.req.reset();
+}
+
+static void server_slot_start(server_slot & slot, const std::shared_ptr<server_request> & req) {
+    const std::vector<gpt_vocab::id> & prompt = req->prompt;
+
+    // reuse the cached prefix, at least one token is evaluated for the logits
+    int n_past = 0;
+    while (n_past < slot.n_past && n_past < (int) prompt.size() && slot.tokens[n_past] == prompt[n_past]) {
+        ++n_past;
+    }
+    n_past = std::min(n_past, (int) prompt.size() - 1);
+
+    slot.req    = req;
+    slot.tokens = prompt;
+    slot.n_past = n_past;
+
+    slot.last_n_tokens.assign(std::max(0, req->repeat_last_n - (int) prompt.size()), 0);
+    slot.last_n_tokens.insert(slot.last_n_tokens.end(), prompt.end() - std::min((int) prompt.size(), req->repeat_last_n), prompt.end());
+    slot.i_last = 0;
+
+    slot.rng.seed(req->seed < 0 ? std::random_device{}() : req->seed);
+    slot.pending.clear();
+    bloom_stop_matcher_init(slot.stops, req->stop);
+    slot.grammar_state = 0;
+
+    slot.t_admit_us = ggml_time_us();
+
+    slot.metrics = {};
+    slot.metrics.n_prompt = prompt.size();
+    slot.metrics.n_cached = n_past;
+    slot.metrics.queue_ms = (slot.t_admit_us - req->t_submit_us)/1000.0;
+    slot.decode_ms.clear();
+}
+
+static void server_slot_last_n(server_slot & slot, gpt_vocab::id id) {
+    if (!slot.last_n_tokens.empty()) {
+        slot.last_n_tokens[slot.i_last] = id;
+        slot.i_last = (slot.i_last + 1) % slot.last_n_tokens.size();
+    }
+}
+
+// the next token of the slot, -1 if its regex allows none
+static gpt_vocab::id server_sample(server_context & sc, server_slot & slot, const float * logits) {
+    const server_request & req = *slot.req;
+    const int n_vocab = sc.model.hparams.n_vocab;
+
+    const bloom_token_mask * mask = req.grammar ? &bloom_grammar_mask(*req.grammar, slot.grammar_state) : nullptr;
+    if (mask && mask->n_allowed == 0) {
+        return -1;
+    }
+
+    gpt_vocab::id id = 0;
+    if (mask && mask->n_allowed == 1) {
+        id = mask->ids[0];
+    } else if (req.temp <= 0.0f && mask) {
+        id = -1;
+        for (gpt_vocab::id i = 0; i < std::min(n_vocab, 32*(int) mask->bits.size()); ++i) {
+            if (((mask->bits[i/32] >> (i%32)) & 1) && (id < 0 || logits[i] > logits[id])) {
+                id = i;
+            }
+        }
+    } else if (req.temp <= 0.0f) {
+        id = std::max_element(logits, logits + n_vocab) - logits;
+    } else {
+        id = bloom_sample_top_p(sc.vocab, logits, slot.last_n_tokens, req.repeat_penalty, req.top_p, req.top_k, req.temp, slot.rng, slot.sampler, mask);
+    }
+
+    server_slot_last_n(slot, id);
+
+    return id;
+}
+
+// add a generated token to the slot and pass its text on, false when it finishes the request
+static bool server_slot_next(server_context & sc, server_slot & slot, gpt_vocab::id id) {
+    server_request & req = *slot.req;
+
+    if (id < 0) {
+        server_slot_finish(sc, slot, "stop");
+        return false;
+    }
+
+    slot.metrics.n_generated += 1;
+    if (slot.metrics.n_generated == 1) {
+        slot.metrics.ttft_ms = (ggml_time_us() - req.t_submit_us)/1000.0;
+    }
+
+    if (std::find(sc.params.eos_ids.begin(), sc.params.eos_ids.end(), id) != sc.params.eos_ids.end()) {
+        server_slot_finish(sc, slot, "stop");
+        return false;
+    }
+
+    slot.tokens.push_back(id);
+    if (req.grammar) {
+        slot.grammar_state = bloom_grammar_next(*req.grammar, slot.grammar_state, sc.vocab, id);
+    }
+
+    const std::string & word = sc.vocab.id_to_token[id];
+
+    int i_stop = -1;
+    const int n_stop = bloom_stop_matcher_feed(slot.stops, word.data(), word.size(), i_stop);
+    if (n_stop >= 0) {
+        // the start of the stop string is in the held back bytes, the text ends before it
+        slot.pending.append(word, 0, n_stop);
+        slot.pending.resize(slot.pending.size() - slot.stops.stops[i_stop].size());
+        server_slot_finish(sc, slot, "stop");
+        return false;
+    }
+
+    server_slot_emit(slot, word, false);
+
+    if (slot.metrics.n_generated >= req.n_predict || (int) slot.tokens.size() >= sc.model.hparams.n_ctx) {
+        server_slot_finish(sc, slot, "length");
+        return false;
+    }
+
+    return true;
+}
+
+static void server_loop(server_context & sc) {
+    const int n_vocab = sc.model.hparams.n_vocab;
+    const int n_embd  = sc.model.hparams.n_embd;
+
+    std::vector<float> logits;
+    std::vector<float> embeddings;
+
+    std::vector<bloom_seq> batch;
+    std::vector<int>       batch_slot;
+    std::vector<int>       prefill; // slots evaluating their prompt
+
+    while (true) {
+        // admit the queued requests into the free slots
+        {
+            std::unique_lock<std::mutex> lock(sc.mutex);
+
+            auto n_active = [&]() {
+                return std::count_if(sc.slots.begin(), sc.slots.end(), [](const server_slot & slot) { return slot.req != nullptr; });
+            };
+
+            sc.cv.wait(lock, [&]() { return !sc.queue.empty() || n_active() > 0; });
+
+            // stop the cancelled requests and the ones past their deadline
+            const int64_t t_now_us = ggml_time_us();
+
+            for (auto & slot : sc.slots) {
+                const char * reason = slot.req ? server_stop_reason(*slot.req, t_now_us) : nullptr;
+                if (reason) {
+                    server_slot_finish(sc, slot, reason);
+                }
+            }
+
+            for (auto it = sc.queue.begin(); it != sc.queue.end(); ) {
+                server_request & req = **it;
+
+                const char * reason = server_stop_reason(req, t_now_us);
+                if (!reason) {
+                    ++it;
+                    continue;
+                }
+
+                bloom_metrics metrics;
+                metrics.n_prompt = req.prompt.size();
+                metrics.queue_ms = (t_now_us - req.t_submit_us)/1000.0;
+                server_request_done(sc, req, metrics, reason, "");
+
+                it = sc.queue.erase(it);
+            }
+
+            // no free slot: the most urgent request takes the slot of the one with the latest deadline that is
+            // still evaluating its prompt, which goes back to the queue
+            if (!sc.queue.empty() && n_active() == (int) sc.slots.size()) {
+                int victim = -1;
+                for (int is = 0; is < (int) sc.slots.size(); ++is) {
+                    const server_slot & slot = sc.slots[is];
+                    if (slot.metrics.n_generated > 0 || server_deadline(*slot.req) <= server_deadline(*sc.queue.front())) {
+                        continue;
+                    }
+                    if (victim < 0 || server_deadline(*slot.req) > server_deadline(*sc.slots[victim].req)) {
+                        victim = is;
+                    }
+                }
+
+                if (victim >= 0) {
+                    server_slot & slot = sc.slots[victim];
+                    server_enqueue(sc, slot.req);
+
+                    // the evaluated prompt tokens stay in the cache
+                    slot.tokens.resize(slot.n_past);
+                    slot.req.reset();
+                }
+            }
+
+            while (!sc.queue.empty() && n_active() < (int) sc.slots.size()) {
+                std::shared_ptr<server_request> req = sc.queue.front();
+                sc.queue.pop_front();
+
+                // the free slot with the longest cached prefix of the prompt
+                int best = -1;
+                int best_len = -1;
+                for (int is = 0; is < (int) sc.slots.size(); ++is) {
+                    const server_slot & slot = sc.slots[is];
+                    if (slot.req) {
+                        continue;
+                    }
+
+                    int len = 0;
+                    while (len < slot.n_past && len < (int) req->prompt.size() && slot.tokens[len] == req->prompt[len]) {
+                        ++len;
+                    }
+                    if (len > best_len) {
+                        best     = is;
+                        best_len = len;
+                    }
+                }
+
+                server_slot_start(sc.slots[best], req);
+            }
+        }
+
+        // the next tokens of the active slots: one token of every generating slot, and the prompts in slices of up to
+        // n_batch tokens. While some slots generate, the prompts share what is left of the step budget in deadline
+        // order, so a long prompt is evaluated between their tokens instead of delaying them for its whole prefill.
+        batch.clear();
+        batch_slot.clear();
+
+        prefill.clear();
+
+        int n_decode = 0;
+        for (int is = 0; is < (int) sc.slots.size(); ++is) {
+            const server_slot & slot = sc.slots[is];
+            if (!slot.req) {
+                continue;
+            }
+            if (slot.metrics.n_generated > 0) {
+                // the sampled token, and the ones its regex allowed alone after it
+                const int n = slot.tokens.size() - slot.n_past;
+
+                batch.push_back({ slot.seq, slot.n_past, slot.tokens.data() + slot.n_past, n });
+                batch_slot.push_back(is);
+                n_decode += n;
+            } else {
+                prefill.push_back(is);
+            }
+        }
+
+        std::stable_sort(prefill.begin(), prefill.end(), [&](int a, int b) {
+            return server_deadline(*sc.slots[a].req) < server_deadline(*sc.slots[b].req);
+        });
+
+        int budget = n_decode > 0 ? std::max(sc.params.n_step - n_decode, 1) : INT_MAX;
+
+        bool embed = false;
+        for (int is : prefill) {
+            const server_slot & slot = sc.slots[is];
+
+            const int n = std::min({ (int) slot.tokens.size() - slot.n_past, sc.params.n_batch, budget });
+            if (n == 0) {
+                break;
+            }
+            budget -= n;
+
+            batch.push_back({ slot.seq, slot.n_past, slot.tokens.data() + slot.n_past, n });
+            batch_slot.push_back(is);
+
+            embed = embed || (slot.req->embed && slot.n_past + n == (int) slot.tokens.size());
+        }
+
+        if (batch.empty()) {
+            continue;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!bloom_eval_batch(sc.model, sc.params.n_threads, batch, logits, embeddings, sc.mem_per_token, false, embed)) {
+            for (int is : batch_slot) {
+                sc.slots[is].n_past = 0;
+                server_slot_finish(sc, sc.slots[is], nullptr, "failed to evaluate the prompt");
+            }
+            continue;
+        }
+
+        const int64_t t_end_us = ggml_time_us();
+
+        int32_t n_kv = 0;
+
+        for (int ib = 0; ib < (int) batch.size(); ++ib) {
+            server_slot & slot = sc.slots[batch_slot[ib]];
+            server_request & req = *slot.req;
+
+            slot.n_past += batch[ib].n_tokens;
+            if (slot.n_past < (int) slot.tokens.size()) {
+                continue; // more prompt tokens
+            }
+
+            if (slot.metrics.n_generated == 0) {
+                slot.metrics.prefill_ms = (t_end_us - slot.t_admit_us)/1000.0;
+            } else {
+                slot.decode_ms.push_back((t_end_us - t_start_us)/1000.0f);
+            }
+
+            if (req.embed) {
+                {
+                    std::lock_guard<std::mutex> lock(req.mutex);
+                    req.embedding.assign(embeddings.begin() + ib*n_embd, embeddings.begin() + (ib + 1)*n_embd);
+                }
+                server_slot_finish(sc, slot, "stop");
+                continue;
+            }
+
+            if (slot.metrics.n_generated >= req.n_predict) {
+                server_slot_finish(sc, slot, "length");
+                continue;
+            }
+
+            gpt_vocab::id id = server_sample(sc, slot, logits.data() + ib*n_vocab);
+
+            // the tokens the regex allows alone do not need the logits, the next step evaluates them with this one
+            while (server_slot_next(sc, slot, id) && req.grammar) {
+                id = bloom_grammar_forced(*req.grammar, slot.grammar_state);
+                if (id < 0) {
+                    break;
+                }
+                server_slot_last_n(slot, id);
+            }
+        }
+
+        for (const auto & slot : sc.slots) {
+            n_kv += slot.n_past;
+        }
+        sc.counters.n_kv.store(n_kv, std::memory_order_relaxed);
+    }
+}
+
+//
+// endpoints
+//
+
+// the prompts of a request: a string, an array of strings, an array of token ids or an array of arrays of token ids
+static bool server_prompts(const server_context & sc, const json_value & v, std::vector<std::vector<gpt_vocab::id>> & prompts, std::string & error) {
+    auto token_ids = [&](const json_value & arr, std::vector<gpt_vocab::id> & tokens) {
+        for (const auto & t : arr.arr) {
+            if (t.type != json_value::JSON_NUMBER || t.num < 0 || t.num >= sc.model.hparams.n_vocab) {
+                return false;
+            }
+            tokens.push_back((gpt_vocab::id) t.num);
+        }
+        return true;
+    };
+
+    if (v.type == json_value::JSON_STRING) {
+        prompts.push_back(bloom_tokenize(sc.vocab, v.str, false));
+    } else if (v.type == json_value::JSON_ARRAY && !v.arr.empty() && v.arr[0].type == json_value::JSON_NUMBER) {
+        prompts.emplace_back();
+        if (!token_ids(v, prompts.back())) {
+            error = "invalid token id";
+            return false;
+        }
+    } else if (v.type == json_value::JSON_ARRAY) {
+        for (const auto & item : v.arr) {
+            prompts.emplace_back();
+            if (item.type == json_value::JSON_STRING) {
+                prompts.back() = bloom_tokenize(sc.vocab, item.str, false);
+            } else if (item.type != json_value::JSON_ARRAY || !token_ids(item, prompts.back())) {
+                error = "the prompts must be strings or arrays of token ids";
+                return false;
+            }
+        }
+    } else {
+        error = "the prompt must be a string or an array";
+        return false;
+    }
+
+    if (prompts.empty()) {
+        error = "no prompt";
+        return false;
+    }
+
+    for (const auto & prompt : prompts) {
+        if (prompt.empty()) {
+            error = "empty prompt";
+            return false;
+        }
+        if ((int) prompt.size() >= sc.model.hparams.n_ctx) {
+            error = "the prompt has " + std::to_string(prompt.size()) + " tokens, the context size is " + std::to_string(sc.model.hparams.n_ctx);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// wait until the request is done, or has new text with text set, false if the client went away first
+static bool server_wait(server_request & req, int fd, bool text = false) {
+    std::unique_lock<std::mutex> lock(req.mutex);
+    while (!req.cv.wait_for(lock, std::chrono::milliseconds(100), [&]() { return req.done || (text && !req.text.empty()); })) {
+        if (!http_connected(fd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the scheduler stops the requests before their next step
+static void server_cancel(const std::vector<std::shared_ptr<server_request>> & reqs) {
+    for (const auto & req : reqs) {
+        req->cancelled = true;
+    }
+}
+
+static std::string server_usage(int n_prompt, int n_generated) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "{\"prompt_tokens\": %d, \"completion_tokens\": %d, \"total_tokens\": %d}", n_prompt, n_generated, n_prompt + n_generated);
+    return buf;
+}
+
+// the compiled regex, the one of an earlier request if it had the same - nullptr with the reason in error if not valid
+static std::shared_ptr<bloom_grammar> server_grammar(server_context & sc, const std::string & regex, std::string & error) {
+    static const size_t max_grammars = 64;
+
+    std::lock_guard<std::mutex> lock(sc.grammar_mutex);
+
+    const auto it = sc.grammars.find(regex);
+    if (it != sc.grammars.end()) {
+        return it->second;
+    }
+
+    if (sc.trie.ids.empty()) {
+        bloom_token_trie_init(sc.trie, sc.vocab);
+    }
+
+    std::shared_ptr<bloom_grammar> grammar = std::make_shared<bloom_grammar>();
+    if (!bloom_grammar_init(*grammar, regex, sc.trie, sc.params.eos_ids, error)) {
+        error = "invalid regex: " + error;
+        return nullptr;
+    }
+
+    // the requests keep theirs
+    if (sc.grammars.size() >= max_grammars) {
+        sc.grammars.clear();
+    }
+    sc.grammars[regex] = grammar;
+
+    return grammar;
+}
+
+static void server_completions(server_context & sc, int fd, const json_value & body) {
+    const json_value * prompt = body.get("prompt");
+    if (!prompt) {
+        http_reply_error(fd, 400, "missing prompt");
+        return;
+    }
+
+    std::vector<std::vector<gpt_vocab::id>> prompts;
+    std::string error;
+    if (!server_prompts(sc, *prompt, prompts, error)) {
+        http_reply_error(fd, 400, error);
+        return;
+    }
+
+    const bool stream = json_bool(body, "stream", false);
+    const bool echo   = json_bool(body, "echo",   false);
+
+    if (json_number(body, "n", 1) != 1) {
+        http_reply_error(fd, 400, "only n = 1 is supported");
+        return;
+    }
+    if (stream && prompts.size() > 1) {
+        http_reply_error(fd, 400, "streaming supports a single prompt");
+        return;
+    }
+
+    // a string or an array of strings
+    std::vector<std::string> stop;
+    if (const json_value * v = body.get("stop")) {
+        if (v->type == json_value::JSON_STRING) {
+            stop.push_back(v->str);
+        } else if (v->type == json_value::JSON_ARRAY) {
+            for (const auto & item : v->arr) {
+                if (item.type != json_value::JSON_STRING) {
+                    http_reply_error(fd, 400, "stop must be a string or an array of strings");
+                    return;
+                }
+                stop.push_back(item.str);
+            }
+        } else if (v->type != json_value::JSON_NULL) {
+            http_reply_error(fd, 400, "stop must be a string or an array of strings");
+            return;
+        }
+    }
+
+    // a regular expression the text matches, see bloom_grammar
+    std::shared_ptr<bloom_grammar> grammar;
+    if (const json_value * v = body.get("regex")) {
+        if (v->type == json_value::JSON_STRING && !v->str.empty()) {
+            grammar = server_grammar(sc, v->str, error);
+            if (!grammar) {
+                http_reply_error(fd, 400, error);
+                return;
+            }
+        } else if (v->type != json_value::JSON_STRING && v->type != json_value::JSON_NULL) {
+            http_reply_error(fd, 400, "regex must be a string");
+            return;
+        }
+    }
+
+    std::vector<std::shared_ptr<server_request>> reqs;
+    for (const auto & tokens : prompts) {
+        std::shared_ptr<server_request> req = std::make_shared<server_request>();
+
+        req->prompt         = tokens;
+        req->n_predict      = json_number(body, "max_tokens",     req->n_predict);
+        req->temp           = json_number(body, "temperature",    req->temp);
+        req->top_p          = json_number(body, "top_p",          req->top_p);
+        req->top_k          = json_number(body, "top_k",          req->top_k);
+        req->repeat_penalty = json_number(body, "repeat_penalty", req->repeat_penalty);
+        req->repeat_last_n  = json_number(body, "repeat_last_n",  req->repeat_last_n);
+        req->seed           = json_number(body, "seed",           req->seed);
+        req->deadline_ms    = json_number(body, "deadline_ms",    sc.params.timeout_ms);
+        req->stop           = stop;
+        req->grammar        = grammar;
+
+        req->n_predict = std::max(0, std::min(req->n_predict, sc.model.hparams.n_ctx - (int) tokens.size()));
+        req->repeat_last_n = std::max(1, req->repeat_last_n);
+
+        reqs.push_back(req);
+    }
+
+    for (const auto & req : reqs) {
+        server_submit(sc, req);
+    }
+
+    char id[64];
+    snprintf(id, sizeof(id), "cmpl-%" PRId64, sc.next_id++);
+
+    // fields of every response and chunk
+    const std::string head = std::string("{\"id\": \"") + id + "\", \"object\": \"text_completion\", \"created\": " +
+        std::to_string((int64_t) time(NULL)) + ", \"model\": " + json_string(sc.model_name);
+
+    auto prompt_text = [&](const std::vector<gpt_vocab::id> & tokens) {
+        std::string text;
+        for (auto t : tokens) {
+            text += sc.vocab.id_to_token.at(t);
+        }
+        return text;
+    };
+
+    if (!stream) {
+        std::string choices;
+        int n_prompt    = 0;
+        int n_generated = 0;
+
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            server_request & req = *reqs[i];
+            if (!server_wait(req, fd)) {
+                server_cancel(reqs);
+                return;
+            }
+
+            if (!req.error.empty()) {
+                server_cancel(reqs);
+                http_reply(fd, 500, "application/json", "{\"error\": {\"message\": " + json_string(req.error) + ", \"type\": \"server_error\"}}\n");
+                return;
+            }
+
+            choices += i > 0 ? ", " : "";
+            choices += "{\"text\": " + json_string((echo ? prompt_text(req.prompt) : "") + req.text) + ", \"index\": " + std::to_string(i) +
+                ", \"logprobs\": null, \"finish_reason\": \"" + req.finish_reason + "\"}";
+
+            n_prompt    += req.prompt.size();
+            n_generated += req.n_generated;
+        }
+
+        http_reply(fd, 200, "application/json", head + ", \"choices\": [" + choices + "], \"usage\": " + server_usage(n_prompt, n_generated) + "}\n");
+        return;
+    }
+
+    // server-sent events, one per batch of new text
+    if (!http_write(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n")) {
+        return;
+    }
+
+    server_request & req = *reqs[0];
+
+    auto chunk = [&](const std::string & text, const char * finish_reason) {
+        std::string event = "data: " + head + ", \"choices\": [{\"text\": " + json_string(text) + ", \"index\": 0, \"logprobs\": null, \"finish_reason\": ";
+        event += finish_reason ? std::string("\"") + finish_reason + "\"" : "null";
+        event += "}]";
+        if (finish_reason) {
+            event += ", \"usage\": " + server_usage(req.prompt.size(), req.n_generated);
+        }
+        event += "}\n\n";
+
+        return http_write(fd, event);
+    };
+
+    bool connected = !echo || chunk(prompt_text(req.prompt), nullptr);
+
+    while (connected) {
+        if (!server_wait(req, fd, true)) {
+            connected = false;
+            break;
+        }
+
+        std::string text;
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(req.mutex);
+            text.swap(req.text);
+            done = req.done;
+        }
+
+        if (done) {
+            if (req.error.empty()) {
+                chunk(text, req.finish_reason);
+            } else {
+                http_write(fd, "data: {\"error\": {\"message\": " + json_string(req.error) + ", \"type\": \"server_error\"}}\n\n");
+            }
+            http_write(fd, "data: [DONE]\n\n");
+            break;
+        }
+
+        connected = chunk(text, nullptr);
+    }
+
+    // the client went away, free the slot
+    if (!connected) {
+        server_cancel(reqs);
+    }
+}
+
+static void server_embeddings(server_context & sc, int fd, const json_value & body) {
+    const json_value * input = body.get("input");
+    if (!input) {
+        http_reply_error(fd, 400, "missing input");
+        return;
+    }
+
+    std::vector<std::vector<gpt_vocab::id>> prompts;
+    std::string error;
+    if (!server_prompts(sc, *input, prompts, error)) {
+        http_reply_error(fd, 400, error);
+        return;
+    }
+
+    std::vector<std::shared_ptr<server_request>> reqs;
+    for (const auto & tokens : prompts) {
+        std::shared_ptr<server_request> req = std::make_shared<server_request>();
+        req->embed       = true;
+        req->prompt      = tokens;
+        req->n_predict   = 0;
+        req->deadline_ms = json_number(body, "deadline_ms", sc.params.timeout_ms);
+        reqs.push_back(req);
+
+        server_submit(sc, req);
+    }
+
+    std::string data;
+    int n_prompt = 0;
+    char buf[32];
+
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        server_request & req = *reqs[i];
+        if (!server_wait(req, fd)) {
+            server_cancel(reqs);
+            return;
+        }
+
+        if (!req.error.empty()) {
+            server_cancel(reqs);
+            http_reply(fd, 500, "application/json", "{\"error\": {\"message\": " + json_string(req.error) + ", \"type\": \"server_error\"}}\n");
+            return;
+        }
+        if (req.embedding.empty()) {
+            server_cancel(reqs);
+            http_reply(fd, 504, "application/json", "{\"error\": {\"message\": \"the deadline passed\", \"type\": \"timeout_error\"}}\n");
+            return;
+        }
+
+        // unit length, as the OpenAI embeddings
+        double norm = 0.0;
+        for (float x : req.embedding) {
+            norm += (double) x*x;
+        }
+        norm = norm > 0.0 ? 1.0/sqrt(norm) : 0.0;
+
+        data += i > 0 ? ", " : "";
+        data += "{\"object\": \"embedding\", \"index\": " + std::to_string(i) + ", \"embedding\": [";
+        for (size_t k = 0; k < req.embedding.size(); ++k) {
+            snprintf(buf, sizeof(buf), "%s%.7g", k > 0 ? ", " : "", req.embedding[k]*norm);
+            data += buf;
+        }
+        data += "]}";
+
+        n_prompt += req.prompt.size();
+    }
+
+    http_reply(fd, 200, "application/json", "{\"object\": \"list\", \"data\": [" + data + "], \"model\": " + json_string(sc.model_name) +
+            ", \"usage\": {\"prompt_tokens\": " + std::to_string(n_prompt) + ", \"total_tokens\": " + std::to_string(n_prompt) + "}}\n");
+}
+
+static void server_connection(server_context & sc, int fd) {
+    http_request req;
+
+    const int status = http_read_request(fd, req);
+    if (status != 0) {
+        if (status > 0) {
+            http_reply_error(fd, status, http_status_text(status));
+        }
+        close(fd);
+        return;
+    }
+
+    if (req.path == "/v1/completions" || req.path == "/v1/embeddings") {
+        json_value body;
+        if (req.method != "POST") {
+            http_reply_error(fd, 405, "use POST");
+        } else if (!json_parse(req.body, body) || body.type != json_value::JSON_OBJECT) {
+            http_reply_error(fd, 400, "the body is not a JSON object");
+        } else if (req.path == "/v1/completions") {
+            server_completions(sc, fd, body);
+        } else {
+            server_embeddings(sc, fd, body);
+        }
+    } else if (req.path == "/v1/models") {
+        http_reply(fd, 200, "application/json",
+                "{\"object\": \"list\", \"data\": [{\"id\": " + json_string(sc.model_name) + ", \"object\": \"model\", \"owned_by\": \"bloomz.cpp\"}]}\n");
+    } else if (req.path == "/health") {
+        http_reply(fd, 200, "application/json", "{\"status\": \"ok\"}\n");
+    } else if (req.path == "/metrics") {
+        bloom_metrics_summary summary;
+        {
+            std::lock_guard<std::mutex> lock(sc.summary_mutex);
+            summary = sc.summary;
+        }
+        http_reply(fd, 200, "text/plain; version=0.0.4", bloom_metrics_prometheus(sc.model, summary));
+    } else {
+        http_reply_error(fd, 404, "not found");
+    }
+
+    close(fd);
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    server_context sc;
+    if (!server_params_parse(argc, argv, sc.params)) {
+        return 1;
+    }
+
+    const server_params & params = sc.params;
+
+    // a client that disconnects must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!bloom_model_load(params.model, sc.model, sc.vocab, params.n_ctx, params.n_parallel)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    sc.model_name = params.model.substr(params.model.find_last_of('/') + 1);
+
+    sc.model.cpus        = params.cpus;
+    sc.model.cpus_decode = params.cpus_decode;
+
+    // determine the required inference memory per token
+    {
+        std::vector<float> logits;
+        std::vector<float> embeddings;
+        bloom_eval(sc.model, params.n_threads, 0, { 0, 1, 2, 3 }, logits, embeddings, sc.mem_per_token);
+    }
+
+    if (params.n_threads_decode < 0) {
+        bloom_tune_threads_decode(sc.model, params.n_threads, sc.mem_per_token);
+    } else {
+        sc.model.n_threads_decode = params.n_threads_decode;
+    }
+
+    sc.model.counters = &sc.counters;
+
+    sc.slots.resize(params.n_parallel);
+    for (int is = 0; is < params.n_parallel; ++is) {
+        sc.slots[is].seq = is;
+        sc.slots[is].tokens.reserve(sc.model.hparams.n_ctx);
+        sc.slots[is].decode_ms.reserve(sc.model.hparams.n_ctx);
+    }
+
+    // listen
+    int fd = -1;
+    {
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+
+        addrinfo * res = nullptr;
+        if (getaddrinfo(params.host.c_str(), std::to_string(params.port).c_str(), &hints, &res) != 0) {
+            fprintf(stderr, "%s: failed to resolve '%s'\n", __func__, params.host.c_str());
+            return 1;
+        }
+
+        for (addrinfo * ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            const int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+                break;
+            }
+
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            fprintf(stderr, "%s: failed to listen on %s:%d\n", __func__, params.host.c_str(), params.port);
+            return 1;
+        }
+    }
+
+    std::thread scheduler(server_loop, std::ref(sc));
+
+    fprintf(stderr, "%s: listening on http://%s:%d with %d slots of %d tokens\n", __func__, params.host.c_str(), params.port, params.n_parallel, params.n_ctx);
+
+    while (true) {
+        const int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) {
+            continue;
+        }
+
+        std::thread(server_connection, std::ref(sc), conn).detach();
+    }
+
+    return 0;
+}
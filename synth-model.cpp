@@ -0,0 +1,398 @@
+// Writes a BLOOM model file with random weights, for benchmarking without a converted checkpoint
+//
+// usage:
+//
+//   ./synth-model models/synth-7b1-q4_0.bin --preset 7b1 --type q4_0
+//   ./synth-model models/synth.bin --n_vocab 32000 --n_embd 2048 --n_head 16 --n_layer 4 --type f16
+//
+// The file has the same layout as the output of convert-hf-to-ggml.py and quantize, so it can be used with main,
+// bench and quantize. The vocab has the special tokens of BLOOM at ids 0-3, one token per byte at ids 4-259 so
+// that any text can be tokenized, and made up words for the rest. The weights are drawn from a uniform distribution
+// with the standard deviation of the BLOOM initialization, the norms are the identity.
+//
+// The tensors are generated and written in chunks of rows, so the memory use does not depend on the model size.
+//
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct synth_hparams {
+    int32_t n_vocab = 250880;
+    int32_t n_embd  = 1024;
+    int32_t n_mult  = 1;
+    int32_t n_head  = 16;
+    int32_t n_layer = 2;
+    int32_t f16     = 2;
+};
+
+struct synth_preset {
+    const char * name;
+    int32_t n_embd;
+    int32_t n_head;
+    int32_t n_layer;
+};
+
+// the released BLOOM models, all of them have a vocab of 250880 tokens
+static const synth_preset k_presets[] = {
+    { "560m",  1024,  16, 24 },
+    { "1b1",   1536,  16, 24 },
+    { "1b7",   2048,  16, 24 },
+    { "3b",    2560,  32, 30 },
+    { "7b1",   4096,  32, 30 },
+    { "176b", 14336, 112, 70 },
+};
+
+static const char * k_special_tokens[] = { "<unk>", "<s>", "</s>", "<pad>" };
+
+// xorshift, fast enough to fill the 176b model in minutes
+struct synth_rng {
+    uint64_t s;
+
+    explicit synth_rng(uint64_t seed) : s(seed*0x9e3779b97f4a7c15ull + 1) {}
+
+    // uniform in [-1, 1)
+    float next() {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return (s >> 40)*(2.0f/16777216.0f) - 1.0f;
+    }
+};
+
+static bool write_tensor(std::ofstream & fout, const std::string & name, int32_t n_dims, const int32_t ne[2],
+        ggml_type type, synth_rng & rng, float scale, float value, size_t & total_size) {
+    const int32_t length = name.size();
+    const int32_t ftype  = type == GGML_TYPE_F32 ? 0 : type == GGML_TYPE_F16 ? 1 : type == GGML_TYPE_Q4_0 ? 2 : 3;
+
+    fout.write(reinterpret_cast<const char *>(&n_dims), sizeof(n_dims));
+    fout.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    fout.write(reinterpret_cast<const char *>(&ftype),  sizeof(ftype));
+    for (int i = 0; i < n_dims; ++i) {
+        fout.write(reinterpret_cast<const char *>(&ne[i]), sizeof(ne[i]));
+    }
+    fout.write(name.data(), length);
+
+    const int64_t n_cols = ne[0];
+    const int64_t n_rows = n_dims == 1 ? 1 : ne[1];
+
+    // about 16M elements per chunk
+    const int64_t n_chunk = std::max<int64_t>(1, (16*1024*1024)/n_cols);
+
+    std::vector<float>   data_f32;
+    std::vector<uint8_t> data_out;
+
+    std::vector<int64_t> hist(1 << 4, 0);
+
+    for (int64_t i1 = 0; i1 < n_rows; i1 += n_chunk) {
+        const int64_t n = std::min(n_chunk, n_rows - i1)*n_cols;
+
+        data_f32.resize(n);
+        for (int64_t i = 0; i < n; ++i) {
+            data_f32[i] = scale != 0.0f ? scale*rng.next() : value;
+        }
+
+        size_t cur_size = 0;
+
+        switch (type) {
+            case GGML_TYPE_F32:
+                {
+                    cur_size = n*sizeof(float);
+                    data_out.resize(cur_size);
+                    memcpy(data_out.data(), data_f32.data(), cur_size);
+                } break;
+            case GGML_TYPE_F16:
+                {
+                    cur_size = n*sizeof(ggml_fp16_t);
+                    data_out.resize(cur_size);
+                    ggml_fp32_to_fp16_row(data_f32.data(), (ggml_fp16_t *) data_out.data(), n);
+                } break;
+            case GGML_TYPE_Q4_0:
+                {
+                    data_out.resize(n*sizeof(float));
+                    cur_size = ggml_quantize_q4_0(data_f32.data(), data_out.data(), n, n_cols, hist.data());
+                } break;
+            case GGML_TYPE_Q4_1:
+                {
+                    data_out.resize(n*sizeof(float));
+                    cur_size = ggml_quantize_q4_1(data_f32.data(), data_out.data(), n, n_cols, hist.data());
+                } break;
+            default:
+                {
+                    fprintf(stderr, "%s: unsupported type %d\n", __func__, type);
+                    return false;
+                }
+        }
+
+        fout.write(reinterpret_cast<const char *>(data_out.data()), cur_size);
+        total_size += cur_size;
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write tensor '%s'\n", __func__, name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// write a model file with random weights
+bool bloom_model_synth(const std::string & fname_out, const synth_hparams & hparams, int seed) {
+    ggml_type wtype = GGML_TYPE_COUNT;
+
+    switch (hparams.f16) {
+        case 0: wtype = GGML_TYPE_F32;  break;
+        case 1: wtype = GGML_TYPE_F16;  break;
+        case 2: wtype = GGML_TYPE_Q4_0; break;
+        case 3: wtype = GGML_TYPE_Q4_1; break;
+        default: fprintf(stderr, "%s: invalid type %d\n", __func__, hparams.f16); return false;
+    };
+
+    const int32_t n_vocab = hparams.n_vocab;
+    const int32_t n_embd  = hparams.n_embd;
+    const int32_t n_layer = hparams.n_layer;
+    const int32_t n_ff    = ((4*n_embd + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+
+    const int32_t n_special = sizeof(k_special_tokens)/sizeof(k_special_tokens[0]);
+
+    if (n_vocab < n_special + 256) {
+        fprintf(stderr, "%s: n_vocab must be at least %d\n", __func__, n_special + 256);
+        return false;
+    }
+
+    // the loader asserts this for the quantized types, it also covers the q4 block sizes of all builds
+    if (n_embd % 64 != 0 || hparams.n_head <= 0 || n_embd % hparams.n_head != 0) {
+        fprintf(stderr, "%s: n_embd must be a multiple of 64 and of n_head\n", __func__);
+        return false;
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    // magic and hparams
+    {
+        const uint32_t magic = 0x67676d6c;
+
+        fout.write((const char *) &magic,           sizeof(magic));
+        fout.write((const char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        fout.write((const char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        fout.write((const char *) &hparams.n_mult,  sizeof(hparams.n_mult));
+        fout.write((const char *) &hparams.n_head,  sizeof(hparams.n_head));
+        fout.write((const char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        fout.write((const char *) &hparams.f16,     sizeof(hparams.f16));
+
+        printf("%s: n_vocab = %d\n", __func__, hparams.n_vocab);
+        printf("%s: n_embd  = %d\n", __func__, hparams.n_embd);
+        printf("%s: n_mult  = %d\n", __func__, hparams.n_mult);
+        printf("%s: n_head  = %d\n", __func__, hparams.n_head);
+        printf("%s: n_layer = %d\n", __func__, hparams.n_layer);
+        printf("%s: f16     = %d\n", __func__, hparams.f16);
+        printf("%s: n_ff    = %d\n", __func__, n_ff);
+    }
+
+    // vocab
+    {
+        std::string word;
+        for (int i = 0; i < n_vocab; i++) {
+            if (i < n_special) {
+                word = k_special_tokens[i];
+            } else if (i < n_special + 256) {
+                word = std::string(1, (char) (i - n_special));
+            } else {
+                // at least two letters, so that the words do not collide with the byte tokens
+                int j = (i - n_special - 256)/2 + 26;
+
+                word = (i - n_special) % 2 ? " " : "";
+                std::string letters;
+                while (j > 0) {
+                    letters += (char) ('a' + j%26);
+                    j /= 26;
+                }
+                word += letters;
+            }
+
+            const uint32_t len = word.size();
+            fout.write((const char *) &len, sizeof(len));
+            fout.write(word.data(), len);
+        }
+    }
+
+    synth_rng rng(seed);
+
+    // uniform in [-a, a] has a standard deviation of a/sqrt(3), BLOOM is initialized with 0.02
+    const float scale = 0.02f*sqrtf(3.0f);
+
+    size_t total_size = 0;
+    int    n_tensors  = 0;
+
+    auto write_1d = [&](const std::string & name, int32_t n, float value) {
+        const int32_t ne[2] = { n, 1 };
+        n_tensors++;
+        return write_tensor(fout, name, 1, ne, GGML_TYPE_F32, rng, 0.0f, value, total_size);
+    };
+
+    auto write_2d = [&](const std::string & name, int32_t ne0, int32_t ne1) {
+        const int32_t ne[2] = { ne0, ne1 };
+        n_tensors++;
+        return write_tensor(fout, name, 2, ne, wtype, rng, scale, 0.0f, total_size);
+    };
+
+    bool ok = true;
+
+    ok = ok && write_2d("tok_embeddings.weight", n_embd, n_vocab);
+    ok = ok && write_1d("norm.weight", n_embd, 1.0f);
+    ok = ok && write_1d("norm.bias",   n_embd, 0.0f);
+
+    for (int il = 0; il < n_layer && ok; ++il) {
+        const std::string prefix = "layers." + std::to_string(il) + ".";
+
+        ok = ok && write_1d(prefix + "attention_norm.weight", n_embd, 1.0f);
+        ok = ok && write_1d(prefix + "attention_norm.bias",   n_embd, 0.0f);
+
+        ok = ok && write_2d(prefix + "attention.query_key_value.weight", n_embd, 3*n_embd);
+        ok = ok && write_1d(prefix + "attention.query_key_value.bias",   3*n_embd, 0.0f);
+        ok = ok && write_2d(prefix + "attention.wo.weight", n_embd, n_embd);
+        ok = ok && write_1d(prefix + "attention.wo.bias",   n_embd, 0.0f);
+
+        ok = ok && write_1d(prefix + "ffn_norm.weight", n_embd, 1.0f);
+        ok = ok && write_1d(prefix + "ffn_norm.bias",   n_embd, 0.0f);
+
+        ok = ok && write_2d(prefix + "feed_forward.w1.weight", n_embd, n_ff);
+        ok = ok && write_1d(prefix + "feed_forward.w1.bias",   n_ff, 0.0f);
+        ok = ok && write_2d(prefix + "feed_forward.w2.weight", n_ff, n_embd);
+        ok = ok && write_1d(prefix + "feed_forward.w2.bias",   n_embd, 0.0f);
+
+        printf("%s: layer %d/%d written, %8.2f MB\n", __func__, il + 1, n_layer, total_size/1024.0/1024.0);
+        fflush(stdout);
+    }
+
+    ok = ok && write_1d("output_norm.weight", n_embd, 1.0f);
+    ok = ok && write_1d("output_norm.bias",   n_embd, 0.0f);
+    ok = ok && write_2d("output.weight", n_embd, n_vocab);
+
+    if (!ok) {
+        return false;
+    }
+
+    printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+
+    fout.close();
+
+    return true;
+}
+
+static void print_usage(const char * argv0, const synth_hparams & hparams) {
+    fprintf(stderr, "usage: %s model-out.bin [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  --preset NAME         hparams of a BLOOM model: 560m, 1b1, 1b7, 3b, 7b1 or 176b\n");
+    fprintf(stderr, "  --n_vocab N           vocab size (default: %d)\n", hparams.n_vocab);
+    fprintf(stderr, "  --n_embd N            embedding size (default: %d)\n", hparams.n_embd);
+    fprintf(stderr, "  --n_head N            number of heads (default: %d)\n", hparams.n_head);
+    fprintf(stderr, "  --n_layer N           number of layers (default: %d)\n", hparams.n_layer);
+    fprintf(stderr, "  --type T              type of the weights: f32, f16, q4_0 or q4_1 (default: q4_0)\n");
+    fprintf(stderr, "  -s SEED, --seed SEED  RNG seed (default: 1234)\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    synth_hparams hparams;
+
+    int seed = 1234;
+
+    if (argc < 2 || argv[1][0] == '-') {
+        print_usage(argv[0], hparams);
+        return 1;
+    }
+
+    const std::string fname_out = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0], hparams);
+            return 0;
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return 1;
+        }
+
+        if (arg == "--preset") {
+            const std::string name = argv[++i];
+
+            const synth_preset * preset = nullptr;
+            for (const auto & p : k_presets) {
+                if (name == p.name) {
+                    preset = &p;
+                }
+            }
+
+            if (!preset) {
+                fprintf(stderr, "error: unknown preset: %s\n", name.c_str());
+                return 1;
+            }
+
+            hparams.n_vocab = 250880;
+            hparams.n_embd  = preset->n_embd;
+            hparams.n_head  = preset->n_head;
+            hparams.n_layer = preset->n_layer;
+        } else if (arg == "--n_vocab") {
+            hparams.n_vocab = std::stoi(argv[++i]);
+        } else if (arg == "--n_embd") {
+            hparams.n_embd = std::stoi(argv[++i]);
+        } else if (arg == "--n_head") {
+            hparams.n_head = std::stoi(argv[++i]);
+        } else if (arg == "--n_layer") {
+            hparams.n_layer = std::stoi(argv[++i]);
+        } else if (arg == "--type") {
+            const std::string type = argv[++i];
+            if      (type == "f32")  { hparams.f16 = 0; }
+            else if (type == "f16")  { hparams.f16 = 1; }
+            else if (type == "q4_0") { hparams.f16 = 2; }
+            else if (type == "q4_1") { hparams.f16 = 3; }
+            else {
+                fprintf(stderr, "error: unknown type: %s\n", type.c_str());
+                return 1;
+            }
+        } else if (arg == "-s" || arg == "--seed") {
+            seed = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0], hparams);
+            return 1;
+        }
+    }
+
+    // needed to initialize f16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false, 0 };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!bloom_model_synth(fname_out, hparams, seed)) {
+        fprintf(stderr, "%s: failed to write model to '%s'\n", __func__, fname_out.c_str());
+        return 1;
+    }
+
+    printf("%s: total time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+
+    return 0;
+}
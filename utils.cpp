@@ -1,8 +1,11 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstring>
 #include <fstream>
+#include <numeric>
 #include <regex>
 
  #if defined(_MSC_VER) || defined(__MINGW32__)
@@ -19,10 +22,31 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.seed = std::stoi(argv[++i]);
         } else if (arg == "-t" || arg == "--threads") {
             params.n_threads = std::stoi(argv[++i]);
+        } else if (arg == "-td" || arg == "--threads_decode") {
+            params.n_threads_decode = std::stoi(argv[++i]);
+        } else if (arg == "--cpus" || arg == "--cpus_decode") {
+            std::vector<int> & cpus = arg == "--cpus" ? params.cpus : params.cpus_decode;
+            if (!gpt_parse_cpus(argv[++i], cpus)) {
+                fprintf(stderr, "error: invalid CPU list for %s: %s\n", arg.c_str(), argv[i]);
+                return false;
+            }
         } else if (arg == "-p" || arg == "--prompt") {
             params.prompt = argv[++i];
         } else if (arg == "-n" || arg == "--n_predict") {
             params.n_predict = std::stoi(argv[++i]);
+        } else if (arg == "-c" || arg == "--ctx") {
+            params.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "-i" || arg == "--interactive") {
+            params.interactive = true;
+        } else if (arg == "-r" || arg == "--reverse-prompt") {
+            params.antiprompt.push_back(argv[++i]);
+        } else if (arg == "--eos") {
+            if (!gpt_parse_ids(argv[++i], params.eos_ids)) {
+                fprintf(stderr, "error: invalid token id list for %s: %s\n", arg.c_str(), argv[i]);
+                return false;
+            }
+        } else if (arg == "--regex") {
+            params.regex = argv[++i];
         } else if (arg == "--top_k") {
             params.top_k = std::stoi(argv[++i]);
         } else if (arg == "--top_p") {
@@ -37,6 +61,21 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.n_batch = std::stoi(argv[++i]);
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
+        } else if (arg == "--profile") {
+            params.profile = true;
+        } else if (arg == "--profile-json") {
+            params.profile = true;
+            params.profile_json = argv[++i];
+        } else if (arg == "--profile-hwc") {
+            params.profile = true;
+            params.profile_hwc = true;
+        } else if (arg == "--trace") {
+            params.trace = argv[++i];
+        } else if (arg == "--mem-report") {
+            params.mem_report = true;
+        } else if (arg == "--mem-report-json") {
+            params.mem_report = true;
+            params.mem_report_json = argv[++i];
         } else if (arg == "-h" || arg == "--help") {
             gpt_print_usage(argc, argv, params);
             exit(0);
@@ -50,6 +89,41 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     return true;
 }
 
+bool gpt_parse_cpus(const std::string & list, std::vector<int> & cpus) {
+    cpus.clear();
+
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string item = list.substr(pos, end - pos);
+
+        int first = 0;
+        int last  = 0;
+        char c;
+        if (sscanf(item.c_str(), "%d-%d%c", &first, &last, &c) != 2) {
+            if (sscanf(item.c_str(), "%d%c", &first, &c) != 1) {
+                return false;
+            }
+            last = first;
+        }
+        if (first < 0 || last < first) {
+            return false;
+        }
+
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+
+        pos = end + 1;
+    }
+
+    return !cpus.empty();
+}
+
 void gpt_print_usage(int argc, char ** argv, const gpt_params & params) {
     fprintf(stderr, "usage: %s [options]\n", argv[0]);
     fprintf(stderr, "\n");
@@ -57,20 +131,41 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  -h, --help            show this help message and exit\n");
     fprintf(stderr, "  -s SEED, --seed SEED  RNG seed (default: -1)\n");
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -td N, --threads_decode N\n");
+    fprintf(stderr, "                        threads of the single token evals, 0 for -t, -1 to calibrate (default: %d)\n", params.n_threads_decode);
+    fprintf(stderr, "  --cpus LIST           CPUs of the prompt eval threads, like 0-7,16 (default: thread i on CPU i)\n");
+    fprintf(stderr, "  --cpus_decode LIST    CPUs of the single token eval threads (default: thread i on CPU i)\n");
     fprintf(stderr, "  -p PROMPT, --prompt PROMPT\n");
     fprintf(stderr, "                        prompt to start generation with (default: random)\n");
-    fprintf(stderr, "  -n N, --n_predict N   number of tokens to predict (default: %d)\n", params.n_predict);
+    fprintf(stderr, "  -n N, --n_predict N   number of tokens to predict, per turn with -i (default: %d)\n", params.n_predict);
+    fprintf(stderr, "  -c N, --ctx N         context size in tokens, of the whole conversation with -i (default: %d)\n", params.n_ctx);
+    fprintf(stderr, "  -i, --interactive     read the next text from stdin when the model is done and go on, Ctrl+C interjects\n");
+    fprintf(stderr, "  -r PROMPT, --reverse-prompt PROMPT\n");
+    fprintf(stderr, "                        stop generating once the output contains PROMPT, give the turn back with -i\n");
+    fprintf(stderr, "  --eos LIST            end of text token ids, like 2,0 (default: 2)\n");
+    fprintf(stderr, "  --regex PATTERN       generate only text that matches PATTERN, the end of text is allowed once it does\n");
     fprintf(stderr, "  --top_k N             top-k sampling (default: %d)\n", params.top_k);
     fprintf(stderr, "  --top_p N             top-p sampling (default: %.1f)\n", params.top_p);
     fprintf(stderr, "  --repeat_last_n N     last n tokens to consider for penalize (default: %d)\n", params.repeat_last_n);
     fprintf(stderr, "  --repeat_penalty N    penalize repeat sequence of tokens (default: %.1f)\n", params.repeat_penalty);
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", params.temp);
-    fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing, 0 to tune it for the model and threads (default: %d)\n", params.n_batch);
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  --profile             print the time spent per op, layer and sub-block\n");
+    fprintf(stderr, "  --profile-json FNAME  profile and write the result as JSON to FNAME\n");
+    fprintf(stderr, "  --profile-hwc         profile with hardware counters too (cycles, instructions, cache and TLB misses)\n");
+    fprintf(stderr, "  --trace FNAME         write the per thread timeline of the graphs to FNAME (Chrome trace format)\n");
+    fprintf(stderr, "  --mem-report          print the memory used by the weights, kv cache, compute buffer, vocab and process\n");
+    fprintf(stderr, "  --mem-report-json FNAME\n");
+    fprintf(stderr, "                        write the memory report as JSON to FNAME\n");
     fprintf(stderr, "\n");
 }
 
+bool gpt_parse_ids(const std::string & list, std::vector<int> & ids) {
+    return gpt_parse_cpus(list, ids);
+}
+
 std::string gpt_random_prompt(std::mt19937 & rng) {
     const int r = rng() % 10;
     switch (r) {
@@ -400,16 +495,17 @@ gpt_vocab::id gpt_sample_top_k_top_p(
 gpt_vocab::id bloom_sample_top_p(
         const gpt_vocab & vocab,
         const float * logits,
-        std::vector<gpt_vocab::id> & last_n_tokens,
+        const std::vector<gpt_vocab::id> & last_n_tokens,
         double repeat_penalty,
         double top_p,
         int top_k,
         double temp,
-        std::mt19937 & rng) {
+        std::mt19937 & rng,
+        bloom_sampler_buf & buf,
+        const bloom_token_mask * mask) {
     int n_logits = vocab.id_to_token.size();
 
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    std::vector<std::pair<double, gpt_vocab::id>> & logits_id = buf.logits_id;
 
     // return max token (greedy search)
     // {
@@ -426,24 +522,82 @@ gpt_vocab::id bloom_sample_top_p(
     //     return max_idx;
     // }
 
-    {
+    if (mask) {
+        // only the allowed tokens are candidates, the penalty is applied as they are added
         const double scale = 1.0/temp;
-        std::vector<gpt_vocab::id> counter(n_logits, 0);
-        for (auto const & id : last_n_tokens) { counter[id] = 1; }
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from CTRL paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/bloom/compare/main...shawwn:bloom:main
-            if (counter[i] > 0) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (logits[i] < 0.0) {
-                    logits_id.push_back(std::make_pair(logits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(logits[i]*scale/repeat_penalty, i));
+
+        buf.seen.resize(n_logits, 0);
+        for (auto const & id : last_n_tokens) {
+            buf.seen[id] = 1;
+        }
+
+        logits_id.resize(mask->n_allowed);
+
+        int n = 0;
+        auto add = [&](gpt_vocab::id id) {
+            if (!buf.seen[id]) {
+                logits_id[n++] = std::make_pair(logits[id]*scale, id);
+            } else if (logits[id] < 0.0) {
+                logits_id[n++] = std::make_pair(logits[id]*scale*repeat_penalty, id);
+            } else {
+                logits_id[n++] = std::make_pair(logits[id]*scale/repeat_penalty, id);
+            }
+        };
+
+        if (!mask->ids.empty()) {
+            for (auto const & id : mask->ids) {
+                add(id);
+            }
+        } else {
+            for (int i = 0; i < (int) mask->bits.size(); ++i) {
+                const uint32_t w = mask->bits[i];
+                if (w == 0) {
+                    continue;
+                }
+                if (w == 0xffffffffu) {
+                    for (int j = 0; j < 32; ++j) {
+                        add(32*i + j);
+                    }
+                    continue;
+                }
+                for (int j = 0; j < 32; ++j) {
+                    if (w & (1u << j)) {
+                        add(32*i + j);
+                    }
                 }
+            }
+        }
+
+        for (auto const & id : last_n_tokens) {
+            buf.seen[id] = 0;
+        }
+    } else {
+        logits_id.resize(n_logits);
+
+        const double scale = 1.0/temp;
+        for (int i = 0; i < n_logits; ++i) {
+            logits_id[i] = std::make_pair(logits[i]*scale, i);
+        }
+
+        // repetition penalty from CTRL paper (https://arxiv.org/abs/1909.05858), once per token
+        // credit https://github.com/facebookresearch/bloom/compare/main...shawwn:bloom:main
+        buf.seen.resize(n_logits, 0);
+        for (auto const & id : last_n_tokens) {
+            if (buf.seen[id]) {
+                continue;
+            }
+            buf.seen[id] = 1;
+
+            // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+            if (logits[id] < 0.0) {
+                logits_id[id].first = logits[id]*scale*repeat_penalty;
             } else {
-                logits_id.push_back(std::make_pair(logits[i]*scale, i));
+                logits_id[id].first = logits[id]*scale/repeat_penalty;
             }
         }
+        for (auto const & id : last_n_tokens) {
+            buf.seen[id] = 0;
+        }
     }
 
     // here llama.cpp uses `std::partial_sort` to pick up the top k tokens,
@@ -454,7 +608,9 @@ gpt_vocab::id bloom_sample_top_p(
     //         [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
     //     return a.first > b.first;
     // });
-    top_k = top_k > 0 ? std::min(top_k, n_logits) : n_logits;
+    const int n_candidates = logits_id.size();
+
+    top_k = top_k > 0 ? std::min(top_k, n_candidates) : n_candidates;
     std::partial_sort(
         logits_id.begin(), logits_id.begin() + top_k, logits_id.end(),
         [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
@@ -476,8 +632,8 @@ gpt_vocab::id bloom_sample_top_p(
     }
 
     // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+    std::vector<double> & probs = buf.probs;
+    probs.clear();
 
     double sum = 0.0;
     for (const auto & kv : logits_id) {
@@ -515,12 +671,828 @@ gpt_vocab::id bloom_sample_top_p(
     //printf("\n\n");
     //exit(0);
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    // what std::discrete_distribution does, without its copy of the probs: the same draws for the same seed
+    if (probs.size() < 2) {
+        return logits_id[0].second;
+    }
+
+    const double sum_probs = std::accumulate(probs.begin(), probs.end(), 0.0);
+    for (auto & p : probs) {
+        p /= sum_probs;
+    }
+    std::partial_sum(probs.begin(), probs.end(), probs.begin());
+    probs.back() = 1.0;
+
+    const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    int idx = std::lower_bound(probs.begin(), probs.end(), u) - probs.begin();
 
     return logits_id[idx].second;
 }
 
+gpt_vocab::id bloom_sample_top_p(
+        const gpt_vocab & vocab,
+        const float * logits,
+        const std::vector<gpt_vocab::id> & last_n_tokens,
+        double repeat_penalty,
+        double top_p,
+        int top_k,
+        double temp,
+        std::mt19937 & rng) {
+    bloom_sampler_buf buf;
+
+    return bloom_sample_top_p(vocab, logits, last_n_tokens, repeat_penalty, top_p, top_k, temp, rng, buf);
+}
+
+
+void bloom_stop_matcher_init(bloom_stop_matcher & matcher, const std::vector<std::string> & stops) {
+    matcher.stops = stops;
+
+    // the trie of the stop strings, with -1 for the missing edges
+    std::vector<int32_t> & next  = matcher.next;
+    std::vector<int32_t> & depth = matcher.depth;
+    std::vector<int32_t> & match = matcher.match;
+
+    next.assign(256, -1);
+    depth.assign(1, 0);
+    match.assign(1, -1);
+
+    for (int i = 0; i < (int) stops.size(); ++i) {
+        const std::string & stop = stops[i];
+        if (stop.empty()) {
+            continue;
+        }
+
+        int s = 0;
+        for (unsigned char c : stop) {
+            if (next[256*s + c] < 0) {
+                next[256*s + c] = depth.size();
+                next.resize(next.size() + 256, -1);
+                depth.push_back(depth[s] + 1);
+                match.push_back(-1);
+            }
+            s = next[256*s + c];
+        }
+        if (match[s] < 0) {
+            match[s] = i;
+        }
+    }
+
+    // the missing edges go where the failure links lead, in breadth-first order so that the states of the failure
+    // links, which are shallower, are complete when they are used
+    std::vector<int32_t> fail(depth.size(), 0);
+    std::vector<int32_t> queue;
+    for (int c = 0; c < 256; ++c) {
+        if (next[c] < 0) {
+            next[c] = 0;
+        } else {
+            queue.push_back(next[c]);
+        }
+    }
+    for (size_t iq = 0; iq < queue.size(); ++iq) {
+        const int s = queue[iq];
+
+        // a stop string that ends at the failure state ends here too, the one of the state itself is longer
+        if (match[s] < 0) {
+            match[s] = match[fail[s]];
+        }
+
+        for (int c = 0; c < 256; ++c) {
+            const int t = next[256*s + c];
+            if (t < 0) {
+                next[256*s + c] = next[256*fail[s] + c];
+            } else {
+                fail[t] = next[256*fail[s] + c];
+                queue.push_back(t);
+            }
+        }
+    }
+
+    matcher.state = 0;
+}
+
+void bloom_stop_matcher_reset(bloom_stop_matcher & matcher) {
+    matcher.state = 0;
+}
+
+int bloom_stop_matcher_feed(bloom_stop_matcher & matcher, const char * text, size_t n, int & i_stop) {
+    if (matcher.next.empty()) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        matcher.state = matcher.next[256*matcher.state + (unsigned char) text[i]];
+        if (matcher.match[matcher.state] >= 0) {
+            i_stop = matcher.match[matcher.state];
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+int bloom_stop_matcher_held(const bloom_stop_matcher & matcher) {
+    return matcher.depth.empty() ? 0 : matcher.depth[matcher.state];
+}
+
+void bloom_token_trie_init(bloom_token_trie & trie, const gpt_vocab & vocab) {
+    trie.n_vocab = vocab.id_to_token.empty() ? 0 : vocab.id_to_token.rbegin()->first + 1;
+
+    // sorted, a token comes right after its prefixes and the tokens with a common prefix are together
+    std::vector<std::pair<std::string, gpt_vocab::id>> tokens;
+    tokens.reserve(vocab.id_to_token.size());
+    for (const auto & kv : vocab.id_to_token) {
+        if (!kv.second.empty()) {
+            tokens.emplace_back(kv.second, kv.first);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+
+    trie.byte.assign(1, 0);
+    trie.depth.assign(1, 0);
+    trie.end.assign(1, 0);
+    trie.ids_begin.assign(1, 0);
+    trie.ids.clear();
+
+    std::vector<int32_t> path(1, 0); // the nodes of the previous token, from the root
+    const std::string * prev = nullptr;
+
+    for (const auto & token : tokens) {
+        const std::string & str = token.first;
+
+        size_t n_common = 0;
+        while (prev && n_common < prev->size() && n_common < str.size() && (*prev)[n_common] == str[n_common]) {
+            ++n_common;
+        }
+
+        // the subtrees past the common prefix are complete
+        while (path.size() > n_common + 1) {
+            trie.end[path.back()] = trie.byte.size();
+            path.pop_back();
+        }
+
+        for (size_t i = n_common; i < str.size(); ++i) {
+            path.push_back(trie.byte.size());
+            trie.byte.push_back(str[i]);
+            trie.depth.push_back(i + 1);
+            trie.end.push_back(0);
+            trie.ids_begin.push_back(trie.ids.size());
+        }
+        trie.ids.push_back(token.second);
+
+        prev = &str;
+    }
+
+    while (!path.empty()) {
+        trie.end[path.back()] = trie.byte.size();
+        path.pop_back();
+    }
+    trie.ids_begin.push_back(trie.ids.size());
+}
+
+// the bytes of an NFA edge or of a class
+typedef std::array<uint64_t, 4> regex_set;
+
+static void regex_set_add(regex_set & set, int c) {
+    set[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+static bool regex_set_has(const regex_set & set, int c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static regex_set regex_set_not(const regex_set & set) {
+    return {{ ~set[0], ~set[1], ~set[2], ~set[3] }};
+}
+
+// the byte of a set of one byte, -1 otherwise
+static int regex_set_single(const regex_set & set) {
+    int c = -1;
+    for (int i = 0; i < 256; ++i) {
+        if (regex_set_has(set, i)) {
+            if (c >= 0) {
+                return -1;
+            }
+            c = i;
+        }
+    }
+    return c;
+}
+
+// a Thompson NFA, built by a recursive descent over the pattern
+//
+// A state has an edge to out on the bytes of set, or none if out is -1, and epsilon edges. A fragment of the NFA goes
+// from its start to its end state, which has no edges yet. The copies of an atom for {n,m} are parsed again.
+struct regex_parser {
+    static const int max_states = 1 << 16;
+    static const int max_repeat = 1000;
+
+    const std::string & p;
+    size_t i = 0;
+
+    std::vector<regex_set>            set;
+    std::vector<int32_t>              out;
+    std::vector<std::vector<int32_t>> eps;
+
+    std::string err;
+
+    struct frag {
+        int32_t start;
+        int32_t end;
+    };
+
+    regex_parser(const std::string & p) : p(p) {}
+
+    bool fail(const std::string & msg) {
+        if (err.empty()) {
+            err = msg + " at offset " + std::to_string(i);
+        }
+        return false;
+    }
+
+    int32_t state() {
+        if ((int) out.size() >= max_states) {
+            fail("the pattern is too large");
+        }
+        set.push_back({{ 0, 0, 0, 0 }});
+        out.push_back(-1);
+        eps.emplace_back();
+        return out.size() - 1;
+    }
+
+    frag edge(const regex_set & bytes) {
+        const int32_t s = state();
+        const int32_t e = state();
+        set[s] = bytes;
+        out[s] = e;
+        return { s, e };
+    }
+
+    frag empty() {
+        const int32_t s = state();
+        return { s, s };
+    }
+
+    frag concat(frag a, frag b) {
+        eps[a.end].push_back(b.start);
+        return { a.start, b.end };
+    }
+
+    frag alt(frag a, frag b) {
+        const int32_t s = state();
+        const int32_t e = state();
+        eps[s].push_back(a.start);
+        eps[s].push_back(b.start);
+        eps[a.end].push_back(e);
+        eps[b.end].push_back(e);
+        return { s, e };
+    }
+
+    frag star(frag a) {
+        const int32_t s = state();
+        const int32_t e = state();
+        eps[s].push_back(a.start);
+        eps[s].push_back(e);
+        eps[a.end].push_back(a.start);
+        eps[a.end].push_back(e);
+        return { s, e };
+    }
+
+    frag plus(frag a) {
+        const int32_t e = state();
+        eps[a.end].push_back(a.start);
+        eps[a.end].push_back(e);
+        return { a.start, e };
+    }
+
+    frag opt(frag a) {
+        const int32_t s = state();
+        const int32_t e = state();
+        eps[s].push_back(a.start);
+        eps[s].push_back(e);
+        eps[a.end].push_back(e);
+        return { s, e };
+    }
+
+    // after the backslash
+    regex_set escape() {
+        regex_set bytes = {{ 0, 0, 0, 0 }};
+        if (i >= p.size()) {
+            fail("trailing \\");
+            return bytes;
+        }
+
+        const char c = p[i++];
+        switch (c) {
+            case 'd': case 'D':
+                for (int b = '0'; b <= '9'; ++b) regex_set_add(bytes, b);
+                break;
+            case 'w': case 'W':
+                for (int b = '0'; b <= '9'; ++b) regex_set_add(bytes, b);
+                for (int b = 'a'; b <= 'z'; ++b) regex_set_add(bytes, b);
+                for (int b = 'A'; b <= 'Z'; ++b) regex_set_add(bytes, b);
+                regex_set_add(bytes, '_');
+                break;
+            case 's': case 'S':
+                for (const char * b = " \t\n\r\f\v"; *b; ++b) regex_set_add(bytes, *b);
+                break;
+            case 'n': regex_set_add(bytes, '\n'); break;
+            case 't': regex_set_add(bytes, '\t'); break;
+            case 'r': regex_set_add(bytes, '\r'); break;
+            case 'f': regex_set_add(bytes, '\f'); break;
+            case 'v': regex_set_add(bytes, '\v'); break;
+            case '0': regex_set_add(bytes, '\0'); break;
+            case 'x':
+                {
+                    int b = 0;
+                    if (i + 2 > p.size() || !isxdigit((unsigned char) p[i]) || !isxdigit((unsigned char) p[i + 1]) ||
+                        sscanf(p.substr(i, 2).c_str(), "%x", &b) != 1) {
+                        fail("invalid \\x escape");
+                        break;
+                    }
+                    i += 2;
+                    regex_set_add(bytes, b);
+                } break;
+            default:
+                if (isalnum((unsigned char) c)) {
+                    fail(std::string("unsupported escape \\") + c);
+                    break;
+                }
+                regex_set_add(bytes, (unsigned char) c);
+        }
+
+        if (c == 'D' || c == 'W' || c == 'S') {
+            bytes = regex_set_not(bytes);
+        }
+
+        return bytes;
+    }
+
+    // a byte of a class, or the set of an escape with first = -1
+    int class_item(regex_set & bytes) {
+        if (p[i] != '\\') {
+            return (unsigned char) p[i++];
+        }
+        ++i;
+        bytes = escape();
+        return regex_set_single(bytes);
+    }
+
+    // after the [
+    regex_set bracket() {
+        regex_set bytes = {{ 0, 0, 0, 0 }};
+
+        const bool negate = i < p.size() && p[i] == '^';
+        if (negate) {
+            ++i;
+        }
+
+        while (true) {
+            if (i >= p.size()) {
+                fail("missing ]");
+                return bytes;
+            }
+            if (p[i] == ']') {
+                ++i;
+                break;
+            }
+
+            regex_set item = {{ 0, 0, 0, 0 }};
+            const int lo = class_item(item);
+            if (!err.empty()) {
+                return bytes;
+            }
+
+            if (i + 1 < p.size() && p[i] == '-' && p[i + 1] != ']') {
+                ++i;
+                const int hi = class_item(item);
+                if (lo < 0 || hi < lo) {
+                    fail("invalid class range");
+                    return bytes;
+                }
+                for (int c = lo; c <= hi; ++c) {
+                    regex_set_add(bytes, c);
+                }
+            } else if (lo >= 0) {
+                regex_set_add(bytes, lo);
+            } else {
+                for (int k = 0; k < 4; ++k) {
+                    bytes[k] |= item[k];
+                }
+            }
+        }
+
+        return negate ? regex_set_not(bytes) : bytes;
+    }
+
+    frag atom() {
+        if (i >= p.size()) {
+            fail("unexpected end of the pattern");
+            return {};
+        }
+
+        const char c = p[i++];
+        switch (c) {
+            case '(':
+                {
+                    if (p.compare(i, 2, "?:") == 0) {
+                        i += 2;
+                    }
+                    const frag f = alternation();
+                    if (err.empty() && (i >= p.size() || p[i] != ')')) {
+                        fail("missing )");
+                    }
+                    ++i;
+                    return f;
+                }
+            case '[':
+                return edge(bracket());
+            case '.':
+                {
+                    regex_set bytes = {{ 0, 0, 0, 0 }};
+                    regex_set_add(bytes, '\n');
+                    return edge(regex_set_not(bytes));
+                }
+            case '\\':
+                return edge(escape());
+            case '*': case '+': case '?': case '{':
+                --i;
+                fail("nothing to repeat");
+                return {};
+            case '^': case '$':
+                --i;
+                fail("^ and $ are only supported at the ends of the pattern");
+                return {};
+            default:
+                {
+                    regex_set bytes = {{ 0, 0, 0, 0 }};
+                    regex_set_add(bytes, (unsigned char) c);
+                    return edge(bytes);
+                }
+        }
+    }
+
+    // an atom parsed again at i_atom
+    frag copy(size_t i_atom) {
+        const size_t i_end = i;
+        i = i_atom;
+        const frag f = atom();
+        i = i_end;
+        return f;
+    }
+
+    int number() {
+        int n = 0;
+        if (i >= p.size() || !isdigit((unsigned char) p[i])) {
+            fail("invalid {n,m}");
+            return 0;
+        }
+        while (i < p.size() && isdigit((unsigned char) p[i])) {
+            n = std::min(10*n + (p[i++] - '0'), max_repeat + 1);
+        }
+        return n;
+    }
+
+    frag repeat() {
+        const size_t i_atom = i;
+
+        frag f = atom();
+        if (!err.empty() || i >= p.size()) {
+            return f;
+        }
+
+        switch (p[i]) {
+            case '*': ++i; f = star(f); break;
+            case '+': ++i; f = plus(f); break;
+            case '?': ++i; f = opt(f);  break;
+            case '{':
+                {
+                    ++i;
+                    const int n_min = number();
+                    int n_max = n_min;
+                    if (err.empty() && i < p.size() && p[i] == ',') {
+                        ++i;
+                        n_max = i < p.size() && p[i] == '}' ? -1 : number();
+                    }
+                    if (err.empty() && (i >= p.size() || p[i] != '}')) {
+                        fail("invalid {n,m}");
+                    }
+                    if (!err.empty()) {
+                        return f;
+                    }
+                    ++i;
+                    if (n_min > max_repeat || n_max > max_repeat || (n_max >= 0 && n_max < n_min)) {
+                        fail("invalid {n,m}, up to " + std::to_string(max_repeat));
+                        return f;
+                    }
+
+                    frag r = empty();
+                    for (int k = 0; k < n_min; ++k) {
+                        r = concat(r, k == 0 ? f : copy(i_atom));
+                    }
+                    if (n_max < 0) {
+                        r = concat(r, star(n_min == 0 ? f : copy(i_atom)));
+                    }
+                    for (int k = n_min; k < n_max; ++k) {
+                        r = concat(r, opt(k == 0 ? f : copy(i_atom)));
+                    }
+                    f = r;
+                } break;
+            default:
+                return f;
+        }
+
+        if (i < p.size() && (p[i] == '*' || p[i] == '+' || p[i] == '?' || p[i] == '{')) {
+            fail("multiple repeat");
+        }
+
+        return f;
+    }
+
+    frag concatenation() {
+        frag f = empty();
+        while (err.empty() && i < p.size() && p[i] != '|' && p[i] != ')') {
+            f = concat(f, repeat());
+        }
+        return f;
+    }
+
+    frag alternation() {
+        frag f = concatenation();
+        while (err.empty() && i < p.size() && p[i] == '|') {
+            ++i;
+            f = alt(f, concatenation());
+        }
+        return f;
+    }
+};
+
+bool bloom_grammar_init(
+        bloom_grammar & grammar,
+        const std::string & pattern,
+        const bloom_token_trie & trie,
+        const std::vector<gpt_vocab::id> & eos_ids,
+        std::string & err) {
+    static const int max_states = 1 << 14;
+
+    grammar.pattern = pattern;
+    grammar.trie    = &trie;
+    grammar.eos_ids = eos_ids;
+
+    // the anchors at the ends do not change the match of the whole text
+    size_t b = 0;
+    size_t e = pattern.size();
+    if (b < e && pattern[b] == '^') {
+        ++b;
+    }
+    if (b < e && pattern[e - 1] == '$') {
+        size_t n_backslash = 0;
+        while (e - 1 - n_backslash > b && pattern[e - 2 - n_backslash] == '\\') {
+            ++n_backslash;
+        }
+        if (n_backslash % 2 == 0) {
+            --e;
+        }
+    }
+
+    const std::string body = pattern.substr(b, e - b);
+
+    regex_parser parser(body);
+    const regex_parser::frag f = parser.alternation();
+    if (parser.err.empty() && parser.i < body.size()) {
+        parser.fail("unmatched )");
+    }
+    if (!parser.err.empty()) {
+        err = parser.err;
+        return false;
+    }
+
+    // the DFA by the subset construction, a state for each epsilon closure of NFA states
+    const int n_nfa = parser.out.size();
+
+    std::vector<uint8_t> in(n_nfa, 0);
+    std::vector<int32_t> set;
+
+    auto add = [&](int32_t s) {
+        if (!in[s]) {
+            in[s] = 1;
+            set.push_back(s);
+        }
+    };
+    auto close = [&]() {
+        for (size_t k = 0; k < set.size(); ++k) {
+            for (int32_t t : parser.eps[set[k]]) {
+                add(t);
+            }
+        }
+        for (int32_t t : set) {
+            in[t] = 0;
+        }
+        std::sort(set.begin(), set.end());
+    };
+
+    std::map<std::vector<int32_t>, int32_t> index;
+    std::vector<std::vector<int32_t>> states;
+
+    add(f.start);
+    close();
+    index[set] = 0;
+    states.push_back(set);
+
+    std::vector<int32_t> & next   = grammar.next;
+    std::vector<uint8_t> & accept = grammar.accept;
+    next.clear();
+    accept.clear();
+
+    std::vector<int32_t> move_prev;
+    for (size_t k = 0; k < states.size(); ++k) {
+        const std::vector<int32_t> cur = states[k];
+
+        accept.push_back(std::binary_search(cur.begin(), cur.end(), f.end));
+        next.resize(256*(k + 1), -1);
+
+        // the neighbour bytes mostly move the same, e.g. in a class
+        move_prev.clear();
+        int32_t target_prev = -1;
+
+        for (int c = 0; c < 256; ++c) {
+            set.clear();
+            for (int32_t s : cur) {
+                if (parser.out[s] >= 0 && regex_set_has(parser.set[s], c)) {
+                    add(parser.out[s]);
+                }
+            }
+
+            if (c > 0 && set == move_prev) {
+                for (int32_t t : set) {
+                    in[t] = 0;
+                }
+                next[256*k + c] = target_prev;
+                continue;
+            }
+            move_prev = set;
+
+            int32_t target = -1;
+            if (!set.empty()) {
+                close();
+
+                const auto it = index.find(set);
+                if (it != index.end()) {
+                    target = it->second;
+                } else {
+                    if ((int) states.size() >= max_states) {
+                        err = "the pattern needs more than " + std::to_string(max_states) + " DFA states";
+                        return false;
+                    }
+                    target = states.size();
+                    index[set] = target;
+                    states.push_back(set);
+                }
+            }
+
+            next[256*k + c] = target;
+            target_prev = target;
+        }
+    }
+
+    // the states from which a match can still be completed, backwards from the accepting ones
+    const int n_states = states.size();
+
+    std::vector<std::vector<int32_t>> prev(n_states);
+    for (int k = 0; k < n_states; ++k) {
+        for (int c = 0; c < 256; ++c) {
+            const int32_t t = next[256*k + c];
+            if (t >= 0 && (prev[t].empty() || prev[t].back() != k)) {
+                prev[t].push_back(k);
+            }
+        }
+    }
+
+    std::vector<uint8_t> live(accept);
+    std::vector<int32_t> queue;
+    for (int k = 0; k < n_states; ++k) {
+        if (live[k]) {
+            queue.push_back(k);
+        }
+    }
+    for (size_t iq = 0; iq < queue.size(); ++iq) {
+        for (int32_t k : prev[queue[iq]]) {
+            if (!live[k]) {
+                live[k] = 1;
+                queue.push_back(k);
+            }
+        }
+    }
+
+    if (!live[0]) {
+        err = "the pattern matches nothing";
+        return false;
+    }
+
+    for (auto & t : next) {
+        if (t >= 0 && !live[t]) {
+            t = -1;
+        }
+    }
+
+    grammar.masks.assign(n_states, bloom_token_mask());
+
+    return true;
+}
+
+const bloom_token_mask & bloom_grammar_mask(bloom_grammar & grammar, int32_t state) {
+    bloom_token_mask & mask = grammar.masks[state];
+    if (mask.n_allowed >= 0) {
+        return mask;
+    }
+
+    const bloom_token_trie & trie = *grammar.trie;
+
+    mask.bits.assign((trie.n_vocab + 31)/32, 0);
+
+    // depth first along the DFA, states[d] is the state after the first d bytes of the node
+    std::vector<int32_t> states(1, state);
+
+    const int32_t n_nodes = trie.byte.size();
+    for (int32_t i = 1; i < n_nodes; ) {
+        const int d = trie.depth[i];
+
+        const int32_t s = grammar.next[256*states[d - 1] + trie.byte[i]];
+        if (s < 0) {
+            // no token with these first bytes
+            i = trie.end[i];
+            continue;
+        }
+
+        if ((int) states.size() <= d) {
+            states.resize(d + 1);
+        }
+        states[d] = s;
+
+        for (int32_t j = trie.ids_begin[i]; j < trie.ids_begin[i + 1]; ++j) {
+            const gpt_vocab::id id = trie.ids[j];
+            mask.bits[id/32] |= 1u << (id%32);
+        }
+
+        ++i;
+    }
+
+    // the end of text tokens end the match instead of adding their bytes
+    for (const auto & id : grammar.eos_ids) {
+        if (id < 0 || id >= trie.n_vocab) {
+            continue;
+        }
+        mask.bits[id/32] &= ~(1u << (id%32));
+        if (grammar.accept[state]) {
+            mask.bits[id/32] |= 1u << (id%32);
+        }
+    }
+
+    int n_allowed = 0;
+    for (const auto & w : mask.bits) {
+        for (uint32_t v = w; v != 0; v &= v - 1) {
+            ++n_allowed;
+        }
+    }
+
+    mask.ids.clear();
+    if (n_allowed <= std::max(trie.n_vocab/32, 1)) {
+        for (gpt_vocab::id id = 0; id < trie.n_vocab; ++id) {
+            if (mask.bits[id/32] & (1u << (id%32))) {
+                mask.ids.push_back(id);
+            }
+        }
+    }
+
+    mask.n_allowed = n_allowed;
+
+    return mask;
+}
+
+gpt_vocab::id bloom_grammar_forced(bloom_grammar & grammar, int32_t state) {
+    const bloom_token_mask & mask = bloom_grammar_mask(grammar, state);
+
+    return mask.n_allowed == 1 ? mask.ids[0] : -1;
+}
+
+int32_t bloom_grammar_next(const bloom_grammar & grammar, int32_t state, const gpt_vocab & vocab, gpt_vocab::id id) {
+    if (std::find(grammar.eos_ids.begin(), grammar.eos_ids.end(), id) != grammar.eos_ids.end()) {
+        return state;
+    }
+
+    const auto it = vocab.id_to_token.find(id);
+    if (it == vocab.id_to_token.end()) {
+        return -1;
+    }
+
+    for (unsigned char c : it->second) {
+        state = grammar.next[256*state + c];
+        if (state < 0) {
+            return -1;
+        }
+    }
+
+    return state;
+}
 
 size_t ggml_quantize_q4_0(float * src, void * dst, int64_t n, int64_t k, int qk, int64_t * hist) {
     const int64_t nb = k / qk;
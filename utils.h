@@ -15,6 +15,10 @@
 struct gpt_params {
     int32_t seed      = -1; // RNG seed
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t n_threads_decode = 0; // threads of the single token evals, 0 for n_threads, -1 to calibrate it
+
+    std::vector<int> cpus;        // CPUs of the compute threads of the prompt evals, thread i on CPU i if empty
+    std::vector<int> cpus_decode; // the same for the single token evals
     int32_t n_predict = 128; // new tokens to predict
     int32_t repeat_last_n = 64;  // last n tokens to penalize
 
@@ -24,14 +28,34 @@ struct gpt_params {
     float   temp  = 0.80f;
     float   repeat_penalty  = 1.30f;
 
-    int32_t n_batch = 8; // batch size for prompt processing
+    int32_t n_batch = 0; // batch size for prompt processing, 0 to pick it with bloom_tune_n_batch
 
     std::string model = "models/lamma-7B/ggml-model.bin"; // model path
     std::string prompt;
+    int32_t n_ctx = 512; // context size, the kv cache holds the tokens of all the turns
+
+    bool interactive = false;            // wait for the next user text on stdin when the model is done
+    std::vector<std::string> antiprompt; // reverse prompts, the generation stops at the token that completes one of them
+    std::vector<int> eos_ids = { 2 };    // the generation stops after any of these tokens
+    std::string regex;                   // the generated text is a match of this pattern, see bloom_grammar
+
+    bool        profile = false; // print the time per op, layer and sub-block
+    std::string profile_json;    // write the profile as JSON to this file
+    bool        profile_hwc = false; // add hardware counters to the profile
+    std::string trace;           // write a Chrome trace of the graph execution to this file
+
+    bool        mem_report = false; // print the memory used by the weights, kv cache, compute buffer, vocab and process
+    std::string mem_report_json;    // write the memory report as JSON to this file
 };
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params);
 
+// parse a list of CPUs like "0-7,16,18", false if it is not one
+bool gpt_parse_cpus(const std::string & list, std::vector<int> & cpus);
+
+// parse a list of token ids, with the syntax of gpt_parse_cpus
+bool gpt_parse_ids(const std::string & list, std::vector<int> & ids);
+
 void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 std::string gpt_random_prompt(std::mt19937 & rng);
@@ -90,16 +114,132 @@ gpt_vocab::id gpt_sample_top_k_top_p(
         double temp,
         std::mt19937 & rng);
 
+struct bloom_token_mask;
+
+// the buffers of bloom_sample_top_p, kept by the caller so that the calls after the first one do not allocate
+struct bloom_sampler_buf {
+    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
+    std::vector<double> probs;
+
+    // the tokens of last_n_tokens seen so far in the call, cleared before it returns
+    std::vector<uint8_t> seen;
+};
+
+// last_n_tokens is a set, their order does not matter - a ring buffer can be passed as is. With a mask, only the tokens it
+// allows are sampled, it must allow at least one.
 gpt_vocab::id bloom_sample_top_p(
         const gpt_vocab & vocab,
         const float * logits,
-        std::vector<gpt_vocab::id> & last_n_tokens,
+        const std::vector<gpt_vocab::id> & last_n_tokens,
+        double repeat_penalty,
+        double top_p,
+        int top_k,
+        double temp,
+        std::mt19937 & rng,
+        bloom_sampler_buf & buf,
+        const bloom_token_mask * mask = nullptr);
+
+gpt_vocab::id bloom_sample_top_p(
+        const gpt_vocab & vocab,
+        const float * logits,
+        const std::vector<gpt_vocab::id> & last_n_tokens,
         double repeat_penalty,
         double top_p,
         int top_k,
         double temp,
         std::mt19937 & rng);
 
+// incremental matching of stop strings in the generated text - an Aho-Corasick automaton over the bytes
+//
+// The text is fed token by token, the state carries the partial matches over the token boundaries, so a stop string
+// is found on the token that completes it at O(1) per byte. After a feed, the last depth[state] bytes of the text may
+// be the start of a stop string: a stream holds them back until the next tokens decide.
+struct bloom_stop_matcher {
+    std::vector<std::string> stops;
+
+    std::vector<int32_t> next;  // 256 transitions per state, state 0 is the empty prefix
+    std::vector<int32_t> depth; // the length of the prefix of a stop string the state stands for
+    std::vector<int32_t> match; // the longest stop string that ends at the state, -1 for none
+
+    int32_t state = 0;
+};
+
+// build the automaton of the non-empty stop strings, the state is reset
+void bloom_stop_matcher_init(bloom_stop_matcher & matcher, const std::vector<std::string> & stops);
+
+// back to the start of the text
+void bloom_stop_matcher_reset(bloom_stop_matcher & matcher);
+
+// feed the next n bytes of the text - returns the number of them up to the end of the first stop string that ends in
+// them, with its index in i_stop, or -1 if none does
+int bloom_stop_matcher_feed(bloom_stop_matcher & matcher, const char * text, size_t n, int & i_stop);
+
+// the number of bytes at the end of the text fed so far that may start a stop string
+int bloom_stop_matcher_held(const bloom_stop_matcher & matcher);
+
+// the bytes of the tokens as a trie, the nodes in depth-first order: the subtree of node i is [i, end[i]), node 0 is the
+// empty string
+struct bloom_token_trie {
+    int32_t n_vocab = 0;
+
+    std::vector<uint8_t>  byte;  // of the edge from the parent
+    std::vector<uint16_t> depth;
+    std::vector<int32_t>  end;
+
+    // the tokens of node i are ids[ids_begin[i]:ids_begin[i + 1]], several ids may have the same bytes
+    std::vector<int32_t>       ids_begin;
+    std::vector<gpt_vocab::id> ids;
+};
+
+void bloom_token_trie_init(bloom_token_trie & trie, const gpt_vocab & vocab);
+
+// the tokens allowed in a state of a grammar
+struct bloom_token_mask {
+    int32_t n_allowed = -1; // -1 until it is computed
+
+    std::vector<uint32_t>      bits; // bit id%32 of bits[id/32]
+    std::vector<gpt_vocab::id> ids;  // the allowed tokens in order, when they are few
+};
+
+// constrained decoding - the generated text is a match of a regular expression
+//
+// The pattern is compiled to a DFA over the bytes, and the transitions to the states from which no match can be
+// completed are removed. The mask of a state holds the tokens whose bytes lead to a state that is left, found by walking
+// the trie of the vocab along the DFA and skipping the subtrees that fail, and the end of text tokens if the state
+// accepts. It is computed on the first use of the state and cached with the grammar, so a constrained sampling step
+// costs a lookup. A state that allows a single token does not need the logits at all.
+//
+// The syntax is a subset of ECMAScript: literals, ., [] classes with ranges, \d \w \s and their negations, groups,
+// | and the * + ? {n} {n,} {n,m} quantifiers. The pattern matches the whole text, ^ and $ at its ends are optional.
+// The classes and . are of bytes, . matches any but '\n'.
+struct bloom_grammar {
+    std::string pattern;
+
+    const bloom_token_trie *   trie = nullptr;
+    std::vector<gpt_vocab::id> eos_ids;
+
+    std::vector<int32_t> next;   // 256 transitions per state, -1 when no match can follow, state 0 is the start
+    std::vector<uint8_t> accept; // the text up to the state is a match
+
+    std::vector<bloom_token_mask> masks;
+};
+
+// false with the reason in err if the pattern is not valid or too large
+bool bloom_grammar_init(
+        bloom_grammar & grammar,
+        const std::string & pattern,
+        const bloom_token_trie & trie,
+        const std::vector<gpt_vocab::id> & eos_ids,
+        std::string & err);
+
+const bloom_token_mask & bloom_grammar_mask(bloom_grammar & grammar, int32_t state);
+
+// the only token the state allows, -1 if there are several or none
+gpt_vocab::id bloom_grammar_forced(bloom_grammar & grammar, int32_t state);
+
+// the state after the bytes of the token, -1 if they leave the grammar - the end of text tokens keep the state
+int32_t bloom_grammar_next(const bloom_grammar & grammar, int32_t state, const gpt_vocab & vocab, gpt_vocab::id id);
+
 //
 // Quantization
 //